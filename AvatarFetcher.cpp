@@ -0,0 +1,403 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "AvatarFetcher.h"
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtEndian>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "RenderTrace.h"
+#ifdef STICKER_HAVE_QTNETWORK
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QThread>
+#include <QTimer>
+#include <QUrl>
+#endif
+
+namespace
+{
+// what's at the start of every file in the disk cache, then the length of the JSON that describes it as a
+// little-endian uint32, then that JSON, then the picture
+constexpr char diskMagic[4] = {'S', 'T', 'K', 'A'};
+constexpr int diskHeaderSize = 8;
+
+// how long a copy is good for when the server doesn't say
+constexpr qint64 defaultFreshMs = 60 * 60 * 1000;
+
+QString directory;
+qint64 maxDiskBytes = 0;
+int timeoutMs = 1500;
+
+std::atomic<qint64> writtenSinceTrim{0};
+std::mutex trimMutex;
+std::atomic<quint64> temporaries{0};
+
+std::atomic<quint64> unchanged{0};
+std::atomic<quint64> downloaded{0};
+
+// downloads under way, by URL, and when whoever started them stops waiting
+struct Flight
+{
+    std::shared_future<RemoteAvatar> result;
+    std::chrono::steady_clock::time_point deadline;
+};
+std::mutex flightMutex;
+std::map<QString, Flight> flights;
+
+QByteArray versionOf(const QByteArray &bytes)
+{
+    return QCryptographicHash::hash(bytes, QCryptographicHash::Sha256).toHex().left(16);
+}
+
+#ifdef STICKER_HAVE_QTNETWORK
+// the download itself gets longer than anyone waits for it, so a slow avatar still makes it for the next sticker
+constexpr int networkTimeoutMs = 10000;
+
+// nobody's avatar is this big, but a URL can point at anything
+constexpr qint64 maxAvatarBytes = 4 * 1024 * 1024;
+
+QThread *networkThread = nullptr;
+
+// Qt's on its way out, so anything still downloading can stop now
+void stopNetwork()
+{
+    networkThread->quit();
+    networkThread->wait();
+}
+
+// one thread, with its own event loop, for every download. The manager lives there and is only touched there
+QNetworkAccessManager *network()
+{
+    static auto *manager = [] {
+        networkThread = new QThread;
+        networkThread->setObjectName(QStringLiteral("avatars"));
+        auto *manager = new QNetworkAccessManager;
+        manager->moveToThread(networkThread);
+        networkThread->start();
+        qAddPostRoutine(stopNetwork);
+        return manager;
+    }();
+    return manager;
+}
+
+// how long the server says we can use what it sent without asking again
+qint64 freshFor(const QNetworkReply *reply)
+{
+    const auto control = reply->rawHeader("Cache-Control").toLower();
+    if (control.contains("no-cache") || control.contains("no-store")) {
+        return 0;
+    }
+    if (const auto at = control.indexOf("max-age="); at >= 0) {
+        auto end = at + 8;
+        while (end < control.size() && control[end] >= '0' && control[end] <= '9') {
+            ++end;
+        }
+        return control.mid(at + 8, end - at - 8).toLongLong() * 1000;
+    }
+    return defaultFreshMs;
+}
+#endif
+}
+
+bool RemoteAvatar::fresh() const
+{
+    return !bytes.isEmpty() && QDateTime::currentMSecsSinceEpoch() < freshUntil;
+}
+
+bool AvatarFetcher::isUrl(const QString &avatar)
+{
+    return avatar.startsWith(QLatin1String("https://"), Qt::CaseInsensitive)
+        || avatar.startsWith(QLatin1String("http://"), Qt::CaseInsensitive);
+}
+
+bool AvatarFetcher::available()
+{
+#ifdef STICKER_HAVE_QTNETWORK
+    return true;
+#else
+    return false;
+#endif
+}
+
+void AvatarFetcher::setDirectory(const QString &path, const qint64 maxMiB)
+{
+    directory = path;
+    maxDiskBytes = qMax<qint64>(maxMiB, 1) * 1024 * 1024;
+    if (!directory.isEmpty()) {
+        QDir().mkpath(directory);
+    }
+}
+
+void AvatarFetcher::setTimeout(const int ms)
+{
+    timeoutMs = qMax(ms, 0);
+}
+
+void AvatarFetcher::prefetch(const QString &url)
+{
+    RemoteAvatar avatar;
+    if (cached(url, avatar) && avatar.fresh()) {
+        return;
+    }
+
+    std::shared_ptr<std::promise<RemoteAvatar>> promise;
+    {
+        std::lock_guard<std::mutex> lock(flightMutex);
+        if (flights.count(url)) {
+            return;
+        }
+        promise = std::make_shared<std::promise<RemoteAvatar>>();
+        flights.emplace(url, Flight{promise->get_future().share(),
+                                    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs)});
+    }
+    // whatever happens, the flight's over and everyone waiting gets `result`
+    const auto land = [url, promise](const RemoteAvatar &result) {
+        promise->set_value(result);
+        std::lock_guard<std::mutex> lock(flightMutex);
+        flights.erase(url);
+    };
+
+#ifdef STICKER_HAVE_QTNETWORK
+    auto *manager = network();
+    QMetaObject::invokeMethod(manager, [manager, url, stale = avatar, land] {
+        QNetworkRequest request{QUrl(url)};
+        request.setAttribute(QNetworkRequest::RedirectPolicyAttribute, QNetworkRequest::NoLessSafeRedirectPolicy);
+        // only ask for the picture if it's changed since the copy we've got
+        if (!stale.etag.isEmpty()) {
+            request.setRawHeader("If-None-Match", stale.etag);
+        }
+        if (!stale.lastModified.isEmpty()) {
+            request.setRawHeader("If-Modified-Since", stale.lastModified);
+        }
+        auto *reply = manager->get(request);
+        QTimer::singleShot(networkTimeoutMs, reply, [reply] { reply->abort(); });
+        QObject::connect(reply, &QNetworkReply::downloadProgress, reply, [reply](const qint64 received, qint64) {
+            if (received > maxAvatarBytes) {
+                reply->abort();
+            }
+        });
+        QObject::connect(reply, &QNetworkReply::finished, reply, [url, stale, land, reply] {
+            reply->deleteLater();
+            const auto status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+            auto result = stale;
+            if (status == 304 && !stale.bytes.isEmpty()) {
+                ++unchanged;
+                result.freshUntil = QDateTime::currentMSecsSinceEpoch() + freshFor(reply);
+                if (const auto etag = reply->rawHeader("ETag"); !etag.isEmpty()) {
+                    result.etag = etag;
+                }
+                store(url, result);
+            } else if (reply->error() == QNetworkReply::NoError && status == 200) {
+                ++downloaded;
+                const auto bytes = reply->readAll();
+                if (!bytes.isEmpty()) {
+                    result.bytes = bytes;
+                    result.version = versionOf(bytes);
+                    result.etag = reply->rawHeader("ETag");
+                    result.lastModified = reply->rawHeader("Last-Modified");
+                    result.freshUntil = QDateTime::currentMSecsSinceEpoch() + freshFor(reply);
+                    store(url, result);
+                }
+            } else {
+                // the old copy (if any) is still better than nothing, but it's no fresher than it was
+                ++downloaded;
+            }
+            land(result);
+        });
+    }, Qt::QueuedConnection);
+#else
+    land(avatar);
+#endif
+}
+
+RemoteAvatar AvatarFetcher::get(const QString &url)
+{
+    RemoteAvatar avatar;
+    if (cached(url, avatar) && avatar.fresh()) {
+        ++unchanged;
+        return avatar;
+    }
+
+    prefetch(url);
+    Flight flight;
+    {
+        std::lock_guard<std::mutex> lock(flightMutex);
+        const auto found = flights.find(url);
+        if (found == flights.end()) {
+            // it landed in between, so it's in memory now
+            cached(url, avatar);
+            return avatar;
+        }
+        flight = found->second;
+    }
+    if (flight.result.wait_until(flight.deadline) == std::future_status::ready) {
+        return flight.result.get();
+    }
+    RenderTrace::count("avatarTimeouts");
+    return avatar;
+}
+
+QByteArray AvatarFetcher::freshVersion(const QString &url)
+{
+    RemoteAvatar avatar;
+    if (cached(url, avatar) && avatar.fresh()) {
+        return avatar.version;
+    }
+    return {};
+}
+
+CacheStats AvatarFetcher::stats()
+{
+    auto stats = memory().stats();
+    stats.hits = unchanged;
+    stats.misses = downloaded;
+    return stats;
+}
+
+bool AvatarFetcher::cached(const QString &url, RemoteAvatar &avatar)
+{
+    if (memory().find(url, avatar)) {
+        return true;
+    }
+    if (directory.isEmpty()) {
+        return false;
+    }
+
+    QFile file(diskPath(url));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const auto bytes = file.readAll();
+    if (bytes.size() < diskHeaderSize || !bytes.startsWith(QByteArray::fromRawData(diskMagic, sizeof(diskMagic)))) {
+        return false;
+    }
+    const auto metaLength = static_cast<int>(qFromLittleEndian<quint32>(bytes.constData() + 4));
+    if (bytes.size() < diskHeaderSize + metaLength) {
+        return false;
+    }
+    const auto meta = QJsonDocument::fromJson(bytes.mid(diskHeaderSize, metaLength)).object();
+    // two URLs could share a file name only if SHA-256 let them, but it costs nothing to check
+    if (meta["url"].toString() != url) {
+        return false;
+    }
+    avatar.bytes = bytes.mid(diskHeaderSize + metaLength);
+    avatar.version = versionOf(avatar.bytes);
+    avatar.etag = meta["etag"].toString().toLatin1();
+    avatar.lastModified = meta["lastModified"].toString().toLatin1();
+    avatar.freshUntil = static_cast<qint64>(meta["freshUntil"].toDouble());
+    memory().insert(url, avatar, static_cast<int>(avatar.bytes.size() / 1024));
+
+    // the modification time is how trimDisk knows what's been used lately
+    file.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+    return true;
+}
+
+void AvatarFetcher::store(const QString &url, const RemoteAvatar &avatar)
+{
+    memory().insert(url, avatar, static_cast<int>(avatar.bytes.size() / 1024));
+    if (directory.isEmpty()) {
+        return;
+    }
+
+    QJsonObject meta;
+    meta["url"] = url;
+    meta["etag"] = QString::fromLatin1(avatar.etag);
+    meta["lastModified"] = QString::fromLatin1(avatar.lastModified);
+    meta["freshUntil"] = static_cast<double>(avatar.freshUntil);
+    const auto json = QJsonDocument(meta).toJson(QJsonDocument::Compact);
+    uchar header[diskHeaderSize];
+    std::copy(std::begin(diskMagic), std::end(diskMagic), header);
+    qToLittleEndian(static_cast<quint32>(json.size()), header + 4);
+
+    // the same dance as RenderCache: somewhere of our own, then renamed into place, so nobody reads half of one
+    const auto target = diskPath(url);
+    const auto temporary = target + QStringLiteral(".%1-%2.tmp")
+                                        .arg(QCoreApplication::applicationPid())
+                                        .arg(++temporaries);
+    QFile file(temporary);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    const auto written = file.write(reinterpret_cast<const char *>(header), diskHeaderSize) == diskHeaderSize
+        && file.write(json) == json.size()
+        && file.write(avatar.bytes) == avatar.bytes.size();
+    file.close();
+    if (!written || std::rename(QFile::encodeName(temporary).constData(), QFile::encodeName(target).constData()) != 0) {
+        QFile::remove(temporary);
+        return;
+    }
+
+    const auto added = diskHeaderSize + json.size() + avatar.bytes.size();
+    if (writtenSinceTrim.fetch_add(added) + added > maxDiskBytes / 16) {
+        writtenSinceTrim = 0;
+        trimDisk();
+    }
+}
+
+QString AvatarFetcher::diskPath(const QString &url)
+{
+    return directory + QLatin1Char('/')
+        + QString::fromLatin1(QCryptographicHash::hash(url.toUtf8(), QCryptographicHash::Sha256).toHex());
+}
+
+void AvatarFetcher::trimDisk()
+{
+    std::unique_lock<std::mutex> lock(trimMutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+
+    struct CachedFile
+    {
+        QString path;
+        qint64 size;
+        qint64 used;
+    };
+    std::vector<CachedFile> files;
+    qint64 total = 0;
+    QDirIterator it(directory, QDir::Files);
+    while (it.hasNext()) {
+        it.next();
+        const auto info = it.fileInfo();
+        files.push_back({info.filePath(), info.size(), info.lastModified().toMSecsSinceEpoch()});
+        total += info.size();
+    }
+    if (total <= maxDiskBytes) {
+        return;
+    }
+
+    std::sort(files.begin(), files.end(), [](const CachedFile &a, const CachedFile &b) { return a.used < b.used; });
+    const auto target = maxDiskBytes / 10 * 9;
+    for (const auto &file : files) {
+        if (total <= target) {
+            break;
+        }
+        if (QFile::remove(file.path)) {
+            total -= file.size;
+        }
+    }
+}
+
+LruCache<RemoteAvatar> &AvatarFetcher::memory()
+{
+    // the pictures as they came, not decoded: StickerGenerator's avatar cache has those
+    static LruCache<RemoteAvatar> cache(8 * 1024);
+    return cache;
+}
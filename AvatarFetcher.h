@@ -0,0 +1,125 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef AVATARFETCHER_H
+#define AVATARFETCHER_H
+
+#include <QByteArray>
+#include <QString>
+#include "LruCache.h"
+
+/*
+ * An avatar that came from a URL, and what we know about how long it's good for
+ */
+struct RemoteAvatar
+{
+    // the picture file, as the server sent it. Empty if we haven't got one
+    QByteArray bytes;
+    // a hash of `bytes`, so caches can tell one picture from another without comparing them
+    QByteArray version;
+    // what the server said to ask it about next time, for a conditional request
+    QByteArray etag;
+    QByteArray lastModified;
+    // milliseconds since the epoch until which we can use it without asking the server
+    qint64 freshUntil = 0;
+
+    bool fresh() const;
+};
+
+/*
+ * Avatars given as http:// or https:// URLs, fetched in the background so they download while the text's being laid
+ * out, rather than the bot having to download every one to /tmp before it asks for a sticker.
+ *
+ * There's a copy in memory and (with a directory set) one on disk, shared with every sticker process pointed at the
+ * same directory, and the least recently used go when it gets too big. A copy is used as it is for as long as the
+ * server's Cache-Control said it could be (an hour if it didn't say); after that it's asked about again with
+ * If-None-Match and If-Modified-Since, so an avatar that hasn't changed doesn't get downloaded again.
+ *
+ * Whoever draws the avatar waits for it, but only so long (1.5s unless told otherwise). Then it's drawn with an
+ * old copy if there is one, and the initials if there isn't. The download carries on for the next sticker's sake.
+ *
+ * Downloads happen on a thread of their own, with a QNetworkAccessManager. It's only started when the first URL turns
+ * up, so it's never around when the prefork supervisor forks. Without QtNetwork at build time, every fetch fails and
+ * URL avatars are always the initials.
+ */
+class AvatarFetcher
+{
+public:
+    /*
+     * @return whether an avatar is a URL for us to fetch, rather than a file
+     */
+    static bool isUrl(const QString &avatar);
+
+    /*
+     * @return whether this build can fetch anything at all
+     */
+    static bool available();
+
+    /*
+     * Turns on the disk cache. Set it up before any stickers are drawn; it's not locked.
+     *
+     * @param path - the directory to keep avatars in. It's created if need be. Empty turns the disk cache off.
+     * @param maxMiB - roughly how big the directory may get before the least recently used avatars go
+     */
+    static void setDirectory(const QString &path, qint64 maxMiB);
+
+    /*
+     * How long `get` waits for a download, in milliseconds. Set it up before any stickers are drawn
+     */
+    static void setTimeout(int ms);
+
+    /*
+     * Starts fetching an avatar, unless we've got a fresh copy or it's already on its way. Doesn't wait.
+     */
+    static void prefetch(const QString &url);
+
+    /*
+     * Gets an avatar, waiting for it to download if need be, but only until the timeout's up (counting from when the
+     * download started, so time spent laying out text while it was on its way counts)
+     *
+     * @return the avatar. If the download didn't finish in time, or failed, whatever copy we had before (which might
+     * be nothing at all)
+     */
+    static RemoteAvatar get(const QString &url);
+
+    /*
+     * For cache keys: which picture a URL stands for right now, without asking the network
+     *
+     * @return the version of a copy we can use as it is, or nothing if we'd have to fetch one
+     */
+    static QByteArray freshVersion(const QString &url);
+
+    /*
+     * @return hits are avatars that didn't need downloading (fresh, or the server said they hadn't changed), misses
+     * are ones that did (or failed to). The rest is the in-memory copies
+     */
+    static CacheStats stats();
+
+private:
+    /*
+     * Looks for a copy in memory, then on disk
+     */
+    static bool cached(const QString &url, RemoteAvatar &avatar);
+
+    /*
+     * Keeps a copy in memory and on disk
+     */
+    static void store(const QString &url, const RemoteAvatar &avatar);
+
+    /*
+     * @return where a URL's copy lives in the disk cache
+     */
+    static QString diskPath(const QString &url);
+
+    /*
+     * Deletes the least recently used avatars until the disk cache is comfortably under its limit
+     */
+    static void trimDisk();
+
+    /*
+     * Avatars, by URL
+     */
+    static LruCache<RemoteAvatar> &memory();
+};
+
+
+#endif //AVATARFETCHER_H
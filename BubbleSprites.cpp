@@ -0,0 +1,217 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "BubbleSprites.h"
+#include <QColor>
+#include <QImage>
+#include <QLinearGradient>
+#include <QPainter>
+#include <QPainterPath>
+#include <algorithm>
+#include <cmath>
+#include "RenderTrace.h"
+
+namespace
+{
+// how much of a pixel, 0-255, an edge `reach` away from where we measure from covers, when the pixel's centre is
+// `distance` away. It's how far the edge is past the pixel's near side, which is right for straight edges and close
+// enough for curves as big as a bubble's corners
+uchar coverage(const qreal reach, const qreal distance)
+{
+    return static_cast<uchar>(std::lround(std::clamp(reach + 0.5 - distance, 0.0, 1.0) * 255));
+}
+
+// a pixel (ramp colour `fill`, outline colour `line`, both opaque) that's `outer` covered, of which `inner` is
+// inside the outline, over whatever's there already
+inline QRgb blend(const QRgb under, const QRgb fill, const QRgb line, const uint outer, const uint inner)
+{
+    if (outer == 255 && inner == 255) {
+        return fill;
+    }
+    const auto rest = 255 - outer;
+    const auto mix = [&](const int shift) {
+        const auto channel = (((fill >> shift) & 0xff) * inner + ((line >> shift) & 0xff) * (outer - inner) + 127) / 255;
+        return qMin<uint>(channel + (((under >> shift) & 0xff) * rest + 127) / 255, 255) << shift;
+    };
+    return qMin<uint>(outer + ((qAlpha(under) * rest + 127) / 255), 255) << 24 | mix(16) | mix(8) | mix(0);
+}
+}
+
+bool BubbleSprites::paint(QPainter *painter, const QRgb colour, const QRectF &rect, const qreal radius)
+{
+    auto *device = painter->device();
+    if (!device || device->devType() != QInternal::Image) {
+        return false;
+    }
+    auto *image = static_cast<QImage *>(device);
+    const auto transform = painter->combinedTransform();
+    if (image->format() != QImage::Format_ARGB32_Premultiplied || transform.type() > QTransform::TxScale
+        || transform.m11() <= 0 || transform.m22() <= 0 || painter->opacity() < 1
+        || painter->compositionMode() != QPainter::CompositionMode_SourceOver) {
+        return false;
+    }
+
+    // everything from here on is in device pixels
+    const auto mapped = transform.mapRect(rect);
+    const auto left = qRound(mapped.left());
+    const auto top = qRound(mapped.top());
+    const auto right = qRound(mapped.right());
+    const auto bottom = qRound(mapped.bottom());
+    const auto width = right - left;
+    const auto height = bottom - top;
+    if (width <= 0 || height <= 0) {
+        return true;
+    }
+    const auto scale = (transform.m11() + transform.m22()) / 2;
+    // paintRoundRect's outline is a 1 pixel pen, before scaling
+    const auto outline = qMax(std::round(scale * 4) / 4, 0.25);
+    const auto cornerRadius = qBound(0, qRound(radius * scale), qMin(width, height) / 2);
+
+    const auto shape = corner(cornerRadius, outline);
+    const auto colours = ramp(colour);
+    const auto line = colour | 0xff000000;
+
+    // the straight part: where the corners aren't
+    const auto coreLeft = left + cornerRadius;
+    const auto coreRight = right - cornerRadius;
+    const auto coreTop = top + cornerRadius;
+    const auto coreBottom = bottom - cornerRadius;
+
+    // everything the outline can reach, within the picture and the clip
+    QRect reach(coreLeft - shape.size, coreTop - shape.size, coreRight - coreLeft + 2 * shape.size,
+                coreBottom - coreTop + 2 * shape.size);
+    reach &= image->rect();
+    if (painter->hasClipping()) {
+        reach &= transform.mapRect(painter->clipBoundingRect()).toAlignedRect();
+    }
+    if (reach.isEmpty()) {
+        return true;
+    }
+
+    // the gradient runs from the bottom left corner to the top right one, so it's a step along for every pixel
+    // right and every pixel up
+    const auto length = static_cast<qreal>(width) * width + static_cast<qreal>(height) * height;
+    const auto stepX = width / length * 255;
+    const auto stepUp = height / length * 255;
+
+    const auto *outer = reinterpret_cast<const uchar *>(shape.outer.constData());
+    const auto *inner = reinterpret_cast<const uchar *>(shape.inner.constData());
+    const auto *edgeOuter = reinterpret_cast<const uchar *>(shape.edgeOuter.constData());
+    const auto *edgeInner = reinterpret_cast<const uchar *>(shape.edgeInner.constData());
+
+    for (auto y = reach.top(); y <= reach.bottom(); ++y) {
+        // how many pixels out from the straight part this row is, or -1 if it's in it
+        const auto j = y < coreTop ? coreTop - 1 - y : y >= coreBottom ? y - coreBottom : -1;
+        auto *pixels = reinterpret_cast<QRgb *>(image->scanLine(y));
+        auto t = (reach.left() + 0.5 - left) * stepX + (bottom - y - 0.5) * stepUp;
+        for (auto x = reach.left(); x <= reach.right(); ++x, t += stepX) {
+            const auto i = x < coreLeft ? coreLeft - 1 - x : x >= coreRight ? x - coreRight : -1;
+            uint covered;
+            uint filled;
+            if (i < 0 && j < 0) {
+                covered = filled = 255;
+            } else if (i < 0 || j < 0) {
+                covered = edgeOuter[qMax(i, j)];
+                filled = edgeInner[qMax(i, j)];
+            } else {
+                covered = outer[j * shape.size + i];
+                filled = inner[j * shape.size + i];
+            }
+            if (covered) {
+                const auto fill = colours[qBound(0, static_cast<int>(t + 0.5), 255)];
+                pixels[x] = blend(pixels[x], fill, line, covered, filled);
+            }
+        }
+    }
+    RenderTrace::count("bubbleSprites");
+    return true;
+}
+
+void BubbleSprites::paintPath(QPainter *painter, const QRgb colour, const QRectF &rect, const qreal radius)
+{
+    painter->save();
+    painter->setRenderHint(QPainter::Antialiasing);
+    painter->setPen(colour);
+
+    // now we create our rounded rect as a PATH
+    QPainterPath path;
+    path.addRoundedRect(rect, radius, radius);
+
+    // and boingo, draw the path, job done
+    const QColor base(colour);
+    const QColor light = base.lighter(150);
+    const QColor dark = base.darker(0);
+    QLinearGradient grad(rect.bottomLeft(), rect.topRight());
+    grad.setColorAt(0.0, light);
+    grad.setColorAt(1.0, dark);
+    painter->fillPath(path, grad);
+    painter->drawPath(path);
+    painter->restore();
+}
+
+CacheStats BubbleSprites::cornerStats()
+{
+    return cornerCache().stats();
+}
+
+BubbleSprites::Corner BubbleSprites::corner(const int radius, const qreal outline)
+{
+    const auto key = QStringLiteral("%1|%2").arg(radius).arg(outline);
+    Corner shape;
+    if (cornerCache().find(key, shape)) {
+        return shape;
+    }
+
+    // the outline's centred on the edge, like a pen's, so it reaches half its width either side
+    const auto outerReach = radius + outline / 2;
+    const auto innerReach = radius - outline / 2;
+    shape.size = radius + static_cast<int>(std::ceil(outline / 2 + 0.5));
+    shape.outer.resize(shape.size * shape.size);
+    shape.inner.resize(shape.size * shape.size);
+    shape.edgeOuter.resize(shape.size);
+    shape.edgeInner.resize(shape.size);
+    for (auto j = 0; j < shape.size; ++j) {
+        for (auto i = 0; i < shape.size; ++i) {
+            const auto distance = std::hypot(i + 0.5, j + 0.5);
+            shape.outer[j * shape.size + i] = static_cast<char>(coverage(outerReach, distance));
+            shape.inner[j * shape.size + i] = static_cast<char>(coverage(innerReach, distance));
+        }
+        shape.edgeOuter[j] = static_cast<char>(coverage(outerReach, j + 0.5));
+        shape.edgeInner[j] = static_cast<char>(coverage(innerReach, j + 0.5));
+    }
+    cornerCache().insert(key, shape, shape.size * (shape.size + 1) * 2 / 1024);
+    return shape;
+}
+
+QVector<QRgb> BubbleSprites::ramp(const QRgb colour)
+{
+    const auto key = QString::number(colour & 0xffffff, 16);
+    QVector<QRgb> colours;
+    if (rampCache().find(key, colours)) {
+        return colours;
+    }
+
+    // the same two stops paintRoundRect gives its QLinearGradient
+    const QColor dark(colour);
+    const QColor light = dark.lighter(150);
+    colours.resize(256);
+    for (auto i = 0; i < 256; ++i) {
+        const auto mix = [i](const int from, const int to) { return (from * (255 - i) + to * i + 127) / 255; };
+        colours[i] = qRgb(mix(light.red(), dark.red()), mix(light.green(), dark.green()), mix(light.blue(), dark.blue()));
+    }
+    rampCache().insert(key, colours, 1);
+    return colours;
+}
+
+LruCache<BubbleSprites::Corner> &BubbleSprites::cornerCache()
+{
+    // a corner at scale 3 is a few tens of KiB, and there's one per radius stickers come out at
+    static LruCache<Corner> cache(2 * 1024);
+    return cache;
+}
+
+LruCache<QVector<QRgb>> &BubbleSprites::rampCache()
+{
+    static LruCache<QVector<QRgb>> cache(256);
+    return cache;
+}
@@ -0,0 +1,88 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef BUBBLESPRITES_H
+#define BUBBLESPRITES_H
+
+#include <QByteArray>
+#include <QRectF>
+#include <QRgb>
+#include <QVector>
+#include "LruCache.h"
+
+class QPainter;
+
+/*
+ * Paints the bubbles behind messages (a rounded rect with a diagonal gradient and an outline, see
+ * StickerGenerator::paintRoundRect) without filling and stroking a path every time.
+ *
+ * What's expensive about the path is the antialiasing, and that's only at the edges. So how much of each pixel is
+ * covered near a corner is worked out once per corner radius and outline width and kept (a "sprite"), and so is the
+ * gradient's colour ramp, once per colour. A bubble of any size is then put together from them: corners from the
+ * sprite, straight edges from its profile, and the inside as plain runs of ramp colours. Nothing is rasterised, so
+ * the time it takes goes with the bubble's edge, plus writing the pixels inside once.
+ *
+ * It paints straight into the picture the painter is painting on, in device pixels, with the rect snapped to whole
+ * ones and the corner radius rounded to one. That's within a pixel of the path, at the edges only, which
+ * sticker_bench --bubbles checks.
+ */
+class BubbleSprites
+{
+public:
+    /*
+     * Paints a bubble, if it can. It can when the painter is on an ARGB32_Premultiplied picture, with no more than a
+     * scale and a translation, SourceOver and full opacity; which is how StickerGenerator paints.
+     *
+     * @param painter - what to paint with, transform and all
+     * @param colour - the bubble's colour. The gradient goes from lighter, bottom left, to this, top right.
+     * @param rect - where the bubble goes, in the painter's coordinates
+     * @param radius - the corners' radius, in the painter's coordinates
+     *
+     * @return false if it couldn't, and nothing was painted
+     */
+    static bool paint(QPainter *painter, QRgb colour, const QRectF &rect, qreal radius);
+
+    /*
+     * Paints a bubble the slow way, filling and stroking a path, with any painter at all. It's what `paint` stands in
+     * for, so it's what `paint` is checked against (see sticker_bench --bubbles). Same parameters.
+     */
+    static void paintPath(QPainter *painter, QRgb colour, const QRectF &rect, qreal radius);
+
+    /*
+     * @return how the corner cache has been doing
+     */
+    static CacheStats cornerStats();
+
+private:
+    /*
+     * How much of each pixel a corner covers. The outer shape is the bubble and its outline, the inner shape is the
+     * gradient's, inside the outline; both 0-255.
+     */
+    struct Corner
+    {
+        // how many pixels out from the straight part of the bubble anything is covered, either way
+        int size = 0;
+        // size * size, row by row, outwards from where the straight edges stop
+        QByteArray outer;
+        QByteArray inner;
+        // a straight edge's, outwards from where the corners start
+        QByteArray edgeOuter;
+        QByteArray edgeInner;
+    };
+
+    /*
+     * @param radius - in device pixels
+     * @param outline - the outline's width, in device pixels, to a quarter of one
+     */
+    static Corner corner(int radius, qreal outline);
+
+    /*
+     * @return the gradient from lighter to `colour`, in 256 steps
+     */
+    static QVector<QRgb> ramp(QRgb colour);
+
+    static LruCache<Corner> &cornerCache();
+    static LruCache<QVector<QRgb>> &rampCache();
+};
+
+
+#endif //BUBBLESPRITES_H
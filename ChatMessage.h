@@ -17,6 +17,8 @@
 struct ChatMessage
 {
 
+ChatMessage() = default;
+
 ChatMessage(QList<Entity> ents, ChatUser frm, const QString &txt)
     {
         from = std::move(frm);
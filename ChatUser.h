@@ -13,7 +13,7 @@ struct ChatUser
 {
     // literally the name as it's displayed on screen
     QString name = "";
-    // URI to user's avatar - technically should be a QUrl, maybe
+    // the user's avatar: a local file, or an http(s) URL for AvatarFetcher to get
     QString avatar = "";
 
     QString first_name = "";
@@ -0,0 +1,63 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "CircleClip.h"
+#include <QRgb>
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+// every channel of a premultiplied pixel times alpha/255, two channels at a time, rounded
+inline QRgb multiply(const QRgb pixel, const uint alpha)
+{
+    auto redBlue = (pixel & 0xff00ff) * alpha;
+    redBlue = ((redBlue + ((redBlue >> 8) & 0xff00ff) + 0x800080) >> 8) & 0xff00ff;
+    auto alphaGreen = ((pixel >> 8) & 0xff00ff) * alpha;
+    alphaGreen = (alphaGreen + ((alphaGreen >> 8) & 0xff00ff) + 0x800080) & 0xff00ff00;
+    return alphaGreen | redBlue;
+}
+}
+
+void CircleClip::apply(QImage &image)
+{
+    if (image.isNull()) {
+        return;
+    }
+    if (image.format() != QImage::Format_ARGB32_Premultiplied) {
+        image = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    }
+
+    // every point of the shape is within `radius` of the line (or, when it's square, the point) down its middle.
+    // A pixel's coverage is near enough how far its centre is inside the edge, plus a half, between 0 and 1
+    const auto width = image.width();
+    const auto height = image.height();
+    const auto radius = std::min(width, height) / 2.0;
+    const auto left = radius;
+    const auto right = width - radius;
+    const auto top = radius;
+    const auto bottom = height - radius;
+    // squared, so most pixels (well inside or well outside) never need a square root
+    const auto inside = radius > 0.5 ? (radius - 0.5) * (radius - 0.5) : 0.0;
+    const auto outside = (radius + 0.5) * (radius + 0.5);
+
+    for (auto y = 0; y < height; ++y) {
+        auto *line = reinterpret_cast<QRgb *>(image.scanLine(y));
+        const auto centreY = y + 0.5;
+        const auto dy = centreY < top ? top - centreY : centreY > bottom ? centreY - bottom : 0.0;
+        for (auto x = 0; x < width; ++x) {
+            const auto centreX = x + 0.5;
+            const auto dx = centreX < left ? left - centreX : centreX > right ? centreX - right : 0.0;
+            const auto distance = dx * dx + dy * dy;
+            if (distance <= inside) {
+                continue;
+            }
+            if (distance >= outside) {
+                line[x] = 0;
+                continue;
+            }
+            const auto coverage = radius + 0.5 - std::sqrt(distance);
+            line[x] = multiply(line[x], static_cast<uint>(std::lround(std::clamp(coverage, 0.0, 1.0) * 255)));
+        }
+    }
+}
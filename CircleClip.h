@@ -0,0 +1,26 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef CIRCLECLIP_H
+#define CIRCLECLIP_H
+
+#include <QImage>
+
+/*
+ * Cuts a picture down to a circle, with a properly antialiased edge, by working out how much of each pixel the circle
+ * covers and scaling the pixel by that. Meant for pictures that are already the size they'll be shown at, so the edge
+ * is as soft as one pixel and no softer, and there's no mask picture at all, let alone a full-size one.
+ *
+ * A picture that isn't square gets a pill shape (a rounded rect with corners half the short side), which is what
+ * avatars that aren't square have always come out as.
+ */
+class CircleClip
+{
+public:
+    /*
+     * @param image - the picture to cut down. Converted to ARGB32_Premultiplied if it isn't already.
+     */
+    static void apply(QImage &image);
+};
+
+
+#endif //CIRCLECLIP_H
@@ -0,0 +1,337 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "Downscale.h"
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "ImagePool.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+// SSE2 is part of x86-64, so it's always there. AVX2 isn't, so its kernel is compiled for it separately and only run
+// once the CPU has said yes
+#define STICKER_DOWNSCALE_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+// weights are fractions of 1 << 14, so a weight fits in a signed 16 bits. Rows blended together keep 7 bits of
+// fraction (a channel is then at most 255 << 7, which also fits), so the picture isn't rounded twice; rounding half
+// up twice makes everything a little brighter
+constexpr int weightBits = 14;
+constexpr int one = 1 << weightBits;
+constexpr int extraBits = 7;
+constexpr int rowRounding = 1 << (weightBits - extraBits - 1);
+constexpr int columnRounding = 1 << (weightBits + extraBits - 1);
+
+/*
+ * Which source pixels (or rows) each output pixel covers, and how much of each
+ */
+struct Taps
+{
+    std::vector<int> first;
+    std::vector<int> count;
+    // weights for output pixel i start at i * stride
+    int stride = 0;
+    std::vector<qint16> weights;
+};
+
+Taps taps(const int from, const int to)
+{
+    Taps taps;
+    const auto ratio = static_cast<double>(from) / to;
+    taps.stride = static_cast<int>(std::ceil(ratio)) + 1;
+    taps.first.resize(to);
+    taps.count.resize(to);
+    taps.weights.assign(static_cast<size_t>(to) * taps.stride, 0);
+
+    for (auto i = 0; i < to; ++i) {
+        const auto start = i * ratio;
+        const auto end = (i + 1) * ratio;
+        auto first = static_cast<int>(std::floor(start));
+        auto last = qMin(from, static_cast<int>(std::ceil(end))) - 1;
+
+        // each weight is where its pixel's coverage ends, rounded, minus where it starts, rounded. So the rounding
+        // never adds up to more or less than one, which would stop solid pixels staying solid
+        auto *weights = &taps.weights[static_cast<size_t>(i) * taps.stride];
+        auto done = 0;
+        for (auto j = first; j <= last; ++j) {
+            const auto coveredTo = j == last ? end : qMin<double>(j + 1, end);
+            const auto upTo = j == last ? one : static_cast<int>(std::lround((coveredTo - start) / ratio * one));
+            weights[j - first] = static_cast<qint16>(upTo - done);
+            done = upTo;
+        }
+
+        // slivers too thin to have a weight aren't worth reading
+        auto count = last - first + 1;
+        while (count > 1 && weights[count - 1] == 0) {
+            --count;
+        }
+        auto skip = 0;
+        while (skip < count - 1 && weights[skip] == 0) {
+            ++skip;
+        }
+        if (skip) {
+            std::memmove(weights, weights + skip, sizeof(qint16) * (count - skip));
+            std::fill(weights + count - skip, weights + count, 0);
+            first += skip;
+            count -= skip;
+        }
+        taps.first[i] = first;
+        taps.count[i] = count;
+    }
+    return taps;
+}
+
+/*
+ * Blends some rows into one, from channel `x` on. Every channel of every pixel is treated the same, so they're just
+ * bytes. What comes out keeps `extraBits` of fraction, for blendColumns to round just once at the end.
+ */
+void blendRowsScalar(const uchar *const *rows, const qint16 *weights, const int count, quint16 *out, const int bytes,
+                     int x = 0)
+{
+    for (; x < bytes; ++x) {
+        auto sum = rowRounding;
+        for (auto k = 0; k < count; ++k) {
+            sum += weights[k] * rows[k][x];
+        }
+        out[x] = static_cast<quint16>(sum >> (weightBits - extraBits));
+    }
+}
+
+/*
+ * Blends the pixels of one row (already blended from several) into the output row
+ */
+void blendColumnsScalar(const quint16 *row, const Taps &taps, uchar *out)
+{
+    const auto width = static_cast<int>(taps.first.size());
+    for (auto i = 0; i < width; ++i) {
+        const auto *pixels = row + taps.first[i] * 4;
+        const auto *weights = &taps.weights[static_cast<size_t>(i) * taps.stride];
+        int sums[4] = {columnRounding, columnRounding, columnRounding, columnRounding};
+        for (auto k = 0; k < taps.count[i]; ++k) {
+            for (auto c = 0; c < 4; ++c) {
+                sums[c] += weights[k] * pixels[k * 4 + c];
+            }
+        }
+        for (auto c = 0; c < 4; ++c) {
+            out[i * 4 + c] = static_cast<uchar>(sums[c] >> (weightBits + extraBits));
+        }
+    }
+}
+
+#ifdef STICKER_DOWNSCALE_X86
+// two weights side by side in every 32 bits, for _mm_madd_epi16 to multiply a pair of channels by and add up
+inline int weightPair(const qint16 a, const qint16 b)
+{
+    return static_cast<int>(static_cast<quint32>(static_cast<quint16>(b)) << 16 | static_cast<quint16>(a));
+}
+
+/*
+ * 16 channels (4 pixels) at a time: widened to 16 bits, interleaved with the same channels of the next row, and
+ * multiplied and added by pairs of weights. Leaves anything past the last whole 16 for the scalar one.
+ */
+void blendRowsSse2(const uchar *const *rows, const qint16 *weights, const int count, quint16 *out, const int bytes)
+{
+    const auto zero = _mm_setzero_si128();
+    auto x = 0;
+    for (; x + 16 <= bytes; x += 16) {
+        auto sum0 = _mm_set1_epi32(rowRounding);
+        auto sum1 = sum0;
+        auto sum2 = sum0;
+        auto sum3 = sum0;
+        for (auto k = 0; k < count; k += 2) {
+            const auto paired = k + 1 < count;
+            const auto pair = _mm_set1_epi32(weightPair(weights[k], paired ? weights[k + 1] : 0));
+            const auto a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k] + x));
+            const auto b = paired ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k + 1] + x)) : zero;
+            const auto aLow = _mm_unpacklo_epi8(a, zero);
+            const auto aHigh = _mm_unpackhi_epi8(a, zero);
+            const auto bLow = _mm_unpacklo_epi8(b, zero);
+            const auto bHigh = _mm_unpackhi_epi8(b, zero);
+            sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(aLow, bLow), pair));
+            sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(aLow, bLow), pair));
+            sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi16(aHigh, bHigh), pair));
+            sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi16(aHigh, bHigh), pair));
+        }
+        constexpr auto shift = weightBits - extraBits;
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x),
+                         _mm_packs_epi32(_mm_srai_epi32(sum0, shift), _mm_srai_epi32(sum1, shift)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x + 8),
+                         _mm_packs_epi32(_mm_srai_epi32(sum2, shift), _mm_srai_epi32(sum3, shift)));
+    }
+    blendRowsScalar(rows, weights, count, out, bytes, x);
+}
+
+/*
+ * A pixel's channels, interleaved with the next pixel's, then multiplied and added by a pair of weights: one output
+ * pixel's four sums in one register
+ */
+void blendColumnsSse2(const quint16 *row, const Taps &taps, uchar *out)
+{
+    const auto zero = _mm_setzero_si128();
+    const auto width = static_cast<int>(taps.first.size());
+    for (auto i = 0; i < width; ++i) {
+        const auto *pixels = row + taps.first[i] * 4;
+        const auto *weights = &taps.weights[static_cast<size_t>(i) * taps.stride];
+        const auto count = taps.count[i];
+        auto sum = _mm_set1_epi32(columnRounding);
+        for (auto k = 0; k < count; k += 2) {
+            const auto paired = k + 1 < count;
+            const auto a = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pixels + k * 4));
+            const auto b = paired ? _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pixels + k * 4 + 4)) : zero;
+            const auto pair = _mm_set1_epi32(weightPair(weights[k], paired ? weights[k + 1] : 0));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), pair));
+        }
+        sum = _mm_srai_epi32(sum, weightBits + extraBits);
+        sum = _mm_packs_epi32(sum, sum);
+        const auto pixel = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+        std::memcpy(out + i * 4, &pixel, 4);
+    }
+}
+
+/*
+ * The SSE2 row blend, 32 channels at a time. AVX2's unpacks and packs work within each 16 byte half, so the
+ * channels come out of the sums in a different order: 0-3, 8-11, 16-19, 24-27 in the first half of each packed
+ * register, and so on. A permute puts them back.
+ */
+__attribute__((target("avx2"))) void blendRowsAvx2(const uchar *const *rows,
+                                                   const qint16 *weights,
+                                                   const int count,
+                                                   quint16 *out,
+                                                   const int bytes)
+{
+    const auto zero = _mm256_setzero_si256();
+    auto x = 0;
+    for (; x + 32 <= bytes; x += 32) {
+        auto sum0 = _mm256_set1_epi32(rowRounding);
+        auto sum1 = sum0;
+        auto sum2 = sum0;
+        auto sum3 = sum0;
+        for (auto k = 0; k < count; k += 2) {
+            const auto paired = k + 1 < count;
+            const auto pair = _mm256_set1_epi32(weightPair(weights[k], paired ? weights[k + 1] : 0));
+            const auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k] + x));
+            const auto b = paired ? _mm256_loadu_si256(reinterpret_cast<const __m256i *>(rows[k + 1] + x)) : zero;
+            const auto aLow = _mm256_unpacklo_epi8(a, zero);
+            const auto aHigh = _mm256_unpackhi_epi8(a, zero);
+            const auto bLow = _mm256_unpacklo_epi8(b, zero);
+            const auto bHigh = _mm256_unpackhi_epi8(b, zero);
+            sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(_mm256_unpacklo_epi16(aLow, bLow), pair));
+            sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_unpackhi_epi16(aLow, bLow), pair));
+            sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(_mm256_unpacklo_epi16(aHigh, bHigh), pair));
+            sum3 = _mm256_add_epi32(sum3, _mm256_madd_epi16(_mm256_unpackhi_epi16(aHigh, bHigh), pair));
+        }
+        constexpr auto shift = weightBits - extraBits;
+        const auto low = _mm256_packs_epi32(_mm256_srai_epi32(sum0, shift), _mm256_srai_epi32(sum1, shift));
+        const auto high = _mm256_packs_epi32(_mm256_srai_epi32(sum2, shift), _mm256_srai_epi32(sum3, shift));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + x), _mm256_permute2x128_si256(low, high, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + x + 16), _mm256_permute2x128_si256(low, high, 0x31));
+    }
+    blendRowsScalar(rows, weights, count, out, bytes, x);
+}
+#endif
+
+void blendRows(const Downscale::Kernel kernel,
+               const uchar *const *rows,
+               const qint16 *weights,
+               const int count,
+               quint16 *out,
+               const int bytes)
+{
+    switch (kernel) {
+#ifdef STICKER_DOWNSCALE_X86
+    case Downscale::Kernel::Avx2:
+        blendRowsAvx2(rows, weights, count, out, bytes);
+        return;
+    case Downscale::Kernel::Sse2:
+        blendRowsSse2(rows, weights, count, out, bytes);
+        return;
+#endif
+    default:
+        blendRowsScalar(rows, weights, count, out, bytes);
+    }
+}
+
+void blendColumns(const Downscale::Kernel kernel, const quint16 *row, const Taps &taps, uchar *out)
+{
+#ifdef STICKER_DOWNSCALE_X86
+    // one output pixel is only 16 bytes of sums, so AVX2 has nothing more to give here
+    if (kernel != Downscale::Kernel::Scalar) {
+        blendColumnsSse2(row, taps, out);
+        return;
+    }
+#endif
+    blendColumnsScalar(row, taps, out);
+}
+}
+
+QImage Downscale::area(const QImage &image, const QSize &size)
+{
+    return area(image, size, best());
+}
+
+QImage Downscale::area(const QImage &image, const QSize &size, Kernel kernel)
+{
+    if (image.isNull() || size.isEmpty()) {
+        return QImage();
+    }
+    const auto source = image.format() == QImage::Format_ARGB32_Premultiplied
+        ? image
+        : image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    if (size == source.size()) {
+        return source;
+    }
+    if (size.width() > source.width() || size.height() > source.height()) {
+        return source.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+            .convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    }
+    if (static_cast<int>(kernel) > static_cast<int>(best())) {
+        kernel = best();
+    }
+
+    // every pixel gets written, so whatever the pool's buffer had in it doesn't matter
+    auto shrunk = ImagePool::take(size);
+    if (shrunk.isNull()) {
+        return shrunk;
+    }
+    const auto columns = taps(source.width(), size.width());
+    const auto lines = taps(source.height(), size.height());
+
+    // one output row at a time, so the in-between picture is only ever a row of it
+    std::vector<quint16> row(static_cast<size_t>(source.width()) * 4);
+    std::vector<const uchar *> rows(lines.stride);
+    for (auto y = 0; y < size.height(); ++y) {
+        const auto count = lines.count[y];
+        for (auto k = 0; k < count; ++k) {
+            rows[k] = source.constScanLine(lines.first[y] + k);
+        }
+        blendRows(kernel, rows.data(), &lines.weights[static_cast<size_t>(y) * lines.stride], count, row.data(),
+                  static_cast<int>(row.size()));
+        blendColumns(kernel, row.data(), columns, shrunk.scanLine(y));
+    }
+    return shrunk;
+}
+
+Downscale::Kernel Downscale::best()
+{
+#ifdef STICKER_DOWNSCALE_X86
+    static const auto kernel = __builtin_cpu_supports("avx2") ? Kernel::Avx2 : Kernel::Sse2;
+    return kernel;
+#else
+    return Kernel::Scalar;
+#endif
+}
+
+const char *Downscale::name(const Kernel kernel)
+{
+    switch (kernel) {
+    case Kernel::Avx2:
+        return "avx2";
+    case Kernel::Sse2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
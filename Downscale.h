@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef DOWNSCALE_H
+#define DOWNSCALE_H
+
+#include <QImage>
+#include <QSize>
+
+/*
+ * Shrinks premultiplied ARGB pictures by area averaging: every output pixel is the average of the source pixels it
+ * covers, weighted by how much of each it covers. For shrinking that's what Qt's smooth scaler does too, near enough,
+ * but Qt's is written for any format, any direction and any transform, and we only ever do one thing with it.
+ *
+ * It's done in two passes with 14-bit fixed point weights: the rows an output row covers are blended into one (the
+ * pass over the whole source, so it's the one that gets the wide registers), then that row's columns are.
+ * On x86 there's an SSE2 kernel and an AVX2 one, picked when it's first needed by asking the CPU. Anywhere else, or
+ * on a CPU with neither, it's plain C++, which gives exactly the same pixels.
+ */
+class Downscale
+{
+public:
+    enum class Kernel {
+        Scalar,
+        Sse2,
+        Avx2,
+    };
+
+    /*
+     * Shrinks a picture. Anything that isn't shrinking (in either direction) goes to Qt's smooth scaler instead.
+     *
+     * @param image - any format. Converted to ARGB32_Premultiplied first if it isn't already.
+     * @param size - how big it should come out. The aspect ratio is whatever this says.
+     *
+     * @return the shrunk picture, in ARGB32_Premultiplied
+     */
+    static QImage area(const QImage &image, const QSize &size);
+
+    /*
+     * The same, with a particular kernel, for comparing them. One the CPU can't run falls back to the next best.
+     */
+    static QImage area(const QImage &image, const QSize &size, Kernel kernel);
+
+    /*
+     * @return the fastest kernel this CPU can run
+     */
+    static Kernel best();
+
+    /*
+     * @return "scalar", "sse2" or "avx2"
+     */
+    static const char *name(Kernel kernel);
+};
+
+
+#endif //DOWNSCALE_H
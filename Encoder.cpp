@@ -0,0 +1,308 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "Encoder.h"
+#include <QBuffer>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QImageWriter>
+#include <QJsonObject>
+#include <QtEndian>
+#include <cerrno>
+#include <map>
+#include <memory>
+#include <unistd.h>
+#include "ImagePool.h"
+#include "RenderTrace.h"
+#ifdef STICKER_HAVE_LIBWEBP
+#include <webp/encode.h>
+#endif
+
+namespace
+{
+// one of Qt's image writers, and the buffer it writes into. A writer loads its plugin's handler the first time it's
+// used and keeps it as long as it has the same device, so each of these is only set up once.
+struct QtWriter
+{
+    QByteArray bytes;
+    QBuffer buffer;
+    QImageWriter writer;
+
+    explicit QtWriter(const QByteArray &format)
+    {
+        // reserving marks the capacity as ours to keep, so emptying the buffer doesn't hand the memory back
+        bytes.reserve(256 * 1024);
+        buffer.setBuffer(&bytes);
+        writer.setDevice(&buffer);
+        // the handler sticks with the format it was made for, which is why there's a writer per format
+        writer.setFormat(format);
+    }
+};
+
+// a row of premultiplied pixels as unpremultiplied RGBA bytes, which is what every encoder that isn't Qt's wants
+void unpremultiplyRow(const QRgb *in, uchar *out, const int width)
+{
+    for (auto x = 0; x < width; ++x, out += 4) {
+        const auto pixel = qUnpremultiply(in[x]);
+        out[0] = static_cast<uchar>(qRed(pixel));
+        out[1] = static_cast<uchar>(qGreen(pixel));
+        out[2] = static_cast<uchar>(qBlue(pixel));
+        out[3] = static_cast<uchar>(qAlpha(pixel));
+    }
+}
+
+#ifdef STICKER_HAVE_LIBWEBP
+// the same for a whole picture, into one of the pool's buffers rather than a fresh one from convertToFormat
+QImage unpremultiplied(const QImage &image)
+{
+    const auto source = image.format() == QImage::Format_ARGB32_Premultiplied
+        ? image
+        : image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    auto rgba = ImagePool::take(source.size(), QImage::Format_RGBA8888);
+    for (auto y = 0; y < source.height(); ++y) {
+        unpremultiplyRow(reinterpret_cast<const QRgb *>(source.constScanLine(y)), rgba.scanLine(y), source.width());
+    }
+    return rgba;
+}
+
+// libwebp grows its output buffer as it goes. Keeping it means it's already big enough for the next sticker.
+struct WebpOutput
+{
+    WebPMemoryWriter memory{};
+
+    WebpOutput() { WebPMemoryWriterInit(&memory); }
+    ~WebpOutput() { WebPMemoryWriterClear(&memory); }
+};
+#endif
+}
+
+void EncoderSettings::apply(const QJsonObject &json)
+{
+    if (const auto value = json["format"].toString(); !value.isEmpty()) {
+        format = value.toLower().toLatin1();
+    }
+    if (json.contains("lossless")) {
+        lossless = json["lossless"].toBool();
+    }
+    if (json.contains("quality")) {
+        quality = qBound(-1, json["quality"].toInt(-1), 100);
+    }
+    if (json.contains("method")) {
+        method = qBound(-1, json["method"].toInt(-1), 6);
+    }
+    if (json.contains("compression")) {
+        compression = qBound(-1, json["compression"].toInt(-1), 9);
+    }
+}
+
+EncoderSettings &Encoder::defaults()
+{
+    static EncoderSettings settings;
+    return settings;
+}
+
+QByteArray Encoder::formatFor(const EncoderSettings &settings, const QString &path)
+{
+    if (!settings.format.isEmpty()) {
+        return settings.format;
+    }
+    // what QImage::save would have guessed, like it always did
+    if (const auto suffix = QFileInfo(path).suffix().toLower().toLatin1(); !suffix.isEmpty()) {
+        return suffix;
+    }
+    return "webp";
+}
+
+bool Encoder::supports(const QByteArray &format)
+{
+    if (format == "rgba" || format == "webp" || format == "png") {
+        return true;
+    }
+    // only asked once: it goes through every plugin, and what's installed doesn't change while we're running
+    static const auto plugins = QImageWriter::supportedImageFormats();
+    return plugins.contains(format);
+}
+
+QByteArray Encoder::encode(const QImage &image,
+                           const EncoderSettings &settings,
+                           const QString &path,
+                           EncodeStats *stats)
+{
+    RenderTrace::Stage stage("encode");
+    QElapsedTimer timer;
+    timer.start();
+
+    const auto format = formatFor(settings, path);
+    QByteArray bytes;
+    if (format == "rgba") {
+        bytes = encodeRaw(image);
+#ifdef STICKER_HAVE_LIBWEBP
+    } else if (format == "webp") {
+        bytes = encodeWebp(image, settings);
+#endif
+    } else {
+        bytes = encodeWithQt(image, format, settings);
+    }
+
+    RenderTrace::note("encodedBytes", bytes.size());
+    if (stats) {
+        stats->format = format;
+        stats->bytes = bytes.size();
+        stats->encodeUs = timer.nsecsElapsed() / 1000;
+    }
+    return bytes;
+}
+
+bool Encoder::writeFile(const QString &path, const QByteArray &bytes)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+    return file.write(bytes) == bytes.size();
+}
+
+int Encoder::streamFor(const QString &path)
+{
+    if (path == QStringLiteral("-")) {
+        return STDOUT_FILENO;
+    }
+    if (path.startsWith(QStringLiteral("fd:"))) {
+        auto ok = false;
+        const auto fd = path.mid(3).toInt(&ok);
+        if (ok && fd >= 0) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+bool Encoder::writeStream(const int fd, const QByteArray &bytes, const int width, const int height)
+{
+    char header[16] = {'S', 'T', 'K', '1'};
+    qToLittleEndian<quint32>(static_cast<quint32>(bytes.size()), header + 4);
+    qToLittleEndian<quint32>(static_cast<quint32>(width), header + 8);
+    qToLittleEndian<quint32>(static_cast<quint32>(height), header + 12);
+
+    // straight down the descriptor, without stdio's buffering in the way
+    const auto writeAll = [fd](const char *data, qsizetype size) {
+        while (size > 0) {
+            const auto wrote = write(fd, data, static_cast<size_t>(size));
+            if (wrote < 0 && errno == EINTR) {
+                continue;
+            }
+            if (wrote <= 0) {
+                return false;
+            }
+            data += wrote;
+            size -= wrote;
+        }
+        return true;
+    };
+    return writeAll(header, sizeof header) && writeAll(bytes.constData(), bytes.size());
+}
+
+QByteArray Encoder::encodeWithQt(const QImage &image, const QByteArray &format, const EncoderSettings &settings)
+{
+    // a writer and its buffer are kept for every format we're asked for, so only ones we can actually write
+    if (!supports(format)) {
+        return {};
+    }
+    thread_local std::map<QByteArray, std::unique_ptr<QtWriter>> writers;
+    auto &slot = writers[format];
+    if (!slot) {
+        slot = std::make_unique<QtWriter>(format);
+    }
+    auto &[bytes, buffer, writer] = *slot;
+
+    if (format == "webp") {
+        // Qt's webp plugin goes lossless at quality 100, so that's the only way to ask it for lossless. Lossy tops out
+        // just under. It has no way to set the effort, so `method` goes unused without libwebp.
+        writer.setQuality(settings.lossless ? 100 : qMin(settings.quality, 99));
+    } else {
+        writer.setQuality(settings.quality);
+    }
+    // set every time, -1 included, so one sticker's settings don't stick to the next one through the same writer
+    writer.setCompression(settings.compression);
+
+    // opening doesn't empty the buffer, so the last sticker's bytes are thrown away first. Its memory stays reserved
+    // for this one, though
+    bytes.resize(0);
+    buffer.open(QIODevice::WriteOnly);
+    const auto written = writer.write(image);
+    const auto size = buffer.pos();
+    buffer.close();
+    if (!written) {
+        return {};
+    }
+    // a copy of just what was written, so the caller doesn't share (and detach) the buffer we're going to write the
+    // next one into
+    return QByteArray(bytes.constData(), static_cast<int>(size));
+}
+
+QByteArray Encoder::encodeRaw(const QImage &image)
+{
+    // straight into the bytes we hand back, with no RGBA picture in between
+    const auto source = image.format() == QImage::Format_ARGB32_Premultiplied
+        ? image
+        : image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    const auto rowBytes = source.width() * 4;
+    QByteArray bytes(rowBytes * source.height(), Qt::Uninitialized);
+    auto *out = reinterpret_cast<uchar *>(bytes.data());
+    for (auto y = 0; y < source.height(); ++y) {
+        unpremultiplyRow(reinterpret_cast<const QRgb *>(source.constScanLine(y)), out + y * rowBytes, source.width());
+    }
+    return bytes;
+}
+
+#ifdef STICKER_HAVE_LIBWEBP
+QByteArray Encoder::encodeWebp(const QImage &image, const EncoderSettings &settings)
+{
+    WebPConfig config;
+    if (!WebPConfigInit(&config)) {
+        return {};
+    }
+    config.lossless = settings.lossless ? 1 : 0;
+    if (settings.quality >= 0) {
+        config.quality = static_cast<float>(settings.quality);
+    }
+    if (settings.method >= 0) {
+        config.method = settings.method;
+    }
+    // keep the colour of fully transparent pixels out of the file; nobody's going to see them
+    config.exact = 0;
+    if (!WebPValidateConfig(&config)) {
+        return {};
+    }
+
+    // libwebp wants unpremultiplied RGBA
+    const auto rgba = unpremultiplied(image);
+
+    WebPPicture picture;
+    if (!WebPPictureInit(&picture)) {
+        return {};
+    }
+    // lossless works on ARGB, lossy on YUV. Importing straight into the one we need saves a conversion
+    picture.use_argb = config.lossless;
+    picture.width = rgba.width();
+    picture.height = rgba.height();
+    if (!WebPPictureImportRGBA(&picture, rgba.constBits(), static_cast<int>(rgba.bytesPerLine()))) {
+        WebPPictureFree(&picture);
+        return {};
+    }
+
+    thread_local WebpOutput output;
+    output.memory.size = 0;
+    picture.writer = WebPMemoryWrite;
+    picture.custom_ptr = &output.memory;
+
+    const auto encoded = WebPEncode(&config, &picture);
+    WebPPictureFree(&picture);
+    if (!encoded) {
+        return {};
+    }
+    return QByteArray(reinterpret_cast<const char *>(output.memory.mem), static_cast<int>(output.memory.size));
+}
+#endif
@@ -0,0 +1,145 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <QByteArray>
+#include <QString>
+
+class QImage;
+class QJsonObject;
+
+/*
+ * How to turn a finished sticker into bytes. Comes from the payload's "encoder" object, on top of the command line's.
+ */
+struct EncoderSettings
+{
+    // "webp", "png" or "rgba" (raw: unpremultiplied RGBA, 4 bytes a pixel, row after row, no header), or anything else
+    // one of Qt's image plugins can write (see Encoder::supports).
+    // Empty means guess from the output file's extension, or webp if there's nothing to guess from.
+    QByteArray format;
+
+    // webp only: lossless instead of lossy
+    bool lossless = false;
+
+    // 0-100. Lossy webp's quality, or how hard lossless webp squeezes. For png, a stand-in for `compression`.
+    // -1 leaves it to the encoder.
+    int quality = -1;
+
+    // webp only: effort, from 0 (quick) to 6 (small). Only libwebp has this knob; Qt's plugin doesn't. -1 for default
+    int method = -1;
+
+    // png only: zlib level, from 0 (quick) to 9 (small). -1 for default
+    int compression = -1;
+
+    /*
+     * Overrides whichever settings the JSON mentions
+     *
+     * @param json - something like {"format":"webp","lossless":false,"quality":80,"method":4}
+     */
+    void apply(const QJsonObject &json);
+};
+
+/*
+ * What encoding cost us
+ */
+struct EncodeStats
+{
+    // what it was encoded as, after any guessing
+    QByteArray format;
+    qint64 bytes = 0;
+    qint64 encodeUs = 0;
+};
+
+/*
+ * The last stage of a sticker: pixels in, bytes out, with the format and effort chosen on purpose rather than by
+ * QImage::save's guess and its plugin's defaults.
+ *
+ * Anything that can be kept between stickers is kept, per thread: Qt's image writers (and the plugin handlers they
+ * load) and libwebp's output buffer. So long-running processes only pay for setting them up once per worker.
+ * If the build found libwebp, webp goes straight through it, which is where `method` comes from.
+ */
+class Encoder
+{
+public:
+    /*
+     * Encodes a picture into memory
+     *
+     * @param image - the finished sticker
+     * @param settings - how to encode it
+     * @param path - where it's going, if anywhere, for guessing the format from. Nothing is written there.
+     * @param stats - if given, gets the format, size and time taken
+     *
+     * @return the encoded bytes, or nothing if it couldn't be encoded
+     */
+    static QByteArray encode(const QImage &image,
+                             const EncoderSettings &settings,
+                             const QString &path = QString(),
+                             EncodeStats *stats = nullptr);
+
+    /*
+     * Writes some encoded bytes to a file
+     *
+     * @return whether all of them made it
+     */
+    static bool writeFile(const QString &path, const QByteArray &bytes);
+
+    /*
+     * Works out whether an output "path" is really a file descriptor we've been handed
+     *
+     * @param path - "-" for stdout, "fd:N" for descriptor N (a pipe, a socket, a memfd...), or an ordinary path
+     *
+     * @return the descriptor, or -1 for an ordinary path
+     */
+    static int streamFor(const QString &path);
+
+    /*
+     * Writes an encoded sticker down a file descriptor, behind a 16 byte header so the reader knows how much to take:
+     * "STK1", then the length of the encoded bytes, the width and the height, each a little-endian uint32.
+     * The descriptor is left open.
+     *
+     * @return whether all of it made it
+     */
+    static bool writeStream(int fd, const QByteArray &bytes, int width, int height);
+
+    /*
+     * The settings every sticker starts with, before its payload has a say. Set them up (from the command line) before
+     * any stickers are drawn; they're not locked.
+     */
+    static EncoderSettings &defaults();
+
+    /*
+     * @return the format `settings` will encode to, for a file at `path`
+     */
+    static QByteArray formatFor(const EncoderSettings &settings, const QString &path);
+
+    /*
+     * Formats come from payloads, so they're checked against this before anything's set up for them
+     *
+     * @param format - lower case, like "png"
+     *
+     * @return whether we can encode to it
+     */
+    static bool supports(const QByteArray &format);
+
+private:
+    /*
+     * Encodes with whichever of Qt's image plugins handles the format
+     */
+    static QByteArray encodeWithQt(const QImage &image, const QByteArray &format, const EncoderSettings &settings);
+
+    /*
+     * Copies the pixels out, unpremultiplied, in RGBA order
+     */
+    static QByteArray encodeRaw(const QImage &image);
+
+#ifdef STICKER_HAVE_LIBWEBP
+    /*
+     * Encodes webp with libwebp directly, so every knob it has is ours to turn
+     */
+    static QByteArray encodeWebp(const QImage &image, const EncoderSettings &settings);
+#endif
+};
+
+
+#endif //ENCODER_H
@@ -2,54 +2,115 @@
 // SPDX-License-Identifier: LGPL-2.1-or-later
 
 #include "Entities.h"
+#include <algorithm>
+#include <iterator>
+#include <vector>
 
+namespace
+{
+struct EntityName
+{
+    std::string_view name;
+    Styles style;
+};
+
+// the names tg uses, sorted so they can be binary searched.
+// inconsistency: I don't *think* my desktop tg highlights phone numbers
+constexpr EntityName entityNames[] = {
+    {"bold", bold},
+    {"bot_command", bot_command},
+    {"cashtag", cashtag},
+    {"code", code},
+    {"email", email},
+    {"hashtag", hashtag},
+    {"italic", italic},
+    {"mention", mention},
+    {"phone_number", phonenumber},
+    {"pre", pre},
+    {"strikethrough", strikethrough},
+    {"text_link", text_link},
+    {"text_mention", mention},
+    {"underline", underline},
+    {"url", url},
+};
+
+constexpr bool isSorted()
+{
+    for (size_t i = 1; i < std::size(entityNames); ++i) {
+        if (!(entityNames[i - 1].name < entityNames[i].name)) {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(isSorted(), "entityNames has to stay sorted");
+static_assert(url < 32, "EntityRun::styles has a bit per style");
+
+// where an entity starts or ends
+struct Edge
+{
+    int position;
+    Styles style;
+    bool starts;
+};
+}
 
-Styles entityType(const QString &what)
+Styles entityType(const std::string_view what)
 {
-    // inconsistency: I don't *think* my desktop tg highlights phone numbers
-    if (what == "bold") {
-        return bold;
-    } if (what == "bot_command") {
-        return bot_command;
-    } if (what == "cashtag") {
-        return cashtag;
-    } if (what == "code") {
-        return code;
-    } if (what == "email") {
-        return
-            email;
-    } if (what == "hashtag") {
-        return
-            hashtag;
-    } if (what == "italic") {
-        return
-            italic;
-    } if (what == "mention") {
-        return
-            mention;
-    } if (what == "text_mention") {
-        return
-            mention;
-    } if (what == "phone_number") {
-        return
-            phonenumber;
-    } if (what == "pre") {
-        return
-            pre;
-    } if (what == "strikethrough") {
-        return
-            strikethrough;
-    } if (what == "text_link") {
-        return
-            text_link;
-    } if (what == "underline") {
-        return
-            underline;
-    } if (what == "url") {
-        return
-            url;
+    const auto found = std::lower_bound(std::begin(entityNames), std::end(entityNames), what,
+                                        [](const EntityName &entry, std::string_view name) { return entry.name < name; });
+    if (found != std::end(entityNames) && found->name == what) {
+        return found->style;
     }
 
     // default/fallback. MAY be (not guaranteed) a ZERO. A NO-OP for things we couldn't identify.
     return _;
 }
+
+QVector<EntityRun> normaliseEntities(const QList<Entity> &entities, const int textLength)
+{
+    std::vector<Edge> edges;
+    edges.reserve(entities.size() * 2);
+    for (const auto &[type, offset, length] : entities) {
+        if (type == _ || length <= 0) {
+            continue;
+        }
+        const auto start = qMax(offset, 0);
+        const auto end = static_cast<int>(qMin<qint64>(static_cast<qint64>(offset) + length, textLength));
+        if (start >= end) {
+            continue;
+        }
+        edges.push_back({start, type, true});
+        edges.push_back({end, type, false});
+    }
+    std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) { return a.position < b.position; });
+
+    // the same style can be over the same text more than once (a link inside a longer link), so count them
+    int covering[32] = {};
+    quint32 styles = 0;
+    QVector<EntityRun> runs;
+    auto runStart = 0;
+    for (size_t i = 0; i < edges.size();) {
+        const auto position = edges[i].position;
+        // everything that starts or ends here, before looking at what's changed
+        auto changed = styles;
+        for (; i < edges.size() && edges[i].position == position; ++i) {
+            auto &count = covering[edges[i].style];
+            count += edges[i].starts ? 1 : -1;
+            if (count > 0) {
+                changed |= 1u << edges[i].style;
+            } else {
+                changed &= ~(1u << edges[i].style);
+            }
+        }
+        if (changed == styles) {
+            continue;
+        }
+        if (styles && position > runStart) {
+            runs.push_back({runStart, position - runStart, styles});
+        }
+        styles = changed;
+        runStart = position;
+    }
+    return runs;
+}
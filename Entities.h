@@ -3,7 +3,10 @@
 #ifndef ENTITIES_H
 #define ENTITIES_H
 
-#include <QString>
+#include <QList>
+#include <QVector>
+#include <QtGlobal>
+#include <string_view>
 
 /*
  * these represent formatting in telegram. We mark them like this so we can push it through switch/case stuffs
@@ -39,13 +42,36 @@ struct Entity
     qsizetype length;
 };
 
+/*
+ * A stretch of text that's formatted the same all the way along
+ */
+struct EntityRun
+{
+    int start;
+    int length;
+    // a bit (1 << style) for each of the Styles over it
+    quint32 styles;
+};
+
 /*
  * Describes an entity type (given as a string) using our enum system
  *
- * @param what - a string, like "bold", saying what kind of entity it is
+ * @param what - the name, like "bold", saying what kind of entity it is. UTF-8 bytes straight out of the payload.
  *
  * @returns what type of entity it is, actually
  */
-Styles entityType(const QString &what);
+Styles entityType(std::string_view what);
+
+/*
+ * Flattens entities into runs that don't overlap, so whatever order telegram sent them in, and however they overlap
+ * (bold over part of a link over part of some italics...), every character gets every style that covers it.
+ * Sorts the places entities start and end, then walks along them, so it's O(n log n) for n entities.
+ *
+ * @param entities - in any order, overlapping or not. Any that run off either end of the text are cut short.
+ * @param textLength - how long the text is, in UTF-16 code units like the offsets
+ *
+ * @returns the runs with any styles at all, in order. Neighbours always have different styles.
+ */
+QVector<EntityRun> normaliseEntities(const QList<Entity> &entities, int textLength);
 
 #endif //ENTITIES_H
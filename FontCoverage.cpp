@@ -0,0 +1,307 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "FontCoverage.h"
+#include <algorithm>
+#include <iterator>
+
+namespace
+{
+// everything below here is Latin, Greek, Cyrillic and friends, which NotoSans draws by itself
+constexpr char32_t mainFontCovers = 0x0530;
+
+/*
+ * On ANDROID, telegram is allowed to use system fonts, and so it can represent all kinds of weird scripts
+ * with characters wayyyyy off the BMP. I talk to a guy whose name is written in Old Turkic.
+ * Android tg can draw it. Desktop tg on my system cannot.
+ * Having all these fallback fonts allows us to do the cool thing that the Android version does.
+ * We need to include the emoji font, because (duh) otherwise we don't get many emoji (the combined ones!).
+ * If you want to switch out the emoji font, you MIGHT need to load it as the main font and then use the main font
+ * as a fallback font. Unconfirmed.
+ * android, ios and desktop all use apple emoji, usually, so using Noto is a visible deviation!
+ * The others are all consistent!
+ * However, for MOST of the VERY FUNDAMENTAL emoji, the similarity is usually high enough for it to be OK.
+ * And sometimes packagers change the fonts, lol, so I THINK the debian version uses noto emoji anyway.
+ *
+ * Ranges are unicode blocks (or bits of them), in order, not overlapping. Families are space separated, best first.
+ * Where a block has emoji in it, the emoji font goes first so they come out in colour, like telegram draws them.
+ */
+struct CoverageEntry
+{
+    char32_t first;
+    char32_t last;
+    const char *families;
+};
+
+constexpr CoverageEntry coverage[] = {
+    {0x0530, 0x058F, "NotoSansArmenian"},
+    {0x0590, 0x05FF, "NotoSansHebrew"},
+    {0x0600, 0x06FF, "NotoSansArabic"},
+    {0x0700, 0x074F, "NotoSansSyriac"},
+    {0x0750, 0x077F, "NotoSansArabic"},
+    {0x0780, 0x07BF, "NotoSansThaana"},
+    {0x07C0, 0x07FF, "NotoSansNKo"},
+    {0x0800, 0x083F, "NotoSansSamaritan"},
+    {0x0840, 0x085F, "NotoSansMandaic"},
+    {0x0860, 0x086F, "NotoSansSyriac"},
+    {0x08A0, 0x08FF, "NotoSansArabic"},
+    {0x0900, 0x097F, "NotoSansDevanagari"},
+    {0x0980, 0x09FF, "NotoSansBengali"},
+    {0x0A00, 0x0A7F, "NotoSansGurmukhi"},
+    {0x0A80, 0x0AFF, "NotoSansGujarati"},
+    {0x0B00, 0x0B7F, "NotoSansOriya"},
+    {0x0B80, 0x0BFF, "NotoSansTamil"},
+    {0x0C00, 0x0C7F, "NotoSansTelugu"},
+    {0x0C80, 0x0CFF, "NotoSansKannada"},
+    {0x0D00, 0x0D7F, "NotoSansMalayalam"},
+    {0x0D80, 0x0DFF, "NotoSansSinhala"},
+    {0x0E00, 0x0E7F, "NotoSansThai"},
+    {0x0E80, 0x0EFF, "NotoSansLao"},
+    {0x1000, 0x109F, "NotoSansMyanmar"},
+    {0x10A0, 0x10FF, "NotoSansGeorgian"},
+    {0x1200, 0x139F, "NotoSansEthiopic"},
+    {0x13A0, 0x13FF, "NotoSansCherokee"},
+    {0x1400, 0x167F, "NotoSansCanadianAboriginal"},
+    {0x1680, 0x169F, "NotoSansOgham"},
+    {0x16A0, 0x16FF, "NotoSansRunic"},
+    {0x1700, 0x171F, "NotoSansTagalog"},
+    {0x1720, 0x173F, "NotoSansHanunoo"},
+    {0x1740, 0x175F, "NotoSansBuhid"},
+    {0x1760, 0x177F, "NotoSansTagbanwa"},
+    {0x1780, 0x17FF, "NotoSansKhmer"},
+    {0x1800, 0x18AF, "NotoSansMongolian"},
+    {0x18B0, 0x18FF, "NotoSansCanadianAboriginal"},
+    {0x1900, 0x194F, "NotoSansLimbu"},
+    {0x1950, 0x197F, "NotoSansTaiLe"},
+    {0x1980, 0x19DF, "NotoSansNewTaiLue"},
+    {0x19E0, 0x19FF, "NotoSansKhmer"},
+    {0x1A00, 0x1A1F, "NotoSansBuginese"},
+    {0x1A20, 0x1AAF, "NotoSansTaiTham"},
+    {0x1B00, 0x1B7F, "NotoSansBalinese"},
+    {0x1B80, 0x1BBF, "NotoSansSundanese"},
+    {0x1BC0, 0x1BFF, "NotoSansBatak"},
+    {0x1C00, 0x1C4F, "NotoSansLepcha"},
+    {0x1C50, 0x1C7F, "NotoSansOlChiki"},
+    {0x1C90, 0x1CBF, "NotoSansGeorgian"},
+    {0x1CC0, 0x1CCF, "NotoSansSundanese"},
+    // zero width joiner: glues emoji together (and shows up in some Indic text, where it does no harm)
+    {0x200D, 0x200D, "NotoColorEmoji"},
+    // combining keycap, for #️⃣ and friends
+    {0x20E3, 0x20E3, "NotoColorEmoji"},
+    {0x2100, 0x214F, "NotoSansSymbols NotoSansMath"},
+    {0x2190, 0x21FF, "NotoSansSymbols2 NotoSansMath"},
+    {0x2200, 0x22FF, "NotoSansMath"},
+    {0x2300, 0x23FF, "NotoColorEmoji NotoSansSymbols2 NotoSansMath"},
+    {0x2400, 0x243F, "NotoSansSymbols2"},
+    {0x2460, 0x24FF, "NotoColorEmoji NotoSansSymbols"},
+    {0x2500, 0x259F, "NotoSansSymbols2 NotoSansMath"},
+    {0x25A0, 0x25FF, "NotoColorEmoji NotoSansSymbols2 NotoSansMath"},
+    {0x2600, 0x27BF, "NotoColorEmoji NotoSansSymbols NotoSansSymbols2"},
+    {0x27C0, 0x27EF, "NotoSansMath"},
+    {0x27F0, 0x27FF, "NotoSansMath NotoSansSymbols2"},
+    {0x2800, 0x28FF, "NotoSansSymbols2"},
+    {0x2900, 0x2AFF, "NotoSansMath"},
+    {0x2B00, 0x2BFF, "NotoColorEmoji NotoSansSymbols2 NotoSansMath"},
+    {0x2C00, 0x2C5F, "NotoSansGlagolitic"},
+    {0x2C80, 0x2CFF, "NotoSansCoptic"},
+    {0x2D00, 0x2D2F, "NotoSansGeorgian"},
+    {0x2D30, 0x2D7F, "NotoSansTifinagh"},
+    {0x2D80, 0x2DDF, "NotoSansEthiopic"},
+    {0x3030, 0x3030, "NotoColorEmoji"},
+    {0x303D, 0x303D, "NotoColorEmoji"},
+    {0x3297, 0x3297, "NotoColorEmoji"},
+    {0x3299, 0x3299, "NotoColorEmoji"},
+    {0xA000, 0xA4CF, "NotoSansYi"},
+    {0xA4D0, 0xA4FF, "NotoSansLisu"},
+    {0xA500, 0xA63F, "NotoSansVai"},
+    {0xA6A0, 0xA6FF, "NotoSansBamum"},
+    {0xA800, 0xA82F, "NotoSansSylotiNagri"},
+    {0xA840, 0xA87F, "NotoSansPhagsPa"},
+    {0xA880, 0xA8DF, "NotoSansSaurashtra"},
+    {0xA8E0, 0xA8FF, "NotoSansDevanagari"},
+    {0xA900, 0xA92F, "NotoSansKayahLi"},
+    {0xA930, 0xA95F, "NotoSansRejang"},
+    {0xA980, 0xA9DF, "NotoSansJavanese"},
+    {0xA9E0, 0xA9FF, "NotoSansMyanmar"},
+    {0xAA00, 0xAA5F, "NotoSansCham"},
+    {0xAA60, 0xAA7F, "NotoSansMyanmar"},
+    {0xAA80, 0xAADF, "NotoSansTaiViet"},
+    {0xAAE0, 0xAAFF, "NotoSansMeeteiMayek"},
+    {0xAB00, 0xAB2F, "NotoSansEthiopic"},
+    {0xAB70, 0xABBF, "NotoSansCherokee"},
+    {0xABC0, 0xABFF, "NotoSansMeeteiMayek"},
+    {0xFB1D, 0xFB4F, "NotoSansHebrew"},
+    {0xFB50, 0xFDFF, "NotoSansArabic"},
+    // variation selectors. FE0F asks for the emoji picture of whatever it follows
+    {0xFE00, 0xFE0F, "NotoColorEmoji"},
+    {0xFE70, 0xFEFF, "NotoSansArabic"},
+    {0x10000, 0x1013F, "NotoSansLinearB"},
+    {0x10190, 0x101CF, "NotoSansSymbols"},
+    {0x10280, 0x1029F, "NotoSansLycian"},
+    {0x102A0, 0x102DF, "NotoSansCarian"},
+    {0x10300, 0x1032F, "NotoSansOldItalic"},
+    {0x10330, 0x1034F, "NotoSansGothic"},
+    {0x10350, 0x1037F, "NotoSansOldPermic"},
+    {0x10380, 0x1039F, "NotoSansUgaritic"},
+    {0x103A0, 0x103DF, "NotoSansOldPersian"},
+    {0x10400, 0x1044F, "NotoSansDeseret"},
+    {0x10450, 0x1047F, "NotoSansShavian"},
+    {0x10480, 0x104AF, "NotoSansOsmanya"},
+    {0x104B0, 0x104FF, "NotoSansOsage"},
+    {0x10500, 0x1052F, "NotoSansElbasan"},
+    {0x10530, 0x1056F, "NotoSansCaucasianAlbanian"},
+    {0x10600, 0x1077F, "NotoSansLinearA"},
+    {0x10800, 0x1083F, "NotoSansCypriot"},
+    {0x10840, 0x1085F, "NotoSansImperialAramaic"},
+    {0x10860, 0x1087F, "NotoSansPalmyrene"},
+    {0x10880, 0x108AF, "NotoSansNabataean"},
+    {0x108E0, 0x108FF, "NotoSansHatran"},
+    {0x10900, 0x1091F, "NotoSansPhoenician"},
+    {0x10920, 0x1093F, "NotoSansLydian"},
+    {0x10980, 0x109FF, "NotoSansMeroitic"},
+    {0x10A00, 0x10A5F, "NotoSansKharoshthi"},
+    {0x10A60, 0x10A7F, "NotoSansOldSouthArabian"},
+    {0x10A80, 0x10A9F, "NotoSansOldNorthArabian"},
+    {0x10AC0, 0x10AFF, "NotoSansManichaean"},
+    {0x10B00, 0x10B3F, "NotoSansAvestan"},
+    {0x10B40, 0x10B5F, "NotoSansInscriptionalParthian"},
+    {0x10B60, 0x10B7F, "NotoSansInscriptionalPahlavi"},
+    {0x10B80, 0x10BAF, "NotoSansPsalterPahlavi"},
+    {0x10C00, 0x10C4F, "NotoSansOldTurkic"},
+    {0x10C80, 0x10CFF, "NotoSansOldHungarian"},
+    {0x10D00, 0x10D3F, "NotoSansHanifiRohingya"},
+    {0x10F00, 0x10F2F, "NotoSansOldSogdian"},
+    {0x10F30, 0x10F6F, "NotoSansSogdian"},
+    {0x10FE0, 0x10FFF, "NotoSansElymaic"},
+    {0x11000, 0x1107F, "NotoSansBrahmi"},
+    {0x11080, 0x110CF, "NotoSansKaithi"},
+    {0x110D0, 0x110FF, "NotoSansSoraSompeng"},
+    {0x11100, 0x1114F, "NotoSansChakma"},
+    {0x11150, 0x1117F, "NotoSansMahajani"},
+    {0x11180, 0x111DF, "NotoSansSharada"},
+    {0x111E0, 0x111FF, "NotoSansSinhala"},
+    {0x11200, 0x1124F, "NotoSansKhojki"},
+    {0x11280, 0x112AF, "NotoSansMultani"},
+    {0x112B0, 0x112FF, "NotoSansKhudawadi"},
+    {0x11300, 0x1137F, "NotoSansGrantha"},
+    {0x11400, 0x1147F, "NotoSansNewa"},
+    {0x11480, 0x114DF, "NotoSansTirhuta"},
+    {0x11580, 0x115FF, "NotoSansSiddham"},
+    {0x11600, 0x1165F, "NotoSansModi"},
+    {0x11680, 0x116CF, "NotoSansTakri"},
+    {0x118A0, 0x118FF, "NotoSansWarangCiti"},
+    {0x11A00, 0x11A4F, "NotoSansZanabazarSquare"},
+    {0x11A50, 0x11AAF, "NotoSansSoyombo"},
+    {0x11AC0, 0x11AFF, "NotoSansPauCinHau"},
+    {0x11C00, 0x11C6F, "NotoSansBhaiksuki"},
+    {0x11C70, 0x11CBF, "NotoSansMarchen"},
+    {0x11D00, 0x11D5F, "NotoSansMasaramGondi"},
+    {0x11D60, 0x11DAF, "NotoSansGunjalaGondi"},
+    {0x11FC0, 0x11FFF, "NotoSansTamilSupplement"},
+    {0x12000, 0x1254F, "NotoSansCuneiform"},
+    {0x13000, 0x1343F, "NotoSansEgyptianHieroglyphs"},
+    {0x14400, 0x1467F, "NotoSansAnatolianHieroglyphs"},
+    {0x16800, 0x16A3F, "NotoSansBamum"},
+    {0x16A40, 0x16A6F, "NotoSansMro"},
+    {0x16AD0, 0x16AFF, "NotoSansBassaVah"},
+    {0x16B00, 0x16B8F, "NotoSansPahawhHmong"},
+    {0x16E40, 0x16E9F, "NotoSansMedefaidrin"},
+    {0x16F00, 0x16F9F, "NotoSansMiao"},
+    {0x1B170, 0x1B2FF, "NotoSansNushu"},
+    {0x1BC00, 0x1BC9F, "NotoSansDuployan"},
+    {0x1D2E0, 0x1D2FF, "NotoSansMayanNumerals"},
+    {0x1D400, 0x1D7FF, "NotoSansMath"},
+    {0x1D800, 0x1DAAF, "NotoSansSignWriting"},
+    {0x1E2C0, 0x1E2FF, "NotoSansWancho"},
+    {0x1E800, 0x1E8DF, "NotoSansMendeKikakui"},
+    {0x1E900, 0x1E95F, "NotoSansAdlam NotoSansAdlamUnjoined"},
+    {0x1EC70, 0x1ECBF, "NotoSansIndicSiyaqNumbers"},
+    {0x1EE00, 0x1EEFF, "NotoSansMath"},
+    {0x1F000, 0x1F0FF, "NotoColorEmoji NotoSansSymbols2"},
+    // includes the regional indicators that flags are made of
+    {0x1F100, 0x1F1FF, "NotoColorEmoji NotoSansSymbols"},
+    {0x1F200, 0x1F2FF, "NotoColorEmoji"},
+    {0x1F300, 0x1F6FF, "NotoColorEmoji NotoSansSymbols2"},
+    {0x1F700, 0x1F77F, "NotoSansSymbols"},
+    {0x1F780, 0x1F7FF, "NotoColorEmoji NotoSansSymbols2"},
+    {0x1F800, 0x1F8FF, "NotoSansSymbols2"},
+    {0x1F900, 0x1FAFF, "NotoColorEmoji NotoSansSymbols2"},
+    {0x1FB00, 0x1FBFF, "NotoSansSymbols2"},
+    // tags, for the subdivision flags (🏴 + england, scotland, wales)
+    {0xE0020, 0xE007F, "NotoColorEmoji"},
+};
+}
+
+const QVector<FontCoverage::Range> &FontCoverage::index()
+{
+    // a function static is built once, and C++ makes any other thread that gets here meanwhile wait for it
+    static const QVector<Range> ranges = [] {
+        QVector<Range> built;
+        built.reserve(static_cast<int>(std::size(coverage)));
+        for (const auto &entry : coverage) {
+            built.push_back({entry.first, entry.last, QString::fromLatin1(entry.families).split(QLatin1Char(' '))});
+        }
+        std::sort(built.begin(), built.end(), [](const Range &a, const Range &b) { return a.first < b.first; });
+        return built;
+    }();
+    return ranges;
+}
+
+void FontCoverage::prepare()
+{
+    index();
+}
+
+QStringList FontCoverage::fallbacksFor(const QString &text)
+{
+    QStringList families;
+    const auto &ranges = index();
+    // runs of the same script are common, so remember the last range we found and check that first
+    const Range *last = nullptr;
+
+    const auto *chars = text.constData();
+    const auto length = static_cast<int>(text.size());
+    for (auto i = 0; i < length; ++i) {
+        char32_t codePoint = chars[i].unicode();
+        if (codePoint < mainFontCovers) {
+            // the usual case. Surrogates are way up at 0xD800, so they never end up here
+            continue;
+        }
+        if (chars[i].isHighSurrogate() && i + 1 < length && chars[i + 1].isLowSurrogate()) {
+            codePoint = QChar::surrogateToUcs4(chars[i], chars[i + 1]);
+            ++i;
+        }
+
+        if (last && codePoint >= last->first && codePoint <= last->last) {
+            continue;
+        }
+        // first range starting after this code point, then step back one to the range it might be in
+        const auto after = std::upper_bound(ranges.cbegin(), ranges.cend(), codePoint,
+                                            [](const char32_t c, const Range &range) { return c < range.first; });
+        if (after == ranges.cbegin() || codePoint > std::prev(after)->last) {
+            // nothing of ours covers it. Qt can still have a go with the main font and the system's fallbacks
+            continue;
+        }
+        last = &*std::prev(after);
+
+        for (const auto &family : last->families) {
+            if (!families.contains(family)) {
+                families.push_back(family);
+            }
+        }
+    }
+    return families;
+}
+
+QStringList FontCoverage::allFamilies()
+{
+    QStringList families;
+    for (const auto &range : index()) {
+        for (const auto &family : range.families) {
+            if (!families.contains(family)) {
+                families.push_back(family);
+            }
+        }
+    }
+    return families;
+}
@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef FONTCOVERAGE_H
+#define FONTCOVERAGE_H
+
+#include <QStringList>
+#include <QVector>
+
+/*
+ * Knows which of our fallback fonts covers which bits of unicode, so each message only asks Qt for the fonts it
+ * actually needs.
+ *
+ * We used to register ~150 Noto families as substitutions for NotoSans. Then any character NotoSans didn't have could
+ * make Qt go looking through all of them, even when the message was plain English. Now the code points in a message
+ * are looked up in a table of unicode ranges, and the font gets just the families those ranges need, in the order
+ * they turn up.
+ */
+class FontCoverage
+{
+public:
+    /*
+     * Works out the fallback families for some text
+     *
+     * @param text - the text that's about to be drawn
+     *
+     * @return the families to try (in order) after the main font. Empty for text the main font covers by itself.
+     */
+    static QStringList fallbacksFor(const QString &text);
+
+    /*
+     * @return every family the coverage table knows about
+     */
+    static QStringList allFamilies();
+
+    /*
+     * Builds the lookup table now rather than on the first message
+     */
+    static void prepare();
+
+private:
+    // one contiguous range of code points, and who to ask for them (best first)
+    struct Range
+    {
+        char32_t first;
+        char32_t last;
+        QStringList families;
+    };
+
+    /*
+     * @return the table, sorted, built on first use
+     */
+    static const QVector<Range> &index();
+};
+
+
+#endif //FONTCOVERAGE_H
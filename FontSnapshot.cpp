@@ -0,0 +1,177 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "FontSnapshot.h"
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QFontDatabase>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QSet>
+#include <QStandardPaths>
+#include <cstdio>
+#include <map>
+#include "FontCoverage.h"
+
+bool FontSnapshot::use(const QString &directory)
+{
+    const QDir snapshot(directory);
+    if (!snapshot.exists(QStringLiteral("fonts.conf")) || !snapshot.exists(QStringLiteral("manifest.json"))) {
+        return false;
+    }
+    // fontconfig (xcb, offscreen, wayland...) reads our config instead of the system's, so the snapshot is all it sees
+    qputenv("FONTCONFIG_FILE", QFile::encodeName(snapshot.absoluteFilePath(QStringLiteral("fonts.conf"))));
+    // and platforms that use Qt's own little font database look here rather than in Qt's lib/fonts
+    qputenv("QT_QPA_FONTDIR", QFile::encodeName(snapshot.absolutePath()));
+    return true;
+}
+
+int FontSnapshot::build(const QString &directory, const bool strict)
+{
+    QDir snapshot(directory);
+    if (!snapshot.mkpath(QStringLiteral("."))) {
+        std::fprintf(stderr, "Couldn't create %s\n", directory.toLocal8Bit().constData());
+        return 1;
+    }
+
+    std::map<QString, QString> wanted; // normalised name -> the name we ask for
+    for (const auto &family : families()) {
+        wanted.emplace(normalised(family), family);
+    }
+
+    // Qt won't say which file a family came from, so load each file on its own and ask what's in it. Slow, but
+    // that's why this is a build step
+    std::map<QString, QStringList> found; // the name we ask for -> files
+    std::map<QString, QString> copied; // system file -> its name in the snapshot
+    QSet<QString> names;
+    for (const auto &path : systemFontFiles()) {
+        const auto id = QFontDatabase::addApplicationFont(path);
+        if (id < 0) {
+            continue;
+        }
+        for (const auto &family : QFontDatabase::applicationFontFamilies(id)) {
+            const auto match = wanted.find(normalised(family));
+            if (match == wanted.end()) {
+                continue;
+            }
+            // collections can hold more than one family we want, but only need copying once
+            auto &name = copied[path];
+            if (name.isEmpty()) {
+                // two directories can have a file of the same name, so the second gets its directory's name on the front
+                name = QFileInfo(path).fileName();
+                if (names.contains(name)) {
+                    name = QFileInfo(path).dir().dirName() + QLatin1Char('-') + name;
+                }
+                names.insert(name);
+                snapshot.remove(name);
+                if (!QFile::copy(path, snapshot.filePath(name))) {
+                    std::fprintf(stderr, "Couldn't copy %s\n", path.toLocal8Bit().constData());
+                    return 1;
+                }
+            }
+            if (!found[match->second].contains(name)) {
+                found[match->second].push_back(name);
+            }
+        }
+        QFontDatabase::removeApplicationFont(id);
+    }
+
+    QJsonObject familyFiles;
+    QJsonArray missing;
+    for (const auto &family : families()) {
+        if (const auto files = found.find(family); files != found.end()) {
+            familyFiles[family] = QJsonArray::fromStringList(files->second);
+        } else {
+            missing.append(family);
+        }
+    }
+    QJsonObject manifest;
+    manifest["version"] = 1;
+    manifest["families"] = familyFiles;
+    manifest["missing"] = missing;
+
+    // the snapshot and nothing else, and no checking it for changes either: it only changes when it's rebuilt
+    const auto absolute = snapshot.absolutePath().toHtmlEscaped();
+    const auto config = QStringLiteral("<?xml version=\"1.0\"?>\n"
+                                       "<!DOCTYPE fontconfig SYSTEM \"fonts.dtd\">\n"
+                                       "<fontconfig>\n"
+                                       "  <dir>%1</dir>\n"
+                                       "  <cachedir>%1/cache</cachedir>\n"
+                                       "  <config><rescan><int>0</int></rescan></config>\n"
+                                       "</fontconfig>\n").arg(absolute);
+
+    QFile configFile(snapshot.filePath(QStringLiteral("fonts.conf")));
+    QFile manifestFile(snapshot.filePath(QStringLiteral("manifest.json")));
+    if (!configFile.open(QIODevice::WriteOnly | QIODevice::Truncate) || configFile.write(config.toUtf8()) < 0
+        || !manifestFile.open(QIODevice::WriteOnly | QIODevice::Truncate)
+        || manifestFile.write(QJsonDocument(manifest).toJson()) < 0) {
+        std::fprintf(stderr, "Couldn't write the snapshot's config to %s\n", directory.toLocal8Bit().constData());
+        return 1;
+    }
+    configFile.close();
+    manifestFile.close();
+
+    // fontconfig's cache, made now so the first sticker doesn't have to. If there's no fc-cache, the first sticker will
+    QProcess cache;
+    auto environment = QProcessEnvironment::systemEnvironment();
+    environment.insert(QStringLiteral("FONTCONFIG_FILE"), configFile.fileName());
+    cache.setProcessEnvironment(environment);
+    cache.start(QStringLiteral("fc-cache"), {QStringLiteral("-f"), snapshot.absolutePath()});
+    cache.waitForFinished(60000);
+
+    for (const auto &family : missing) {
+        std::fprintf(stderr, "Couldn't find %s; its characters will fall back to whatever's in the snapshot\n",
+                     family.toString().toLocal8Bit().constData());
+    }
+    std::printf("Font snapshot in %s: %zu of %d families\n",
+                snapshot.absolutePath().toLocal8Bit().constData(),
+                found.size(),
+                static_cast<int>(families().size()));
+    return strict && !missing.isEmpty() ? 2 : 0;
+}
+
+QStringList FontSnapshot::families()
+{
+    // layoutText's main font and entityFormat's monospace one, then every fallback FontCoverage might hand out
+    // (the emoji font among them)
+    QStringList families{QStringLiteral("NotoSans"), QStringLiteral("Noto Mono")};
+    for (const auto &family : FontCoverage::allFamilies()) {
+        if (!families.contains(family)) {
+            families.push_back(family);
+        }
+    }
+    return families;
+}
+
+QString FontSnapshot::normalised(const QString &family)
+{
+    return family.toLower().remove(QLatin1Char(' '));
+}
+
+QStringList FontSnapshot::systemFontFiles()
+{
+    auto directories = QStandardPaths::standardLocations(QStandardPaths::FontsLocation);
+    directories << QStringLiteral("/usr/share/fonts") << QStringLiteral("/usr/local/share/fonts");
+
+    QStringList files;
+    QSet<QString> seen;
+    for (const auto &directory : directories) {
+        QDirIterator it(directory,
+                        {QStringLiteral("*.ttf"), QStringLiteral("*.otf"), QStringLiteral("*.ttc"),
+                         QStringLiteral("*.otc")},
+                        QDir::Files,
+                        QDirIterator::Subdirectories | QDirIterator::FollowSymlinks);
+        while (it.hasNext()) {
+            const auto path = QFileInfo(it.next()).canonicalFilePath();
+            if (!path.isEmpty() && !seen.contains(path)) {
+                seen.insert(path);
+                files.push_back(path);
+            }
+        }
+    }
+    return files;
+}
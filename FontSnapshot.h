@@ -0,0 +1,68 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef FONTSNAPSHOT_H
+#define FONTSNAPSHOT_H
+
+#include <QString>
+#include <QStringList>
+
+/*
+ * A directory holding just the fonts stickers are drawn with (NotoSans, the monospace font, the emoji font and the
+ * fallbacks in FontCoverage's table), plus a fontconfig config that points at nothing else.
+ *
+ * Normally the first QFont makes fontconfig look at every font installed, which with the whole Noto set is most of
+ * a cold start. Pointed at a snapshot, it only ever looks at the snapshot, and there's a cache of that in there too.
+ *
+ * Building one is slow (it goes through all the system's fonts to find ours), so it's a build or install step:
+ *   sticker --build-font-snapshot /usr/local/share/sticker/fonts
+ * and then every run uses it:
+ *   sticker --font-snapshot /usr/local/share/sticker/fonts ...
+ * The directory gets:
+ *   fonts.conf     - a fontconfig config with the snapshot as its only font directory
+ *   manifest.json  - which files each family came from, and which families couldn't be found
+ *   cache/         - fontconfig's cache of the lot, if fc-cache was around to build it
+ *   the font files themselves, copied
+ */
+class FontSnapshot
+{
+public:
+    /*
+     * Points Qt (and fontconfig) at a snapshot. Has to happen before the QGuiApplication is created.
+     *
+     * @param directory - a snapshot, from `build`
+     *
+     * @return false if there's no snapshot there, in which case nothing was changed
+     */
+    static bool use(const QString &directory);
+
+    /*
+     * Finds our fonts among the system's and copies them into a snapshot. Needs a QGuiApplication.
+     *
+     * @param directory - where to put the snapshot. Created if need be; files already there are replaced.
+     * @param strict - whether a missing family is a failure. Most systems don't have every fallback font, and the
+     *                 snapshot is still usable without them, so usually it's only a warning.
+     *
+     * @return 0 if it was written (and, if strict, every family was found), 2 if strict and some weren't, 1 if it
+     * couldn't be written
+     */
+    static int build(const QString &directory, bool strict = false);
+
+    /*
+     * @return the families stickers are drawn with, main font first
+     */
+    static QStringList families();
+
+private:
+    /*
+     * Family names the way fontconfig compares them: without case or spaces, so "Noto Sans" is "NotoSans"
+     */
+    static QString normalised(const QString &family);
+
+    /*
+     * @return every font file in the usual system and user font directories
+     */
+    static QStringList systemFontFiles();
+};
+
+
+#endif //FONTSNAPSHOT_H
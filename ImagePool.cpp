@@ -0,0 +1,136 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "ImagePool.h"
+#include <QMutex>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+namespace
+{
+// anything smaller comes from malloc's own free lists anyway, without a page fault in sight
+constexpr size_t smallest = 64 * 1024;
+
+// each buffer starts with its size class, so it knows where to go back to. 64 bytes keeps the pixels aligned
+constexpr size_t header = 64;
+
+struct Pool
+{
+    QMutex mutex;
+    // size class -> idle buffers of that size
+    std::map<size_t, std::vector<void *>> idle;
+    size_t idleBytes = 0;
+    size_t maxBytes = 64 * 1024 * 1024;
+    quint64 reused = 0;
+    quint64 allocated = 0;
+    int idleCount = 0;
+
+    // frees idle buffers, biggest first, until we're within the limit
+    void trim()
+    {
+        while (idleBytes > maxBytes && !idle.empty()) {
+            auto biggest = std::prev(idle.end());
+            std::free(biggest->second.back());
+            biggest->second.pop_back();
+            idleBytes -= biggest->first;
+            --idleCount;
+            if (biggest->second.empty()) {
+                idle.erase(biggest);
+            }
+        }
+    }
+};
+
+Pool &pool()
+{
+    // never destroyed: pictures in other statics (the avatar cache, say) can give their buffers back during exit
+    static auto *pool = new Pool;
+    return *pool;
+}
+
+// the size class `bytes` falls into: the next of 1, 1.25, 1.5 or 1.75 times a power of two
+size_t sizeClass(const size_t bytes)
+{
+    auto power = smallest;
+    while (power * 2 <= bytes) {
+        power *= 2;
+    }
+    const auto step = power / 4;
+    return (bytes + step - 1) / step * step;
+}
+}
+
+QImage ImagePool::take(const QSize &size, const QImage::Format format)
+{
+    const auto bytesPerLine = static_cast<size_t>(qMax(size.width(), 0)) * 4;
+    const auto bytes = bytesPerLine * static_cast<size_t>(qMax(size.height(), 0));
+    if (bytes < smallest) {
+        return QImage(size, format);
+    }
+
+    const auto bucket = sizeClass(bytes);
+    void *block = nullptr;
+    {
+        auto &p = pool();
+        QMutexLocker locker(&p.mutex);
+        if (auto spare = p.idle.find(bucket); spare != p.idle.end()) {
+            block = spare->second.back();
+            spare->second.pop_back();
+            if (spare->second.empty()) {
+                p.idle.erase(spare);
+            }
+            p.idleBytes -= bucket;
+            --p.idleCount;
+            ++p.reused;
+        } else {
+            ++p.allocated;
+        }
+    }
+    if (!block) {
+        block = std::malloc(header + bucket);
+        if (!block) {
+            return QImage(size, format);
+        }
+        *static_cast<size_t *>(block) = bucket;
+    }
+
+    return QImage(static_cast<uchar *>(block) + header, size.width(), size.height(),
+                  static_cast<int>(bytesPerLine), format, release, block);
+}
+
+void ImagePool::setMaxKiB(const int maxKiB)
+{
+    auto &p = pool();
+    QMutexLocker locker(&p.mutex);
+    p.maxBytes = static_cast<size_t>(qMax(maxKiB, 0)) * 1024;
+    p.trim();
+}
+
+CacheStats ImagePool::stats()
+{
+    auto &p = pool();
+    QMutexLocker locker(&p.mutex);
+    CacheStats stats;
+    stats.hits = p.reused;
+    stats.misses = p.allocated;
+    stats.entries = p.idleCount;
+    stats.usedKiB = static_cast<int>(p.idleBytes / 1024);
+    stats.maxKiB = static_cast<int>(p.maxBytes / 1024);
+    return stats;
+}
+
+void ImagePool::release(void *block)
+{
+    const auto bucket = *static_cast<size_t *>(block);
+    auto &p = pool();
+    QMutexLocker locker(&p.mutex);
+    if (bucket > p.maxBytes) {
+        std::free(block);
+        return;
+    }
+    p.idle[bucket].push_back(block);
+    p.idleBytes += bucket;
+    ++p.idleCount;
+    p.trim();
+}
@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef IMAGEPOOL_H
+#define IMAGEPOOL_H
+
+#include <QImage>
+#include <QSize>
+#include "LruCache.h"
+
+/*
+ * Pixel buffers for the big short-lived pictures a sticker goes through (the canvas, supersampled layers, whatever
+ * Downscale makes, the encoder's unpremultiplied copy), handed back out instead of freed.
+ *
+ * Buffers that size are mmapped and unmapped by malloc every time, so every sticker used to page fault its way
+ * through fresh memory several times over. Now the memory goes back here when the last QImage using it goes away,
+ * and the next picture about that size gets it again, so a long-running process settles down to reusing the same
+ * few buffers.
+ *
+ * Buffers come in size classes a quarter of a power of two apart, so a picture gets one at most a quarter bigger
+ * than it needs. Idle buffers are kept up to a limit (64MiB unless told otherwise), and anything past it is freed.
+ * Small pictures aren't worth the lock, so they're plain QImages.
+ *
+ * The pixels in a buffer are whatever the last picture left there: fill it if you need it clear.
+ */
+class ImagePool
+{
+public:
+    /*
+     * @param size - how big a picture
+     * @param format - any 32-bit format
+     *
+     * @return a picture whose pixels are garbage, backed by a pooled buffer if it's big enough to be worth one
+     */
+    static QImage take(const QSize &size, QImage::Format format = QImage::Format_ARGB32_Premultiplied);
+
+    /*
+     * Changes how much idle memory is kept, freeing buffers if we're now over it
+     */
+    static void setMaxKiB(int maxKiB);
+
+    /*
+     * @return hits are buffers handed out again, misses are ones that had to be allocated. Entries and usedKiB are
+     * the idle buffers
+     */
+    static CacheStats stats();
+
+private:
+    /*
+     * Where a buffer goes when the last picture using it is done with it
+     */
+    static void release(void *block);
+};
+
+
+#endif //IMAGEPOOL_H
@@ -0,0 +1,102 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef LRUCACHE_H
+#define LRUCACHE_H
+
+#include <QCache>
+#include <QMutex>
+#include <QString>
+
+/*
+ * How a cache has been doing. Handy for working out whether it's worth its memory.
+ */
+struct CacheStats
+{
+    quint64 hits = 0;
+    quint64 misses = 0;
+    int entries = 0;
+    // how full it is, and how full it's allowed to get, in KiB
+    int usedKiB = 0;
+    int maxKiB = 0;
+};
+
+/*
+ * QCache (which already throws out the least recently used things first), plus a lock so every worker thread can
+ * share it, plus hit/miss counters.
+ * Values are copied in and out, so keep to implicitly shared things like QImage and QByteArray where that's cheap.
+ */
+template <typename T>
+class LruCache
+{
+public:
+    /*
+     * @param maxKiB - the most memory the cache may hold, roughly
+     */
+    explicit LruCache(const int maxKiB)
+    {
+        cache.setMaxCost(maxKiB);
+    }
+
+    /*
+     * Looks something up, and counts it as a hit or a miss
+     *
+     * @param key - what it was stored under
+     * @param value - gets a copy of what was stored, if anything was
+     *
+     * @return whether it was there
+     */
+    bool find(const QString &key, T &value)
+    {
+        QMutexLocker locker(&mutex);
+        if (const auto *found = cache.object(key)) {
+            ++hits;
+            value = *found;
+            return true;
+        }
+        ++misses;
+        return false;
+    }
+
+    /*
+     * Stores something, possibly pushing older things out. Things bigger than the whole cache aren't kept at all.
+     *
+     * @param key - what to store it under
+     * @param value - what to store
+     * @param costKiB - how much memory it's holding on to
+     */
+    void insert(const QString &key, const T &value, const int costKiB)
+    {
+        QMutexLocker locker(&mutex);
+        cache.insert(key, new T(value), qMax(costKiB, 1));
+    }
+
+    /*
+     * Changes the memory limit, throwing things out if we're now over it
+     */
+    void setMaxKiB(const int maxKiB)
+    {
+        QMutexLocker locker(&mutex);
+        cache.setMaxCost(maxKiB);
+    }
+
+    CacheStats stats() const
+    {
+        QMutexLocker locker(&mutex);
+        CacheStats stats;
+        stats.hits = hits;
+        stats.misses = misses;
+        stats.entries = static_cast<int>(cache.count());
+        stats.usedKiB = static_cast<int>(cache.totalCost());
+        stats.maxKiB = static_cast<int>(cache.maxCost());
+        return stats;
+    }
+
+private:
+    mutable QMutex mutex;
+    QCache<QString, T> cache;
+    quint64 hits = 0;
+    quint64 misses = 0;
+};
+
+
+#endif //LRUCACHE_H
@@ -0,0 +1,730 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "PayloadParser.h"
+#include <QColor>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <climits>
+#include <string_view>
+#include <utility>
+#include "StickerRequest.h"
+
+namespace
+{
+// any deeper than this and it's not a sticker payload, it's an attempt on our stack
+constexpr int maxDepth = 64;
+
+// the most messages one sticker can have
+constexpr int maxMessages = 32;
+
+/*
+ * Walks through the bytes of one payload. Everything returns false as soon as something's wrong, and the first thing
+ * that went wrong is what ends up in `error`.
+ */
+class Reader
+{
+public:
+    Reader(const char *begin, const char *end) : start(begin), p(begin), end(end) {}
+
+    PayloadError error;
+
+    bool fail(const PayloadError::Code code, const char *field = nullptr)
+    {
+        if (!error) {
+            error.code = code;
+            error.offset = p - start;
+            error.field = field;
+        }
+        return false;
+    }
+
+    // the next byte that isn't whitespace, without taking it. '\0' at the end
+    char peek()
+    {
+        while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+            ++p;
+        }
+        return p < end ? *p : '\0';
+    }
+
+    bool atEnd()
+    {
+        peek();
+        return p == end;
+    }
+
+    bool take(const char c)
+    {
+        if (peek() != c) {
+            return false;
+        }
+        ++p;
+        return true;
+    }
+
+    bool literal(const std::string_view word)
+    {
+        if (static_cast<size_t>(end - p) < word.size() || std::string_view(p, word.size()) != word) {
+            return fail(PayloadError::Syntax);
+        }
+        p += word.size();
+        return true;
+    }
+
+    /*
+     * Reads an object, calling `member` with each key. `member` has to read (or skip) the value, and has to be done
+     * with the key before it does: an escaped key lives in the same scratch space as the next escaped string.
+     */
+    template<typename Member>
+    bool object(Member &&member, const int depth)
+    {
+        if (depth > maxDepth) {
+            return fail(PayloadError::TooDeep);
+        }
+        if (!take('{')) {
+            return fail(PayloadError::Syntax);
+        }
+        if (take('}')) {
+            return true;
+        }
+        do {
+            std::string_view key;
+            if (peek() != '"') {
+                return fail(PayloadError::Syntax);
+            }
+            if (!rawString(key)) {
+                return false;
+            }
+            if (!take(':')) {
+                return fail(PayloadError::Syntax);
+            }
+            if (!member(key)) {
+                return false;
+            }
+        } while (take(','));
+        return take('}') || fail(PayloadError::Syntax);
+    }
+
+    // reads an array, calling `element` to read (or skip) each element
+    template<typename Element>
+    bool array(Element &&element, const int depth)
+    {
+        if (depth > maxDepth) {
+            return fail(PayloadError::TooDeep);
+        }
+        if (!take('[')) {
+            return fail(PayloadError::Syntax);
+        }
+        if (take(']')) {
+            return true;
+        }
+        do {
+            if (!element()) {
+                return false;
+            }
+        } while (take(','));
+        return take(']') || fail(PayloadError::Syntax);
+    }
+
+    /*
+     * Reads a string's bytes, unescaped. Most strings have no escapes, and come back pointing straight into the
+     * payload; the rest point into `unescaped`, which is only good until the next string.
+     */
+    bool rawString(std::string_view &out)
+    {
+        ++p; // the opening quote, which the caller has peeked at
+        const auto *begin = p;
+        while (p < end && *p != '"' && *p != '\\' && static_cast<unsigned char>(*p) >= 0x20) {
+            ++p;
+        }
+        if (p < end && *p == '"') {
+            out = std::string_view(begin, static_cast<size_t>(p - begin));
+            ++p;
+            return true;
+        }
+
+        unescaped.resize(0);
+        unescaped.append(begin, static_cast<int>(p - begin));
+        while (p < end) {
+            begin = p;
+            while (p < end && *p != '"' && *p != '\\' && static_cast<unsigned char>(*p) >= 0x20) {
+                ++p;
+            }
+            unescaped.append(begin, static_cast<int>(p - begin));
+            if (p == end) {
+                break;
+            }
+            if (*p == '"') {
+                ++p;
+                out = std::string_view(unescaped.constData(), static_cast<size_t>(unescaped.size()));
+                return true;
+            }
+            if (*p != '\\') {
+                return fail(PayloadError::BadString);
+            }
+            if (++p == end) {
+                break;
+            }
+            switch (*p++) {
+            case '"': unescaped.append('"'); break;
+            case '\\': unescaped.append('\\'); break;
+            case '/': unescaped.append('/'); break;
+            case 'b': unescaped.append('\b'); break;
+            case 'f': unescaped.append('\f'); break;
+            case 'n': unescaped.append('\n'); break;
+            case 'r': unescaped.append('\r'); break;
+            case 't': unescaped.append('\t'); break;
+            case 'u':
+                if (!codePoint()) {
+                    return false;
+                }
+                break;
+            default:
+                --p;
+                return fail(PayloadError::BadString);
+            }
+        }
+        return fail(PayloadError::Syntax); // ran out before the closing quote
+    }
+
+    // reads a number. Integers (nearly everything in a payload) don't go anywhere near a double parser
+    bool number(double &out)
+    {
+        const auto *begin = p;
+        if (p < end && *p == '-') {
+            ++p;
+        }
+        const auto *digits = p;
+        qint64 whole = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (p - digits < 18) {
+                whole = whole * 10 + (*p - '0');
+            }
+            ++p;
+        }
+        if (p == digits) {
+            return fail(PayloadError::Syntax);
+        }
+        if (p - digits <= 15 && (p == end || (*p != '.' && *p != 'e' && *p != 'E'))) {
+            out = static_cast<double>(*begin == '-' ? -whole : whole);
+            return true;
+        }
+        while (p < end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E' || *p == '+' || *p == '-')) {
+            ++p;
+        }
+        // QByteArray's conversion, not strtod, which would follow the C locale QGuiApplication set up
+        auto ok = false;
+        out = QByteArray::fromRawData(begin, static_cast<int>(p - begin)).toDouble(&ok);
+        return ok || fail(PayloadError::Syntax);
+    }
+
+    // skips a value of any type
+    bool skip(const int depth)
+    {
+        switch (peek()) {
+        case '{':
+            return object([this, depth](std::string_view) { return skip(depth + 1); }, depth);
+        case '[':
+            return array([this, depth] { return skip(depth + 1); }, depth);
+        case '"': {
+            std::string_view ignored;
+            return rawString(ignored);
+        }
+        case 't':
+            return literal("true");
+        case 'f':
+            return literal("false");
+        case 'n':
+            return literal("null");
+        default:
+            double ignored;
+            return number(ignored);
+        }
+    }
+
+    // reads a value of any type, for the bits of the payload we pass along without looking inside
+    bool value(QJsonValue &out, const int depth)
+    {
+        switch (peek()) {
+        case '{': {
+            QJsonObject json;
+            const auto read = object([this, depth, &json](std::string_view key) {
+                const auto name = QString::fromUtf8(key.data(), static_cast<int>(key.size()));
+                QJsonValue member;
+                if (!value(member, depth + 1)) {
+                    return false;
+                }
+                json.insert(name, member);
+                return true;
+            }, depth);
+            out = json;
+            return read;
+        }
+        case '[': {
+            QJsonArray json;
+            const auto read = array([this, depth, &json] {
+                QJsonValue element;
+                if (!value(element, depth + 1)) {
+                    return false;
+                }
+                json.append(element);
+                return true;
+            }, depth);
+            out = json;
+            return read;
+        }
+        case '"': {
+            std::string_view raw;
+            if (!rawString(raw)) {
+                return false;
+            }
+            out = QString::fromUtf8(raw.data(), static_cast<int>(raw.size()));
+            return true;
+        }
+        case 't':
+            out = true;
+            return literal("true");
+        case 'f':
+            out = false;
+            return literal("false");
+        case 'n':
+            out = QJsonValue();
+            return literal("null");
+        default:
+            double parsed;
+            if (!number(parsed)) {
+                return false;
+            }
+            out = parsed;
+            return true;
+        }
+    }
+
+    // The fields we know about. null counts as not being there, and leaves `out` alone; the wrong type is an error.
+
+    bool readName(std::string_view &out, const char *field)
+    {
+        const auto c = peek();
+        if (c == 'n') {
+            return literal("null");
+        }
+        if (c != '"') {
+            return fail(PayloadError::WrongType, field);
+        }
+        return rawString(out);
+    }
+
+    bool readString(QString &out, const char *field)
+    {
+        std::string_view raw;
+        if (peek() == 'n') {
+            return literal("null");
+        }
+        if (!readName(raw, field)) {
+            return false;
+        }
+        out = QString::fromUtf8(raw.data(), static_cast<int>(raw.size()));
+        return true;
+    }
+
+    bool readNumber(double &out, const char *field)
+    {
+        const auto c = peek();
+        if (c == 'n') {
+            return literal("null");
+        }
+        if (c != '-' && (c < '0' || c > '9')) {
+            return fail(PayloadError::WrongType, field);
+        }
+        return number(out);
+    }
+
+    bool readInt(int &out, const char *field)
+    {
+        double number = out;
+        if (!readNumber(number, field)) {
+            return false;
+        }
+        out = static_cast<int>(qBound(static_cast<double>(INT_MIN), number, static_cast<double>(INT_MAX)));
+        return true;
+    }
+
+    bool readBool(bool &out, const char *field)
+    {
+        switch (peek()) {
+        case 'n':
+            return literal("null");
+        case 't':
+            out = true;
+            return literal("true");
+        case 'f':
+            out = false;
+            return literal("false");
+        default:
+            return fail(PayloadError::WrongType, field);
+        }
+    }
+
+    template<typename Member>
+    bool readObject(Member &&member, const char *field, const int depth)
+    {
+        const auto c = peek();
+        if (c == 'n') {
+            return literal("null");
+        }
+        if (c != '{') {
+            return fail(PayloadError::WrongType, field);
+        }
+        return object(std::forward<Member>(member), depth);
+    }
+
+    template<typename Element>
+    bool readArray(Element &&element, const char *field, const int depth)
+    {
+        const auto c = peek();
+        if (c == 'n') {
+            return literal("null");
+        }
+        if (c != '[') {
+            return fail(PayloadError::WrongType, field);
+        }
+        return array(std::forward<Element>(element), depth);
+    }
+
+private:
+    // reads the XXXX of a \uXXXX, plus the second half of a surrogate pair, and appends it to `unescaped` as UTF-8
+    bool codePoint()
+    {
+        char32_t unit = 0;
+        if (!hex(unit)) {
+            return false;
+        }
+        if (unit >= 0xD800 && unit < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+            p += 2;
+            char32_t low = 0;
+            if (!hex(low)) {
+                return false;
+            }
+            if (low >= 0xDC00 && low < 0xE000) {
+                unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+            } else {
+                appendUtf8(0xFFFD);
+                unit = low;
+            }
+        }
+        // half a surrogate pair is what QJsonDocument would have turned into a replacement character too
+        appendUtf8(unit >= 0xD800 && unit < 0xE000 ? 0xFFFD : unit);
+        return true;
+    }
+
+    bool hex(char32_t &out)
+    {
+        if (end - p < 4) {
+            return fail(PayloadError::BadString);
+        }
+        for (auto i = 0; i < 4; ++i, ++p) {
+            const auto c = *p;
+            out <<= 4;
+            if (c >= '0' && c <= '9') {
+                out |= static_cast<char32_t>(c - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                out |= static_cast<char32_t>(c - 'a' + 10);
+            } else if (c >= 'A' && c <= 'F') {
+                out |= static_cast<char32_t>(c - 'A' + 10);
+            } else {
+                return fail(PayloadError::BadString);
+            }
+        }
+        return true;
+    }
+
+    void appendUtf8(const char32_t c)
+    {
+        if (c < 0x80) {
+            unescaped.append(static_cast<char>(c));
+        } else if (c < 0x800) {
+            unescaped.append(static_cast<char>(0xC0 | (c >> 6)));
+            unescaped.append(static_cast<char>(0x80 | (c & 0x3F)));
+        } else if (c < 0x10000) {
+            unescaped.append(static_cast<char>(0xE0 | (c >> 12)));
+            unescaped.append(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            unescaped.append(static_cast<char>(0x80 | (c & 0x3F)));
+        } else {
+            unescaped.append(static_cast<char>(0xF0 | (c >> 18)));
+            unescaped.append(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+            unescaped.append(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+            unescaped.append(static_cast<char>(0x80 | (c & 0x3F)));
+        }
+    }
+
+    const char *start;
+    const char *p;
+    const char *end;
+    QByteArray unescaped;
+};
+
+// one message's worth of fields, as they turn up
+struct MessageFields
+{
+    // whether there was anything in it at all
+    bool present = false;
+    QString text;
+    QList<Entity> entities;
+    ChatUser from;
+};
+
+bool readUser(Reader &in, ChatUser &from, const int depth)
+{
+    return in.readObject([&in, &from, depth](std::string_view key) {
+        if (key == "name") {
+            return in.readString(from.name, "message.from.name");
+        }
+        if (key == "avatar") {
+            return in.readString(from.avatar, "message.from.avatar");
+        }
+        if (key == "first_name") {
+            return in.readString(from.first_name, "message.from.first_name");
+        }
+        if (key == "last_name") {
+            return in.readString(from.last_name, "message.from.last_name");
+        }
+        if (key == "id") {
+            return in.readNumber(from.id, "message.from.id");
+        }
+        return in.skip(depth + 1);
+    }, "message.from", depth);
+}
+
+// we expect entities that look like telegram bot api's, but we normalize a bit
+bool readEntities(Reader &in, QList<Entity> &entities, const int depth)
+{
+    return in.readArray([&in, &entities, depth] {
+        if (in.peek() == 'n') {
+            return in.literal("null");
+        }
+        Entity entity{_, 0, 0};
+        auto length = 0;
+        const auto read = in.readObject([&in, &entity, &length, depth](std::string_view key) {
+            if (key == "type") {
+                std::string_view type;
+                if (!in.readName(type, "message.entities.type")) {
+                    return false;
+                }
+                entity.type = entityType(type);
+                return true;
+            }
+            if (key == "offset") {
+                return in.readInt(entity.offset, "message.entities.offset");
+            }
+            if (key == "length") {
+                return in.readInt(length, "message.entities.length");
+            }
+            return in.skip(depth + 2);
+        }, "message.entities", depth + 1);
+        entity.length = length;
+        entities.push_back(entity);
+        return read;
+    }, "message.entities", depth);
+}
+
+bool readMessage(Reader &in, MessageFields &message, const int depth)
+{
+    return in.readObject([&in, &message, depth](std::string_view key) {
+        message.present = true;
+        if (key == "text") {
+            return in.readString(message.text, "message.text");
+        }
+        if (key == "entities") {
+            return readEntities(in, message.entities, depth + 1);
+        }
+        if (key == "from") {
+            return readUser(in, message.from, depth + 1);
+        }
+        return in.skip(depth + 1);
+    }, "message", depth);
+}
+}
+
+const char *PayloadError::name() const
+{
+    switch (code) {
+    case None: return "none";
+    case Empty: return "empty";
+    case Syntax: return "syntax";
+    case BadString: return "badString";
+    case TooDeep: return "tooDeep";
+    case NotAnObject: return "notAnObject";
+    case NoMessage: return "noMessage";
+    case WrongType: return "wrongType";
+    case UnknownFormat: return "unknownFormat";
+    }
+    return "unknown";
+}
+
+QString PayloadError::message() const
+{
+    switch (code) {
+    case None:
+        return QString();
+    case Empty:
+        return QStringLiteral("payload is empty");
+    case Syntax:
+        return QStringLiteral("payload isn't valid JSON (at byte %1)").arg(offset);
+    case BadString:
+        return QStringLiteral("payload has a bad string escape or control character (at byte %1)").arg(offset);
+    case TooDeep:
+        return QStringLiteral("payload is nested too deeply (at byte %1)").arg(offset);
+    case NotAnObject:
+        return QStringLiteral("payload isn't a JSON object");
+    case NoMessage:
+        return QStringLiteral("payload has no message object");
+    case WrongType:
+        return QStringLiteral("%1 has the wrong type (at byte %2)").arg(QLatin1String(field)).arg(offset);
+    case UnknownFormat:
+        return QStringLiteral("payload asks for an image format we can't encode");
+    }
+    return QString();
+}
+
+PayloadError PayloadParser::parse(const QByteArray &json, StickerRequest &request)
+{
+    request = StickerRequest();
+    request.id = QJsonValue(QJsonValue::Undefined);
+
+    Reader in(json.constData(), json.constData() + json.size());
+    if (in.atEnd()) {
+        in.fail(PayloadError::Empty);
+        return in.error;
+    }
+    if (in.peek() != '{') {
+        in.fail(PayloadError::NotAnObject);
+        return in.error;
+    }
+
+    // collected as they turn up, and put together at the end, because keys can come in any order
+    QString background;
+    QString format;
+    QJsonValue encoder;
+    MessageFields message;
+    QList<ChatMessage> messages;
+
+    const auto readQuality = [&in, &request](std::string_view key) {
+        if (key == "avatar") {
+            return in.readInt(request.quality.avatar, "quality.avatar");
+        }
+        if (key == "bubble") {
+            return in.readInt(request.quality.bubble, "quality.bubble");
+        }
+        if (key == "names") {
+            return in.readInt(request.quality.names, "quality.names");
+        }
+        if (key == "text") {
+            return in.readInt(request.quality.text, "quality.text");
+        }
+        return in.skip(3);
+    };
+
+    const auto read = in.object([&](std::string_view key) {
+        if (key == "message") {
+            return readMessage(in, message, 2);
+        }
+        if (key == "messages") {
+            return in.readArray([&in, &messages] {
+                MessageFields next;
+                if (!readMessage(in, next, 3)) {
+                    return false;
+                }
+                // any more than this and it's a screenshot of the chat, not a sticker
+                if (next.present && messages.size() < maxMessages) {
+                    messages.push_back(ChatMessage(next.entities, next.from, next.text));
+                }
+                return true;
+            }, "messages", 2);
+        }
+        if (key == "backgroundColor") {
+            return in.readString(background, "backgroundColor");
+        }
+        if (key == "width") {
+            return in.readInt(request.width, "width");
+        }
+        if (key == "scale") {
+            return in.readInt(request.scale, "scale");
+        }
+        if (key == "output") {
+            return in.readString(request.output, "output");
+        }
+        if (key == "format") {
+            return in.readString(format, "format");
+        }
+        if (key == "encoder") {
+            if (const auto c = in.peek(); c != '{' && c != 'n') {
+                return in.fail(PayloadError::WrongType, "encoder");
+            }
+            return in.value(encoder, 2);
+        }
+        if (key == "quality") {
+            return in.readObject(readQuality, "quality", 2);
+        }
+        if (key == "id") {
+            return in.value(request.id, 2);
+        }
+        if (key == "stats") {
+            return in.readBool(request.stats, "stats");
+        }
+        if (key == "autoFit") {
+            // true for square, or a number: how tall the sticker may be, as a multiple of its width
+            if (const auto c = in.peek(); c == 't' || c == 'f') {
+                auto fit = false;
+                if (!in.readBool(fit, "autoFit")) {
+                    return false;
+                }
+                request.autoFit = fit ? 1.0 : 0.0;
+                return true;
+            }
+            return in.readNumber(request.autoFit, "autoFit");
+        }
+        return in.skip(2);
+    }, 1);
+    if (!read) {
+        return in.error;
+    }
+    if (!in.atEnd()) {
+        in.fail(PayloadError::Syntax);
+        return in.error;
+    }
+
+    request.backgroundColour = QColor(background).rgb();
+    // the command line sets the defaults. "format" is the old way to pick one, "encoder" has all the knobs
+    request.encoder = Encoder::defaults();
+    if (!format.isEmpty()) {
+        request.encoder.format = format.toLower().toLatin1();
+    }
+    request.encoder.apply(encoder.toObject());
+    if (!request.encoder.format.isEmpty() && !Encoder::supports(request.encoder.format)) {
+        in.fail(PayloadError::UnknownFormat, "format");
+        in.error.offset = 0;
+        return in.error;
+    }
+
+    // supersampling is opt-in, per part of the sticker, and there's no point going past 4x
+    request.quality.avatar = qBound(1, request.quality.avatar, 4);
+    request.quality.bubble = qBound(1, request.quality.bubble, 4);
+    request.quality.names = qBound(1, request.quality.names, 4);
+    request.quality.text = qBound(1, request.quality.text, 4);
+
+    // anything much taller than 4:1 isn't fitting any more, and NaN isn't anything
+    request.autoFit = request.autoFit > 0 ? qMin(request.autoFit, 4.0) : 0.0;
+
+    // "messages" is for several at once, and wins if there are both
+    if (messages.isEmpty() && message.present) {
+        messages.push_back(ChatMessage(message.entities, message.from, message.text));
+    }
+    if (messages.isEmpty()) {
+        in.fail(PayloadError::NoMessage);
+        in.error.offset = 0;
+        return in.error;
+    }
+    request.messages = messages;
+    return in.error;
+}
@@ -0,0 +1,84 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef PAYLOADPARSER_H
+#define PAYLOADPARSER_H
+
+#include <QByteArray>
+#include <QString>
+
+struct StickerRequest;
+
+/*
+ * What was wrong with a payload, if anything, and where
+ */
+struct PayloadError
+{
+    enum Code
+    {
+        // nothing, it's fine
+        None,
+        // no bytes, or only whitespace
+        Empty,
+        // not JSON: a missing brace, a stray character, something after the end...
+        Syntax,
+        // a string with a bad escape or a raw control character in it
+        BadString,
+        // objects and arrays nested deeper than anyone sensible would send
+        TooDeep,
+        // JSON, but not an object
+        NotAnObject,
+        // no message object, or an empty one, so nothing to draw
+        NoMessage,
+        // a field we know about has the wrong type, like "width":"512"
+        WrongType,
+        // "format" (or the encoder's) is something we can't encode to
+        UnknownFormat
+    };
+
+    Code code = None;
+
+    // byte offset into the payload where it went wrong
+    qsizetype offset = 0;
+
+    // for WrongType, the field in question, like "message.entities.offset"
+    const char *field = nullptr;
+
+    explicit operator bool() const { return code != None; }
+
+    /*
+     * @return a short, stable name for the code, like "syntax", for machines to match on
+     */
+    const char *name() const;
+
+    /*
+     * @return what went wrong, for a human
+     */
+    QString message() const;
+};
+
+/*
+ * Turns a payload's raw UTF-8 bytes straight into a StickerRequest, in one pass, without building a QJsonDocument
+ * (or a QString of the whole thing) on the way. Strings are only decoded for the fields we keep, and keys and entity
+ * types are matched as bytes.
+ *
+ * Fields we don't know about are skipped, whatever they hold. Fields we do know about have to have the right type,
+ * though null is taken to mean "not given". Anything else gets a PayloadError, rather than quietly turning into a 0
+ * or an empty string like it did when everything went through QJsonObject.
+ */
+class PayloadParser
+{
+public:
+    /*
+     * Unmarshalls a payload
+     *
+     * @param json - the payload, as it looks in the README. A trailing newline is fine.
+     * @param request - gets filled in with what we found. Whatever it held before is thrown away.
+     *   The id and stats flag are filled in even when there's no message, for the daemon.
+     *
+     * @return what was wrong with it, if anything
+     */
+    static PayloadError parse(const QByteArray &json, StickerRequest &request);
+};
+
+
+#endif //PAYLOADPARSER_H
@@ -0,0 +1,290 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "PreforkServer.h"
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Encoder.h"
+#include "PayloadParser.h"
+#include "RenderPool.h"
+#include "StickerRequest.h"
+#include "StickerServer.h"
+
+namespace
+{
+// one per worker, in memory the supervisor and every worker share, so the supervisor can see how they're doing.
+// A replacement carries on counting where the worker before it left off
+struct Slot
+{
+    std::atomic<quint64> requests;
+    std::atomic<quint64> failed;
+};
+
+// every worker's slot, mapped before the first fork
+Slot *workerSlots = nullptr;
+
+// this worker's slot, or nothing in the supervisor (and in every other mode)
+Slot *mine = nullptr;
+
+volatile std::sig_atomic_t stopping = 0;
+
+void stop(int)
+{
+    stopping = 1;
+}
+
+// nothing to do but wake the supervisor up, so a worker that's gone is replaced now rather than at the next tick
+void childExited(int)
+{
+}
+
+// what the supervisor knows about each worker
+struct Worker
+{
+    pid_t pid = -1;
+    QElapsedTimer started;
+    int restarts = 0;
+    // when (on the supervisor's clock) it may be forked again, if it died too soon after the last time
+    qint64 notBeforeMs = 0;
+    // for working out the rate between reports
+    quint64 reportedRequests = 0;
+};
+
+constexpr auto reportEveryMs = 60 * 1000;
+
+void say(const QJsonObject &line)
+{
+    const auto json = QJsonDocument(line).toJson(QJsonDocument::Compact) + '\n';
+    std::fwrite(json.constData(), 1, static_cast<size_t>(json.size()), stderr);
+    std::fflush(stderr);
+}
+
+QString describe(const int status)
+{
+    if (WIFSIGNALED(status)) {
+        return QStringLiteral("signal %1").arg(WTERMSIG(status));
+    }
+    return QStringLiteral("exit %1").arg(WEXITSTATUS(status));
+}
+}
+
+int PreforkServer::serve(const QString &path, int workers, int threads, const int maxMiB)
+{
+    if (workers <= 0) {
+        workers = QThread::idealThreadCount();
+    }
+    if (threads <= 0) {
+        threads = qMax(1, QThread::idealThreadCount() / workers);
+    }
+
+    // one sticker, start to finish, so every worker starts with the shaping, glyph and avatar caches already warm.
+    // It's only this thread, and it's done before anything forks
+    StickerRequest warm;
+    const auto warmPayload = QByteArrayLiteral(
+        R"({"backgroundColor":"#243447","width":512,"scale":2,"message":{"text":"warm up 🙂 /start @you",)"
+        R"("entities":[{"type":"bold","offset":0,"length":4},{"type":"bot_command","offset":11,"length":6}],)"
+        R"("from":{"id":1,"name":"Warm Up"}}})");
+    if (!PayloadParser::parse(warmPayload, warm)) {
+        Encoder::encode(warm.render(), warm.encoder);
+    }
+
+    const auto listener = StickerServer::listenOn(path);
+    if (listener < 0) {
+        return 1;
+    }
+
+    auto *shared = mmap(nullptr, sizeof(Slot) * workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        std::perror("mmap");
+        close(listener);
+        return 1;
+    }
+    workerSlots = static_cast<Slot *>(shared);
+    for (auto i = 0; i < workers; ++i) {
+        new (&workerSlots[i]) Slot{{0}, {0}};
+    }
+
+    // no SA_RESTART, so the sleep below wakes up for these
+    struct sigaction action{};
+    action.sa_handler = stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+    action.sa_handler = childExited;
+    sigaction(SIGCHLD, &action, nullptr);
+
+    QElapsedTimer clock;
+    clock.start();
+
+    std::vector<Worker> running(workers);
+    for (auto i = 0; i < workers; ++i) {
+        running[i].pid = spawn(listener, i, threads);
+        running[i].started.start();
+    }
+
+    QElapsedTimer sinceReport;
+    sinceReport.start();
+    while (!stopping) {
+        // whoever's gone, dead or killed, gets replaced straight away
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (auto i = 0; i < workers; ++i) {
+                auto &worker = running[i];
+                if (worker.pid != pid) {
+                    continue;
+                }
+                QJsonObject line;
+                line["prefork"] = QStringLiteral("replaced");
+                line["slot"] = i;
+                line["pid"] = static_cast<qint64>(pid);
+                line["reason"] = describe(status);
+                line["uptimeMs"] = worker.started.elapsed();
+                say(line);
+                worker.pid = -1;
+                ++worker.restarts;
+                // something that dies the moment it starts would otherwise have us forking it as fast as we can.
+                // It waits its turn without holding up anyone else
+                if (worker.started.elapsed() < 1000) {
+                    worker.notBeforeMs = clock.elapsed() + 1000;
+                }
+            }
+        }
+        // (and so does any that didn't fork last time, after a second)
+        for (auto i = 0; i < workers; ++i) {
+            auto &worker = running[i];
+            if (worker.pid > 0 || clock.elapsed() < worker.notBeforeMs) {
+                continue;
+            }
+            worker.pid = spawn(listener, i, threads);
+            worker.started.start();
+            if (worker.pid < 0) {
+                worker.notBeforeMs = clock.elapsed() + 1000;
+            }
+        }
+
+        if (maxMiB > 0) {
+            for (auto i = 0; i < workers; ++i) {
+                const auto &worker = running[i];
+                if (worker.pid <= 0) {
+                    continue;
+                }
+                if (const auto used = privateKiB(worker.pid); used > static_cast<qint64>(maxMiB) * 1024) {
+                    QJsonObject line;
+                    line["prefork"] = QStringLiteral("overLimit");
+                    line["slot"] = i;
+                    line["pid"] = static_cast<qint64>(worker.pid);
+                    line["privateKiB"] = used;
+                    say(line);
+                    // and it's replaced next time round, along with anything else that's gone
+                    kill(worker.pid, SIGKILL);
+                }
+            }
+        }
+
+        if (sinceReport.elapsed() >= reportEveryMs) {
+            const auto seconds = sinceReport.restart() / 1000.0;
+            QJsonArray list;
+            for (auto i = 0; i < workers; ++i) {
+                auto &worker = running[i];
+                const auto requests = workerSlots[i].requests.load();
+                QJsonObject entry;
+                entry["slot"] = i;
+                entry["pid"] = static_cast<qint64>(worker.pid);
+                entry["requests"] = static_cast<qint64>(requests);
+                entry["failed"] = static_cast<qint64>(workerSlots[i].failed.load());
+                entry["perSecond"] = (requests - worker.reportedRequests) / seconds;
+                entry["privateKiB"] = privateKiB(worker.pid);
+                entry["restarts"] = worker.restarts;
+                list.append(entry);
+                worker.reportedRequests = requests;
+            }
+            QJsonObject line;
+            line["prefork"] = QStringLiteral("report");
+            line["workers"] = list;
+            say(line);
+        }
+
+        // until the next tick, or until a worker goes
+        sleep(1);
+    }
+
+    for (const auto &worker : running) {
+        if (worker.pid > 0) {
+            kill(worker.pid, SIGTERM);
+        }
+    }
+    for (const auto &worker : running) {
+        if (worker.pid > 0) {
+            waitpid(worker.pid, nullptr, 0);
+        }
+    }
+    munmap(workerSlots, sizeof(Slot) * workers);
+    workerSlots = nullptr;
+    close(listener);
+    unlink(path.toLocal8Bit().constData());
+    return 0;
+}
+
+void PreforkServer::served(const bool ok)
+{
+    if (!mine) {
+        return;
+    }
+    mine->requests.fetch_add(1, std::memory_order_relaxed);
+    if (!ok) {
+        mine->failed.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+pid_t PreforkServer::spawn(const int listener, const int slot, const int threads)
+{
+    const auto pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            std::perror("fork");
+        }
+        return pid;
+    }
+
+    // the worker: it dies of whatever the supervisor was catching, and counts into its own slot
+    std::signal(SIGTERM, SIG_DFL);
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGCHLD, SIG_DFL);
+    mine = &workerSlots[slot];
+
+    // its threads start here, after the fork, so they're really its own
+    RenderPool pool(threads);
+    StickerServer::serveListener(listener, pool);
+    // serveListener doesn't come back, and if it ever did, the supervisor's exit handlers aren't ours to run
+    _exit(1);
+}
+
+qint64 PreforkServer::privateKiB(const pid_t pid)
+{
+    // smaps_rollup adds it all up for us (Linux 4.14 and up). Private pages are the ones killing the worker frees
+    QFile smaps(QStringLiteral("/proc/%1/smaps_rollup").arg(pid));
+    if (!smaps.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    qint64 total = 0;
+    for (const auto &line : smaps.readAll().split('\n')) {
+        if (line.startsWith("Private_Clean:") || line.startsWith("Private_Dirty:")) {
+            total += line.mid(line.indexOf(':') + 1).trimmed().split(' ').first().toLongLong();
+        }
+    }
+    return total;
+}
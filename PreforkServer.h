@@ -0,0 +1,66 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef PREFORKSERVER_H
+#define PREFORKSERVER_H
+
+#include <QString>
+#include <sys/types.h>
+
+/*
+ * Socket mode, but with several processes instead of one. Threads are fine until a bad font or a broken picture
+ * crashes one of them, and then it takes every other request down with it.
+ *
+ * The supervisor does all the slow setup once (Qt, fonts, one sticker drawn start to finish so the glyph caches and
+ * plugins are warm), opens the socket, and only then forks the workers. They share all those warm pages with it,
+ * copy-on-write, and take turns accepting connections on the one socket. When a worker dies, or holds on to more
+ * memory of its own than it's allowed, the supervisor forks a fresh one from its own warm state, which takes
+ * milliseconds rather than a cold start.
+ *
+ * Everything the supervisor says goes to stderr, one JSON line at a time: a "replaced" line whenever a worker goes,
+ * and a "report" line every minute with each worker's pid, requests served (and failed) so far, requests a second
+ * since the last report, and how much memory it has that isn't shared with the supervisor.
+ *
+ * Linux only, really: memory limits need /proc, and without it they aren't enforced.
+ */
+class PreforkServer
+{
+public:
+    /*
+     * Runs the supervisor until it gets SIGTERM or SIGINT, when it stops the workers and returns.
+     * Call `StickerServer::warmUp` first, and don't start any threads before this: only the forking thread makes it
+     * into the workers.
+     *
+     * @param path - filesystem path for the socket. Anything already there is removed first.
+     * @param workers - how many worker processes. Zero or less means one per core.
+     * @param threads - how many drawing threads each worker has. Zero or less shares the cores out between them.
+     * @param maxMiB - a worker holding more memory of its own than this is replaced. Zero for no limit.
+     *
+     * @return non-zero if the socket couldn't be set up, otherwise 0 once we're told to stop
+     */
+    static int serve(const QString &path, int workers, int threads, int maxMiB);
+
+    /*
+     * Counts a request towards this worker's throughput. Does nothing outside a prefork worker.
+     *
+     * @param ok - whether the response said it went well
+     */
+    static void served(bool ok);
+
+private:
+    /*
+     * Forks one worker, which serves `listener` until it dies
+     *
+     * @param slot - which worker this is, for counting
+     *
+     * @return the worker's pid, or -1 if fork failed
+     */
+    static pid_t spawn(int listener, int slot, int threads);
+
+    /*
+     * @return how much memory a process has all to itself (not shared with anyone), in KiB, or -1 if we can't tell
+     */
+    static qint64 privateKiB(pid_t pid);
+};
+
+
+#endif //PREFORKSERVER_H
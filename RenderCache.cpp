@@ -0,0 +1,377 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "RenderCache.h"
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QtEndian>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+#include "AvatarFetcher.h"
+#include "RenderTrace.h"
+#include "StickerRequest.h"
+
+namespace
+{
+// bump this whenever the drawing code changes what comes out, so old stickers aren't served for new requests
+constexpr char cacheVersion[] = "sticker-cache-4";
+
+// what's at the start of every file in the disk cache, then the width, height and format length as little-endian
+// uint32s, then the format, then the encoded sticker
+constexpr char diskMagic[4] = {'S', 'T', 'K', 'C'};
+constexpr int diskHeaderSize = 16;
+
+QString directory;
+qint64 maxDiskBytes = 0;
+
+// roughly what's been written since the directory was last measured, so it's only measured now and then
+std::atomic<qint64> writtenSinceTrim{0};
+std::mutex trimMutex;
+
+// numbers the temporary files this process writes, so no two threads pick the same name
+std::atomic<quint64> temporaries{0};
+
+// requests being drawn right now, by key, for anyone who wants the same sticker to wait on
+std::mutex flightMutex;
+std::map<QString, std::shared_future<EncodedSticker>> flights;
+
+// whoever's drawing a sticker for everyone else holds one of these. However the drawing ends, even by throwing, the
+// waiters get told (the sticker, or what went wrong) and the key's taken out, so the next request draws it afresh
+// rather than waiting on a promise that's never going to be kept
+class Flight
+{
+public:
+    explicit Flight(QString key) : key(std::move(key)) {}
+    Flight(const Flight &) = delete;
+    Flight &operator=(const Flight &) = delete;
+
+    ~Flight()
+    {
+        if (!settled) {
+            fail(std::make_exception_ptr(std::runtime_error("the sticker wasn't drawn")));
+        }
+        std::lock_guard<std::mutex> lock(flightMutex);
+        flights.erase(key);
+    }
+
+    std::shared_future<EncodedSticker> future() { return drawn.get_future().share(); }
+
+    void land(const EncodedSticker &sticker)
+    {
+        drawn.set_value(sticker);
+        settled = true;
+    }
+
+    void fail(const std::exception_ptr &error)
+    {
+        drawn.set_exception(error);
+        settled = true;
+    }
+
+private:
+    QString key;
+    std::promise<EncodedSticker> drawn;
+    bool settled = false;
+};
+
+// hashes a field with its length in front, so "ab"+"c" and "a"+"bc" come out different
+void addField(QCryptographicHash &hash, const QByteArray &bytes)
+{
+    const auto length = qToLittleEndian(static_cast<quint32>(bytes.size()));
+    hash.addData(reinterpret_cast<const char *>(&length), sizeof(length));
+    hash.addData(bytes);
+}
+
+void addField(QCryptographicHash &hash, const QString &text)
+{
+    addField(hash, text.toUtf8());
+}
+
+void addField(QCryptographicHash &hash, const qint64 number)
+{
+    addField(hash, QByteArray::number(number));
+}
+}
+
+void RenderCache::setDirectory(const QString &path, const qint64 maxMiB)
+{
+    directory = path;
+    maxDiskBytes = qMax<qint64>(maxMiB, 1) * 1024 * 1024;
+    if (!directory.isEmpty()) {
+        QDir().mkpath(directory);
+    }
+}
+
+EncodedSticker RenderCache::draw(StickerRequest &request, const QString &path)
+{
+    // an avatar URL we'd have to ask the network about could turn out to be a new picture, or not turn up in time and
+    // be the initials instead. Either way, it's not something to keep, so it's drawn without the cache
+    for (const auto &message : request.messages) {
+        if (AvatarFetcher::isUrl(message.from.avatar) && AvatarFetcher::freshVersion(message.from.avatar).isEmpty()) {
+            RenderTrace::count("renderCacheSkips");
+            return render(request, path);
+        }
+    }
+
+    RenderTrace::Stage lookupStage("cache");
+    const auto key = keyFor(request, path);
+    EncodedSticker sticker;
+    if (memory().find(key, sticker)) {
+        RenderTrace::count("renderCacheHits");
+        sticker.cached = true;
+        sticker.encoding.encodeUs = 0;
+        return sticker;
+    }
+    if (readDisk(key, sticker)) {
+        RenderTrace::count("renderDiskHits");
+        memory().insert(key, sticker, static_cast<int>(sticker.bytes.size() / 1024));
+        sticker.cached = true;
+        sticker.encoding.encodeUs = 0;
+        return sticker;
+    }
+    RenderTrace::count("renderCacheMisses");
+
+    // nobody's drawn it before, but someone might be drawing it right now
+    std::optional<Flight> flight;
+    std::shared_future<EncodedSticker> waiting;
+    {
+        std::lock_guard<std::mutex> lock(flightMutex);
+        if (const auto found = flights.find(key); found != flights.end()) {
+            waiting = found->second;
+        } else {
+            flight.emplace(key);
+            flights.emplace(key, flight->future());
+        }
+    }
+    lookupStage.finish();
+
+    if (!flight) {
+        RenderTrace::count("renderCacheWaits");
+        RenderTrace::Stage waitStage("cacheWait");
+        // if the drawing threw, so do we, same as if we'd been drawing it ourselves
+        sticker = waiting.get();
+        if (!sticker.isNull()) {
+            sticker.cached = true;
+            sticker.encoding.encodeUs = 0;
+        }
+        return sticker;
+    }
+
+    try {
+        sticker = render(request, path);
+    } catch (...) {
+        flight->fail(std::current_exception());
+        throw;
+    }
+    if (!sticker.isNull()) {
+        // in memory before the flight's over, so nobody turning up in between misses both
+        memory().insert(key, sticker, static_cast<int>(sticker.bytes.size() / 1024));
+    }
+    flight->land(sticker);
+    flight.reset();
+    if (!sticker.isNull() && !directory.isEmpty()) {
+        RenderTrace::Stage writeStage("cache");
+        writeDisk(key, sticker);
+    }
+    return sticker;
+}
+
+QString RenderCache::keyFor(const StickerRequest &request, const QString &path)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(cacheVersion, sizeof(cacheVersion));
+
+    addField(hash, static_cast<qint64>(request.messages.size()));
+    for (const auto &message : request.messages) {
+        addField(hash, message.text);
+        addField(hash, static_cast<qint64>(message.entities.size()));
+        for (const auto &entity : message.entities) {
+            addField(hash, static_cast<qint64>(entity.type));
+            addField(hash, static_cast<qint64>(entity.offset));
+            addField(hash, static_cast<qint64>(entity.length));
+        }
+
+        const auto &from = message.from;
+        addField(hash, from.name);
+        addField(hash, from.first_name);
+        addField(hash, from.last_name);
+        addField(hash, QByteArray::number(from.id, 'g', 17));
+        // the same path can hold a new picture, so it's the file we go by, like the avatar cache does
+        addField(hash, from.avatar);
+        if (AvatarFetcher::isUrl(from.avatar)) {
+            // and the same URL too. draw doesn't get this far unless the copy we've got is fresh
+            addField(hash, AvatarFetcher::freshVersion(from.avatar));
+        } else if (const QFileInfo avatar(from.avatar); !from.avatar.isEmpty() && avatar.exists()) {
+            addField(hash, avatar.lastModified().toMSecsSinceEpoch());
+            addField(hash, avatar.size());
+        } else {
+            addField(hash, static_cast<qint64>(-1));
+        }
+    }
+
+    addField(hash, static_cast<qint64>(request.backgroundColour));
+    addField(hash, static_cast<qint64>(request.width));
+    addField(hash, static_cast<qint64>(request.scale));
+    addField(hash, static_cast<qint64>(request.quality.avatar));
+    addField(hash, static_cast<qint64>(request.quality.bubble));
+    addField(hash, static_cast<qint64>(request.quality.names));
+    addField(hash, static_cast<qint64>(request.quality.text));
+    addField(hash, QByteArray::number(request.autoFit, 'g', 17));
+
+    addField(hash, Encoder::formatFor(request.encoder, path));
+    addField(hash, static_cast<qint64>(request.encoder.lossless));
+    addField(hash, static_cast<qint64>(request.encoder.quality));
+    addField(hash, static_cast<qint64>(request.encoder.method));
+    addField(hash, static_cast<qint64>(request.encoder.compression));
+
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+CacheStats RenderCache::memoryStats()
+{
+    return memory().stats();
+}
+
+EncodedSticker RenderCache::render(StickerRequest &request, const QString &path)
+{
+    EncodedSticker sticker;
+    const auto image = request.render();
+    sticker.width = image.width();
+    sticker.height = image.height();
+    sticker.bytes = Encoder::encode(image, request.encoder, path, &sticker.encoding);
+    return sticker;
+}
+
+QString RenderCache::diskPath(const QString &key)
+{
+    // a level of subdirectories, so no one directory ends up with hundreds of thousands of files in it
+    return directory + QLatin1Char('/') + key.left(2) + QLatin1Char('/') + key;
+}
+
+bool RenderCache::readDisk(const QString &key, EncodedSticker &sticker)
+{
+    if (directory.isEmpty()) {
+        return false;
+    }
+    QFile file(diskPath(key));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const auto bytes = file.readAll();
+    if (bytes.size() < diskHeaderSize || !bytes.startsWith(QByteArray::fromRawData(diskMagic, sizeof(diskMagic)))) {
+        return false;
+    }
+    const auto *header = reinterpret_cast<const uchar *>(bytes.constData());
+    const auto formatLength = static_cast<int>(qFromLittleEndian<quint32>(header + 12));
+    if (formatLength > 16 || bytes.size() < diskHeaderSize + formatLength) {
+        return false;
+    }
+    sticker.width = static_cast<int>(qFromLittleEndian<quint32>(header + 4));
+    sticker.height = static_cast<int>(qFromLittleEndian<quint32>(header + 8));
+    sticker.encoding.format = bytes.mid(diskHeaderSize, formatLength);
+    sticker.bytes = bytes.mid(diskHeaderSize + formatLength);
+    sticker.encoding.bytes = sticker.bytes.size();
+    sticker.encoding.encodeUs = 0;
+
+    // the modification time is how trimDisk knows what's been used lately
+    file.setFileTime(QDateTime::currentDateTimeUtc(), QFileDevice::FileModificationTime);
+    return true;
+}
+
+void RenderCache::writeDisk(const QString &key, const EncodedSticker &sticker)
+{
+    const auto target = diskPath(key);
+    QDir().mkpath(QFileInfo(target).path());
+
+    uchar header[diskHeaderSize];
+    std::copy(std::begin(diskMagic), std::end(diskMagic), header);
+    qToLittleEndian(static_cast<quint32>(sticker.width), header + 4);
+    qToLittleEndian(static_cast<quint32>(sticker.height), header + 8);
+    qToLittleEndian(static_cast<quint32>(sticker.encoding.format.size()), header + 12);
+
+    // somewhere nobody else is writing to (other threads, other processes), then renamed into place in one go,
+    // which also replaces whatever an identical request in another process got there first with
+    const auto temporary = target + QStringLiteral(".%1-%2.tmp")
+                                        .arg(QCoreApplication::applicationPid())
+                                        .arg(++temporaries);
+    QFile file(temporary);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return;
+    }
+    const auto written = file.write(reinterpret_cast<const char *>(header), diskHeaderSize) == diskHeaderSize
+        && file.write(sticker.encoding.format) == sticker.encoding.format.size()
+        && file.write(sticker.bytes) == sticker.bytes.size();
+    file.close();
+    // QFile::rename won't replace an existing file, and rename(2) does, atomically
+    if (!written || std::rename(QFile::encodeName(temporary).constData(), QFile::encodeName(target).constData()) != 0) {
+        QFile::remove(temporary);
+        return;
+    }
+
+    // measuring the directory means reading every file's metadata, so only bother once a good chunk has been added
+    const auto added = diskHeaderSize + sticker.encoding.format.size() + sticker.bytes.size();
+    if (writtenSinceTrim.fetch_add(added) + added > maxDiskBytes / 16) {
+        writtenSinceTrim = 0;
+        trimDisk();
+    }
+}
+
+void RenderCache::trimDisk()
+{
+    // other processes might be trimming too, which is fine: deleting a file twice just fails the second time
+    std::unique_lock<std::mutex> lock(trimMutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+
+    struct CachedFile
+    {
+        QString path;
+        qint64 size;
+        qint64 used;
+    };
+    std::vector<CachedFile> files;
+    qint64 total = 0;
+    QDirIterator it(directory, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        it.next();
+        const auto info = it.fileInfo();
+        files.push_back({info.filePath(), info.size(), info.lastModified().toMSecsSinceEpoch()});
+        total += info.size();
+    }
+    if (total <= maxDiskBytes) {
+        return;
+    }
+
+    // down to 90%, so we're not back here after the very next write
+    std::sort(files.begin(), files.end(), [](const CachedFile &a, const CachedFile &b) { return a.used < b.used; });
+    const auto target = maxDiskBytes / 10 * 9;
+    for (const auto &file : files) {
+        if (total <= target) {
+            break;
+        }
+        if (QFile::remove(file.path)) {
+            total -= file.size;
+        }
+    }
+}
+
+LruCache<EncodedSticker> &RenderCache::memory()
+{
+    // 32MiB is a couple of thousand webp stickers
+    static LruCache<EncodedSticker> cache(32 * 1024);
+    return cache;
+}
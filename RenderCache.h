@@ -0,0 +1,107 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef RENDERCACHE_H
+#define RENDERCACHE_H
+
+#include <QByteArray>
+#include <QString>
+#include "Encoder.h"
+#include "LruCache.h"
+
+struct StickerRequest;
+
+/*
+ * A sticker, drawn and encoded, ready to be written out
+ */
+struct EncodedSticker
+{
+    QByteArray bytes;
+    // what it was encoded as. Out of the cache (or from someone else's identical request), encodeUs is 0: that's the
+    // point
+    EncodeStats encoding;
+    int width = 0;
+    int height = 0;
+    // whether it came out of the cache (or someone else's identical request) rather than being drawn just now
+    bool cached = false;
+
+    bool isNull() const { return bytes.isEmpty(); }
+};
+
+/*
+ * People quote the same message over and over, and bots ask for the same sticker again when they retry. So finished
+ * stickers are kept, encoded, under a hash of everything that goes into them: the text, entities, sender, the
+ * avatar file (its path, size and modification time, or its URL and which picture is behind it), colour, width,
+ * scale, quality and encoder settings.
+ *
+ * There are two levels. Memory, per process, which is always there. And optionally a directory, which any number of
+ * sticker processes can share: files are written under a temporary name and renamed into place, so nobody ever reads
+ * half of one, and the oldest are deleted when it gets too big.
+ *
+ * Identical requests that arrive together (on a RenderPool, or several socket connections) only get drawn once: the
+ * first one draws, and the rest wait for it and take a copy.
+ */
+class RenderCache
+{
+public:
+    /*
+     * Turns on the disk cache. Set it up before any stickers are drawn; it's not locked.
+     *
+     * @param path - the directory to keep stickers in. It's created if need be. Empty turns the disk cache off.
+     * @param maxMiB - roughly how big the directory may get before the least recently used stickers go
+     */
+    static void setDirectory(const QString &path, qint64 maxMiB);
+
+    /*
+     * Draws and encodes a sticker, unless it's been done before
+     *
+     * @param request - the sticker
+     * @param path - where it's going, if anywhere, for Encoder to guess the format from
+     *
+     * @return the encoded sticker. Null if it couldn't be encoded, in which case encoding.format says what we tried.
+     */
+    static EncodedSticker draw(StickerRequest &request, const QString &path);
+
+    /*
+     * @return the key a sticker is cached under: a SHA-256, in hex
+     */
+    static QString keyFor(const StickerRequest &request, const QString &path);
+
+    /*
+     * @return how the in-memory cache is doing
+     */
+    static CacheStats memoryStats();
+
+private:
+    /*
+     * Actually draws and encodes it
+     */
+    static EncodedSticker render(StickerRequest &request, const QString &path);
+
+    /*
+     * @return where a key's file lives in the disk cache
+     */
+    static QString diskPath(const QString &key);
+
+    /*
+     * Reads a sticker from the disk cache, if it's there, and marks it recently used
+     */
+    static bool readDisk(const QString &key, EncodedSticker &sticker);
+
+    /*
+     * Puts a sticker in the disk cache, then makes sure the cache isn't too big
+     */
+    static void writeDisk(const QString &key, const EncodedSticker &sticker);
+
+    /*
+     * Deletes the least recently used stickers until the disk cache is comfortably under its limit
+     */
+    static void trimDisk();
+
+    /*
+     * Encoded stickers, by key
+     */
+    static LruCache<EncodedSticker> &memory();
+};
+
+
+#endif //RENDERCACHE_H
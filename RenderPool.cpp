@@ -0,0 +1,61 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "RenderPool.h"
+#include <QFontDatabase>
+#include <QThread>
+#include <cstdio>
+#include "StickerGenerator.h"
+
+RenderPool::RenderPool(int threads)
+{
+    if (threads <= 0) {
+        threads = QThread::idealThreadCount();
+    }
+
+    // Qt 6 always can. Qt 5 depends on the platform plugin (xcb can, some headless ones can't).
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+    if (threads > 1 && !QFontDatabase::supportsThreadedFontRendering()) {
+        std::fprintf(stderr, "This Qt platform can't draw text off the GUI thread, so only using one worker\n");
+        threads = 1;
+    }
+#endif
+
+    // font substitutions are global, so get them in place before anyone starts reading them
+    StickerGenerator::prepareFonts();
+
+    workers.reserve(threads);
+    for (auto i = 0; i < threads; ++i) {
+        workers.emplace_back(&RenderPool::work, this);
+    }
+}
+
+RenderPool::~RenderPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+void RenderPool::work()
+{
+    for (;;) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            // drain the queue before we stop, so nobody's left holding a future that never resolves
+            if (queue.empty()) {
+                return;
+            }
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,80 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef RENDERPOOL_H
+#define RENDERPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * A fixed number of worker threads, fed from one queue. Lets a single process draw stickers on every core.
+ *
+ * Anything you submit has to be safe to run off the GUI thread, which StickerGenerator is now that it only uses
+ * QImage. Whether *text* can be drawn off the GUI thread is up to the Qt platform plugin, so the pool asks, and
+ * quietly shrinks itself to one worker if the answer is no.
+ */
+class RenderPool
+{
+public:
+    /*
+     * Starts the workers. Needs a QGuiApplication to exist already.
+     *
+     * @param threads - how many workers. Zero or less means one per core.
+     */
+    explicit RenderPool(int threads = 0);
+
+    /*
+     * Finishes everything that's already queued, then stops the workers
+     */
+    ~RenderPool();
+
+    RenderPool(const RenderPool &) = delete;
+    RenderPool &operator=(const RenderPool &) = delete;
+
+    /*
+     * @return how many workers we actually ended up with
+     */
+    int size() const { return static_cast<int>(workers.size()); }
+
+    /*
+     * Queues some work for the next free worker
+     *
+     * @param job - anything callable with no arguments
+     *
+     * @return a future for whatever `job` returns
+     */
+    template <typename Job>
+    auto submit(Job job) -> std::future<decltype(job())>
+    {
+        // std::function wants to be copyable, and packaged_task isn't, hence the shared_ptr
+        auto task = std::make_shared<std::packaged_task<decltype(job())()>>(std::move(job));
+        auto result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.emplace_back([task] { (*task)(); });
+        }
+        wake.notify_one();
+        return result;
+    }
+
+private:
+    /*
+     * What each worker thread runs until the pool is destroyed
+     */
+    void work();
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::function<void()>> queue;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+};
+
+
+#endif //RENDERPOOL_H
@@ -0,0 +1,150 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "RenderTrace.h"
+#include <QJsonDocument>
+#include <cstring>
+#include <mutex>
+#include <utility>
+
+namespace
+{
+// the sticker this thread is recording, if it's recording one, and the stage it's in
+thread_local RenderTrace *recording = nullptr;
+thread_local RenderTrace record;
+thread_local RenderTrace::Stage *innermost = nullptr;
+
+// where finished records go. Workers finish stickers at the same time, so lines are written one at a time
+std::FILE *output = nullptr;
+std::mutex outputMutex;
+}
+
+void RenderTrace::setOutput(std::FILE *file)
+{
+    output = file;
+}
+
+bool RenderTrace::enabled()
+{
+    return output != nullptr;
+}
+
+void RenderTrace::begin()
+{
+    record = RenderTrace();
+    record.started.start();
+    recording = &record;
+    innermost = nullptr;
+}
+
+RenderTrace RenderTrace::end()
+{
+    if (recording) {
+        record.total = record.started.nsecsElapsed();
+    }
+    recording = nullptr;
+    innermost = nullptr;
+    return std::exchange(record, RenderTrace());
+}
+
+void RenderTrace::count(const char *name, const qint64 by)
+{
+    if (recording) {
+        add(recording->counters, name, by, false);
+    }
+}
+
+void RenderTrace::note(const char *name, const qint64 value)
+{
+    if (recording) {
+        add(recording->counters, name, value, true);
+    }
+}
+
+void RenderTrace::write(QJsonObject record, const RenderTrace &trace)
+{
+    if (!output) {
+        return;
+    }
+    record["totalUs"] = trace.totalNs() / 1000;
+    const auto traced = trace.toJson();
+    for (auto it = traced.begin(); it != traced.end(); ++it) {
+        record[it.key()] = it.value();
+    }
+    const auto line = QJsonDocument(record).toJson(QJsonDocument::Compact) + '\n';
+
+    std::lock_guard<std::mutex> lock(outputMutex);
+    std::fwrite(line.constData(), 1, static_cast<size_t>(line.size()), output);
+    std::fflush(output);
+}
+
+RenderTrace::Stage::Stage(const char *name) : name(name)
+{
+    if (recording) {
+        parent = innermost;
+        innermost = this;
+        timer.start();
+    }
+}
+
+RenderTrace::Stage::~Stage()
+{
+    finish();
+}
+
+void RenderTrace::Stage::finish()
+{
+    if (!timer.isValid()) {
+        return;
+    }
+    const auto ns = timer.nsecsElapsed();
+    timer.invalidate();
+    if (!recording) {
+        return;
+    }
+    add(recording->stageTimes, name, ns - childNs, false);
+    if (parent) {
+        parent->childNs += ns;
+    }
+    if (innermost == this) {
+        innermost = parent;
+    }
+}
+
+qint64 RenderTrace::stageNs(const char *name) const
+{
+    for (const auto &stage : stageTimes) {
+        if (std::strcmp(stage.name, name) == 0) {
+            return stage.value;
+        }
+    }
+    return 0;
+}
+
+QJsonObject RenderTrace::toJson() const
+{
+    QJsonObject stages;
+    for (const auto &stage : stageTimes) {
+        stages[QLatin1String(stage.name)] = stage.value / 1000;
+    }
+    QJsonObject counted;
+    for (const auto &counter : counters) {
+        counted[QLatin1String(counter.name)] = counter.value;
+    }
+    QJsonObject json;
+    json["stages"] = stages;
+    json["counters"] = counted;
+    return json;
+}
+
+void RenderTrace::add(QVector<Entry> &entries, const char *name, const qint64 value, const bool replace)
+{
+    // a handful of names, so a straight search is as quick as anything
+    for (auto &entry : entries) {
+        if (std::strcmp(entry.name, name) == 0) {
+            entry.value = replace ? value : entry.value + value;
+            return;
+        }
+    }
+    entries.push_back({name, value});
+}
@@ -0,0 +1,128 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef RENDERTRACE_H
+#define RENDERTRACE_H
+
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QVector>
+#include <cstdio>
+
+/*
+ * Where one sticker's time went, stage by stage, plus a few counters (text length, entities, cache hits, sizes).
+ * Recording is per thread and off unless someone asks for it, so when nobody's looking the hooks in the drawing code
+ * cost a thread-local read and a branch.
+ *
+ * With an output set (see `setOutput`, and --trace on the command line), every sticker writes one JSON line there:
+ *   {"mode":"daemon","id":1,"ok":true,"totalUs":1234,"stages":{"parse":12,"layout":345,...},"counters":{...}}
+ * Stage times are in microseconds.
+ */
+class RenderTrace
+{
+public:
+    // how long one stage took, all told, or what a counter got to
+    struct Entry
+    {
+        const char *name;
+        qint64 value;
+    };
+
+    /*
+     * Sends a record of every sticker to `file`, one JSON line each. Set it up before any stickers are drawn.
+     *
+     * @param file - somewhere to write lines to, like stderr. It's not closed. nullptr turns tracing off.
+     */
+    static void setOutput(std::FILE *file);
+
+    /*
+     * @return whether stickers should be traced (there's somewhere to write them)
+     */
+    static bool enabled();
+
+    /*
+     * Starts recording on this thread, forgetting anything recorded before
+     */
+    static void begin();
+
+    /*
+     * Stops recording on this thread
+     *
+     * @return what was recorded since `begin`
+     */
+    static RenderTrace end();
+
+    /*
+     * Adds to a counter, if this thread is recording
+     */
+    static void count(const char *name, qint64 by = 1);
+
+    /*
+     * Sets a counter, if this thread is recording
+     */
+    static void note(const char *name, qint64 value);
+
+    /*
+     * Writes one sticker's record to the output
+     *
+     * @param record - whatever the caller knows about the sticker (mode, id, ok...). The trace goes in with it.
+     * @param trace - what was recorded
+     */
+    static void write(QJsonObject record, const RenderTrace &trace);
+
+    /*
+     * Times a stage of the sticker for as long as it's in scope (or until `finish`). Stages that happen more than once
+     * add up. They can nest: a stage's time doesn't include the stages inside it, so nothing is counted twice.
+     */
+    class Stage
+    {
+    public:
+        explicit Stage(const char *name);
+        ~Stage();
+
+        /*
+         * Ends the stage early, for when it doesn't line up with a scope
+         */
+        void finish();
+
+        Stage(const Stage &) = delete;
+        Stage &operator=(const Stage &) = delete;
+
+    private:
+        const char *name;
+        QElapsedTimer timer;
+        // the stage we're inside, if any, and how long the stages inside us took
+        Stage *parent = nullptr;
+        qint64 childNs = 0;
+    };
+
+    /*
+     * @return how long the named stage took, in nanoseconds, not counting stages inside it. 0 if it never happened
+     */
+    qint64 stageNs(const char *name) const;
+
+    /*
+     * @return every stage that happened, in the order they first did, in nanoseconds
+     */
+    const QVector<Entry> &stages() const { return stageTimes; }
+
+    /*
+     * @return from `begin` to `end`, in nanoseconds
+     */
+    qint64 totalNs() const { return total; }
+
+    /*
+     * @return the stages and counters, ready to go in a record
+     */
+    QJsonObject toJson() const;
+
+private:
+    static void add(QVector<Entry> &entries, const char *name, qint64 value, bool replace);
+
+    QVector<Entry> stageTimes;
+    QVector<Entry> counters;
+    QElapsedTimer started;
+    qint64 total = 0;
+};
+
+
+#endif //RENDERTRACE_H
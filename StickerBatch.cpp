@@ -0,0 +1,228 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "StickerBatch.h"
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <thread>
+#include "Encoder.h"
+#include "PayloadParser.h"
+#include "RenderCache.h"
+#include "RenderPool.h"
+#include "RenderTrace.h"
+#include "StickerRequest.h"
+
+namespace
+{
+// what a worker hands over to the writer thread
+struct BatchItem
+{
+    int line = 0;
+    QString output;
+    // encoded on the worker, so the writer thread only has to write
+    QByteArray encoded;
+    EncodeStats encoding;
+    QString error;
+    // for payloads we couldn't read, see PayloadError::name
+    const char *errorCode = nullptr;
+    // whether it came out of the RenderCache
+    bool cached = false;
+    qint64 renderMs = 0;
+};
+
+// one line of payload in, one picture (or a reason why not) out
+BatchItem drawLine(const int line, const QByteArray &payload)
+{
+    BatchItem item;
+    item.line = line;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    RenderTrace::Stage parseStage("parse");
+    StickerRequest request;
+    if (const auto error = PayloadParser::parse(payload, request)) {
+        item.error = error.message();
+        item.errorCode = error.name();
+        return item;
+    }
+    if (request.output.isEmpty()) {
+        item.error = QStringLiteral("payload has no output path");
+        return item;
+    }
+
+    parseStage.finish();
+
+    item.output = request.output;
+    // one sticker too big to draw (bad_alloc, say) fails its own line, not the whole batch
+    EncodedSticker sticker;
+    try {
+        sticker = RenderCache::draw(request, request.output);
+    } catch (const std::exception &e) {
+        item.error = QStringLiteral("could not draw the sticker: ") + QString::fromLocal8Bit(e.what());
+        item.errorCode = "renderFailed";
+        return item;
+    } catch (...) {
+        item.error = QStringLiteral("could not draw the sticker");
+        item.errorCode = "renderFailed";
+        return item;
+    }
+    item.encoded = sticker.bytes;
+    item.encoding = sticker.encoding;
+    item.cached = sticker.cached;
+    item.renderMs = timer.elapsed() - item.encoding.encodeUs / 1000;
+    if (item.encoded.isEmpty()) {
+        item.error = QStringLiteral("could not encode as ") + QString::fromLatin1(item.encoding.format);
+    }
+    return item;
+}
+
+// drawLine, traced if anyone's listening
+BatchItem renderLine(const int line, const QByteArray &payload)
+{
+    if (!RenderTrace::enabled()) {
+        return drawLine(line, payload);
+    }
+
+    RenderTrace::begin();
+    auto item = drawLine(line, payload);
+    const auto trace = RenderTrace::end();
+    QJsonObject record;
+    record["mode"] = QStringLiteral("batch");
+    record["line"] = line;
+    record["ok"] = item.error.isEmpty();
+    RenderTrace::write(record, trace);
+    return item;
+}
+
+void printLine(const QJsonObject &object)
+{
+    const auto line = QJsonDocument(object).toJson(QJsonDocument::Compact) + '\n';
+    std::fwrite(line.constData(), 1, static_cast<size_t>(line.size()), stdout);
+    std::fflush(stdout);
+}
+}
+
+int StickerBatch::run(const QString &path, RenderPool &pool)
+{
+    QFile file;
+    auto opened = false;
+    if (path == QStringLiteral("-")) {
+        opened = file.open(stdin, QIODevice::ReadOnly);
+    } else {
+        file.setFileName(path);
+        opened = file.open(QIODevice::ReadOnly);
+    }
+    if (!opened) {
+        std::fprintf(stderr, "Couldn't open batch file %s\n", path.toLocal8Bit().constData());
+        return 1;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // keep a few stickers per worker queued up, but don't read a huge file into memory all at once
+    const auto maxInFlight = static_cast<size_t>(pool.size()) * 4;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::future<BatchItem>> inFlight;
+    auto inputEnded = false;
+    auto total = 0;
+    auto written = 0;
+
+    // the writer takes finished pictures in input order, so the progress lines come out in order too
+    std::thread writer([&] {
+        for (;;) {
+            std::future<BatchItem> next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return inputEnded || !inFlight.empty(); });
+                if (inFlight.empty()) {
+                    return;
+                }
+                next = std::move(inFlight.front());
+                inFlight.pop_front();
+            }
+            changed.notify_all();
+
+            const auto item = next.get();
+            QJsonObject progress;
+            progress["line"] = item.line;
+            if (item.error.isEmpty()) {
+                QElapsedTimer writeTimer;
+                writeTimer.start();
+                if (Encoder::writeFile(item.output, item.encoded)) {
+                    ++written;
+                    progress["ok"] = true;
+                    progress["output"] = item.output;
+                    progress["renderMs"] = item.renderMs;
+                    progress["format"] = QString::fromLatin1(item.encoding.format);
+                    progress["bytes"] = item.encoding.bytes;
+                    progress["encodeUs"] = item.encoding.encodeUs;
+                    progress["cached"] = item.cached;
+                    progress["writeMs"] = writeTimer.elapsed();
+                } else {
+                    progress["ok"] = false;
+                    progress["output"] = item.output;
+                    progress["error"] = QStringLiteral("could not write ") + item.output;
+                }
+            } else {
+                progress["ok"] = false;
+                progress["error"] = item.error;
+                if (item.errorCode) {
+                    progress["errorCode"] = QLatin1String(item.errorCode);
+                }
+            }
+            printLine(progress);
+        }
+    });
+
+    // readLine only comes back empty at the end; a blank line still has its newline
+    auto lineNumber = 0;
+    for (;;) {
+        const auto line = file.readLine();
+        if (line.isEmpty()) {
+            break;
+        }
+        ++lineNumber;
+        if (line.trimmed().isEmpty()) {
+            continue;
+        }
+        ++total;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return inFlight.size() < maxInFlight; });
+        inFlight.push_back(pool.submit([lineNumber, line] { return renderLine(lineNumber, line); }));
+        lock.unlock();
+        changed.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        inputEnded = true;
+    }
+    changed.notify_all();
+    writer.join();
+
+    QJsonObject summary;
+    summary["done"] = true;
+    summary["total"] = total;
+    summary["ok"] = written;
+    summary["failed"] = total - written;
+    summary["ms"] = timer.elapsed();
+    printLine(summary);
+
+    if (written == total) {
+        return 0;
+    }
+    return written ? 7 : 8;
+}
@@ -0,0 +1,38 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef STICKERBATCH_H
+#define STICKERBATCH_H
+
+#include <QString>
+
+class RenderPool;
+
+/*
+ * Draws a whole file of stickers in one process: handy for backfills, or after a theme change.
+ *
+ * The input has one payload per line, each the same JSON main.cpp takes on stdin plus an "output" path.
+ * Stickers are drawn and encoded on the RenderPool, and a separate thread only writes each one out while the
+ * workers get on with the next, so the disk never holds up the drawing.
+ *
+ * For every input line, one JSON line is printed to stdout, in input order:
+ *   {"line":3, "ok":true, "output":"/tmp/3.webp", "renderMs":41, "writeMs":12}
+ *   {"line":4, "ok":false, "error":"payload has no message object"}
+ * and once everything's done, a summary:
+ *   {"done":true, "total":2, "ok":1, "failed":1, "ms":60}
+ */
+class StickerBatch
+{
+public:
+    /*
+     * Renders everything in a batch file
+     *
+     * @param path - the batch file, or "-" for stdin
+     * @param pool - the workers which do the drawing
+     *
+     * @return 0 if every sticker was written, 7 if some failed, 8 if none were written, 1 if we couldn't read the file
+     */
+    static int run(const QString &path, RenderPool &pool);
+};
+
+
+#endif //STICKERBATCH_H
@@ -1,28 +1,122 @@
 // SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
 // SPDX-License-Identifier: LGPL-2.1-or-later
 #include "StickerGenerator.h"
-#include <QBitmap>
-#include <QLinearGradient>
+#include <QFileInfo>
+#include <QImage>
 #include <QPainter>
-#include <QPainterPath>
-#include <QPixmap>
 #include <QRgb>
-#include <QStaticText>
+#include <QTextCharFormat>
 #include <QtCore>
+#include <algorithm>
 #include <cmath>
+#include <map>
+#include <vector>
+#include "AvatarFetcher.h"
+#include "BubbleSprites.h"
+#include "CircleClip.h"
+#include "Downscale.h"
+#include "FontCoverage.h"
+#include "ImagePool.h"
+#include "RenderTrace.h"
+#include "TextBlock.h"
+
+namespace
+{
+// an LruCache for each thread, for things that mustn't leave the thread that made them, with every thread's counters
+// kept where they can be added up
+template <typename T>
+struct PerThreadCache
+{
+    static inline QMutex mutex;
+    static inline std::vector<PerThreadCache *> all;
+
+    LruCache<T> cache;
+
+    explicit PerThreadCache(const int maxKiB) : cache(maxKiB)
+    {
+        QMutexLocker locker(&mutex);
+        all.push_back(this);
+    }
+
+    ~PerThreadCache()
+    {
+        QMutexLocker locker(&mutex);
+        all.erase(std::find(all.begin(), all.end(), this));
+    }
+
+    static CacheStats total()
+    {
+        QMutexLocker locker(&mutex);
+        CacheStats total;
+        for (const auto *each : all) {
+            const auto stats = each->cache.stats();
+            total.hits += stats.hits;
+            total.misses += stats.misses;
+            total.entries += stats.entries;
+            total.usedKiB += stats.usedKiB;
+            total.maxKiB += stats.maxKiB;
+        }
+        return total;
+    }
+};
+}
 
-QPixmap
-StickerGenerator::generate(const QRgb &backgroundColour, ChatMessage &message, int width, int scale)
+QImage
+StickerGenerator::generate(const QRgb &backgroundColour,
+                           QList<ChatMessage> &messages,
+                           int width,
+                           int scale,
+                           const int bottomPadding,
+                           const RenderQuality &quality,
+                           const double autoFit)
 {
     // scale variable is a bit strange
     if (!scale) { scale = 2; }
     if (scale > 20) { scale = 20; }
+    // everything is still laid out at `scale` times the size, so it all looks like it always has. The painter shrinks
+    // it to `target` on its way onto the canvas, so nothing is ever drawn that big.
+    const auto target = width;
     width *= scale;
 
-    // we automatically have a bold entity wrapping the username, so set that up now
-    QList<Entity> boldEntities;
-    boldEntities.append(Entity{bold, 0, message.from.name.length()});
+    // avatars from URLs download while the text's being laid out, and drawQuote waits for them (but not for long)
+    for (const auto &message : messages) {
+        if (AvatarFetcher::isUrl(message.from.avatar)) {
+            AvatarFetcher::prefetch(message.from.avatar);
+        }
+    }
+
+    // everything up to drawQuote is shaping and measuring text
+    RenderTrace::Stage layoutStage("layout");
+
+    // all on this thread, the one that paints them: a TextBox's glyph runs hold on to font engines that belong to the
+    // thread that shaped them. Whole stickers are already drawn side by side on the RenderPool, which is where the
+    // cores go
+    const auto count = static_cast<int>(messages.size());
+    QVector<Bubble> bubbles;
+    bubbles.reserve(count);
+    // auto-fitting shares the height out evenly, which is about right for a few messages of about the same length
+    const auto fitHeight = autoFit > 0 && count > 0 ? autoFit * width / count : 0.0;
+    for (auto i = 0; i < count; ++i) {
+        const auto &previous = messages[qMax(i - 1, 0)].from;
+        auto &message = messages[i];
+        const auto continued = i > 0 && message.from.id == previous.id && message.from.name == previous.name;
+        bubbles.push_back(layoutMessage(backgroundColour, message, continued, width, scale, fitHeight));
+    }
+
+    layoutStage.finish();
 
+    // so now send all the laid out text to drawQuote, which works out where it goes and paints the lot.
+    // The avatars are fetched in there, because only then do we know how big they end up.
+    return drawQuote(backgroundColour, bubbles, scale, target, bottomPadding, quality);
+}
+
+StickerGenerator::Bubble StickerGenerator::layoutMessage(const QRgb backgroundColour,
+                                                         ChatMessage &message,
+                                                         const bool continued,
+                                                         const int width,
+                                                         const int scale,
+                                                         const qreal fitHeight)
+{
     // check background style colour black/light
     auto backIsLight = isLight(backgroundColour);
 
@@ -76,16 +170,13 @@ StickerGenerator::generate(const QRgb &backgroundColour, ChatMessage &message, i
 
     auto nameSize = 24 * scale;
 
-    // where we write the peer's/user's name (if there is one)
-    QPixmap nameCanvas;
-    if (!message.from.name.isEmpty()) {
-        nameCanvas = drawText(message.from.name,
-                              boldEntities,
-                              nameSize,
-                              &nameColor,
-                              0,
-                              0,
-                              width, true);
+    Bubble bubble;
+    bubble.user = message.from;
+    bubble.showAvatar = !continued;
+
+    // where we write the peer's/user's name (if there is one). The rest of their run goes without
+    if (!continued && !message.from.name.isEmpty()) {
+        bubble.name = layoutName(message.from.name, nameSize, nameColor, 0, width);
     }
 
     // const minFontSize = 18
@@ -98,26 +189,32 @@ StickerGenerator::generate(const QRgb &backgroundColour, ChatMessage &message, i
 
     auto fontSize = 24 * scale;
 
+    // auto-fitting uses quote-api's limits, and measures rather than guessing from the length. The text gets whatever
+    // height is left after the name and the bubble's padding, and wraps where the bubble would reach `width`
+    auto minFontSize = fontSize;
+    auto textWidth = width;
+    qreal textHeight = 0;
+    if (fitHeight > 0) {
+        minFontSize = 18 * scale;
+        fontSize = 28 * scale;
+        textWidth = width - 85 * scale;
+        textHeight = qMax<qreal>(fitHeight - (bubble.name.isNull() ? 0 : bubble.name.height) - 30 * scale, 1);
+    }
+
     auto textColor = backIsLight ? QColor(0, 0, 0) : QColor(0xff, 0xff, 0xff);
 
     // The message body. Only text is supported, but with lots of formatting
-    QPixmap textCanvas;
     if (!message.text.isEmpty()) {
-        textCanvas = drawText(message.text,
-                              message.entities,
-                              fontSize,
-                              &textColor,
-                              0,
-                              0,
-                              width, false);
+        bubble.text = layoutText(message.text,
+                                 message.entities,
+                                 fontSize,
+                                 &textColor,
+                                 0,
+                                 0,
+                                 textWidth, false, textHeight, minFontSize);
     }
 
-    // This becomes the user's avatar, cropped to a circle. OR, their initials, on a circular background
-    QPixmap avatarCanvas = drawAvatar(message.from);
-
     // This is completely untested and probably won't work at all, but the meat is here
-    QPixmap replyName;
-    QPixmap replyText;
     if (message.replyMessage && !message.replyMessage->from.name.isEmpty() && !message.replyMessage->text.isEmpty()) {
         auto replyNameIndex = fmod(qAbs(message.replyMessage->from.id), 7);
         // narrowing!
@@ -128,37 +225,31 @@ StickerGenerator::generate(const QRgb &backgroundColour, ChatMessage &message, i
         auto replyNameFontSize = 16 * scale;
 
         if (!message.replyMessage->from.name.isEmpty()) {
-            replyName = drawText(message.replyMessage->from.name,
-                                 boldEntities,
-                                 replyNameFontSize,
-                                 &replyNameColor,
-                                 0,
-                                 replyNameFontSize,
-                                 static_cast<int>(width * 0.9), true);
+            bubble.replyName = layoutName(message.replyMessage->from.name,
+                                          replyNameFontSize,
+                                          replyNameColor,
+                                          replyNameFontSize,
+                                          static_cast<int>(width * 0.9));
         }
 
         auto textColor2 = backIsLight ? QColor(0, 0, 0) : QColor(0xff, 0xff, 0xff);
 
         auto replyTextFontSize = 21 * scale;
         // FIXME rounded double to int, but double might be wiser anyway
-        replyText = drawText(message.replyMessage->text,
-                             QList<Entity>(),
-                             replyTextFontSize,
-                             &textColor2,
-                             0,
-                             replyTextFontSize,
-                             qRound(width * 0.9), false);
-    }
-
-    // so now send all the little pictures to drawQuote for compositing or what have you
-    return drawQuote(
-        backgroundColour,
-        avatarCanvas,
-        replyName, replyText,
-        nameCanvas, textCanvas,
-        scale
-    );
+        bubble.replyText = layoutText(message.replyMessage->text,
+                                      QList<Entity>(),
+                                      replyTextFontSize,
+                                      &textColor2,
+                                      0,
+                                      replyTextFontSize,
+                                      qRound(width * 0.9), false);
+    }
 
+    // a message carrying on from a named sender's still gets its bubble, even though its name isn't drawn
+    bubble.filled = !bubble.name.isNull() || !bubble.replyName.isNull()
+        || (continued && !message.from.name.isEmpty());
+    measureBubble(bubble, scale);
+    return bubble;
 }
 
 bool StickerGenerator::isLight(const QRgb &colour)
@@ -176,14 +267,13 @@ bool StickerGenerator::isLight(const QRgb &colour)
     return hsp > 127.5;
 }
 
-QPixmap StickerGenerator::drawQuote(const QRgb backgroundColour,
-                                    const QPixmap &avatar,
-                                    const QPixmap &replyName,
-                                    const QPixmap &replyText,
-                                    const QPixmap &name,
-                                    const QPixmap &text,
-                                    const int scale)
+void StickerGenerator::measureBubble(Bubble &bubble, const int scale)
 {
+    const auto &replyName = bubble.replyName;
+    const auto &replyText = bubble.replyText;
+    const auto &name = bubble.name;
+    const auto &text = bubble.text;
+
     // for the rectangle/bubble behind the name and the text body
     const auto blockPosX = 55 * scale;
     constexpr auto blockPosY = 0;
@@ -191,25 +281,23 @@ QPixmap StickerGenerator::drawQuote(const QRgb backgroundColour,
     // general measurement for padding, minimum sizes, and replied-to indents
     const auto indent = 15 * scale;
 
-    const auto avatarSize = 50 * scale;
-
     // calculate the width for our background box/bubble by finding which picture will need the most horizontal space
     auto width = 0;
-    if (!name.isNull()) { width = name.width(); }
-    if (!text.isNull() && width < text.width()) { width = text.width() + indent; }
+    if (!name.isNull()) { width = name.width; }
+    if (!text.isNull() && width < text.width) { width = text.width + indent; }
     if (!replyName.isNull()) {
-        if (width < replyName.width()) { width = replyName.width() + indent; }
-        if (width < replyText.width()) { width = replyText.width() + indent; }
+        if (width < replyName.width) { width = replyName.width + indent; }
+        if (width < replyText.width) { width = replyText.width + indent; }
     }
 
     // we don't need height if we have nothing
     double height = 0;
     if (name.isNull() && !text.isNull()) {
         // height when we text but no name
-            height = text.height() + indent;
+            height = text.height + indent;
     } else if (!name.isNull() && !text.isNull()) {
         // height if we have both name and text
-            height = text.height() + name.height();
+            height = text.height + name.height;
     } else if (!name.isNull() && text.isNull()) {
         // height if we have name only
             height = 2 * indent;
@@ -218,111 +306,257 @@ QPixmap StickerGenerator::drawQuote(const QRgb backgroundColour,
     width += blockPosX + indent * 2;
     height += blockPosY;
 
-    int namePosX;
-    int namePosY;
-
     if (name.isNull()) {
-        namePosX = 0;
-        namePosY = -indent - 5 * scale;
+        bubble.namePosX = 0;
+        bubble.namePosY = -indent - 5 * scale;
     } else {
-        namePosX = blockPosX + indent;
-        namePosY = indent;
+        bubble.namePosX = blockPosX + indent;
+        bubble.namePosY = indent;
     }
 
-    const auto textPosX = blockPosX + indent;
-    double textPosY = indent;
-    if (!name.isNull()) { textPosY = name.height() - 5 * scale; }
-
-    auto replyPosX = 0;
-    double replyNamePosY = 0;
-    double replyTextPosY = 0;
+    bubble.textPosX = blockPosX + indent;
+    bubble.textPosY = indent;
+    if (!name.isNull()) { bubble.textPosY = name.height - 5 * scale; }
 
     // remember that reply isn't actually tested (I was drawing from a system that can't support replies)
     if (!replyName.isNull()) {
-        replyPosX = textPosX + indent;
+        bubble.replyPosX = bubble.textPosX + indent;
 
-        const auto replyNameHeight = replyName.height() * 1.2;
-        const auto replyTextHeight = replyText.height() * 0.5;
+        const auto replyNameHeight = replyName.height * 1.2;
+        const auto replyTextHeight = replyText.height * 0.5;
 
-        replyNamePosY = namePosY + replyNameHeight;
-        replyTextPosY = replyNamePosY + replyTextHeight;
+        bubble.replyNamePosY = bubble.namePosY + replyNameHeight;
+        bubble.replyTextPosY = bubble.replyNamePosY + replyTextHeight;
 
-        textPosY += replyNameHeight + replyTextHeight;
+        bubble.textPosY += replyNameHeight + replyTextHeight;
         height += replyNameHeight + replyTextHeight;
     }
 
     height -= 11 * scale;
 
-    QPixmap canvas(width, static_cast<int>(height));
+    bubble.width = width;
+    bubble.height = height;
+}
+
+QImage StickerGenerator::drawQuote(const QRgb backgroundColour,
+                                   const QVector<Bubble> &bubbles,
+                                   const int scale,
+                                   const int target,
+                                   const int bottomPadding,
+                                   const RenderQuality &quality)
+{
+    // messages are stacked one under the other, a little apart, like they are in a chat
+    const auto gap = 5 * scale;
+    QVector<double> tops;
+    tops.reserve(bubbles.size());
+    auto width = 0;
+    double height = 0;
+    for (const auto &bubble : bubbles) {
+        tops.push_back(height);
+        if (bubble.isNull()) {
+            continue;
+        }
+        if (height > 0) {
+            height += gap;
+            tops.back() = height;
+        }
+        width = qMax(width, bubble.width);
+        height += bubble.height;
+    }
+
+    // everything above is in layout pixels. Now work out how far to shrink it to fit in `target`, leaving room for
+    // the transparent padding at the bottom that telegram likes
+    const auto contentWidth = width;
+    const auto contentHeight = static_cast<int>(height);
+    auto padding = bottomPadding;
+    if (padding >= target) {
+        padding = 0;
+    }
+    if (contentWidth <= 0 || contentHeight <= 0 || target <= 0) {
+        return {};
+    }
+    int scaledW;
+    int scaledH;
+    const double scaleW = static_cast<double>(target) / contentWidth;
+    if (const double scaleH = static_cast<double>(target - padding) / contentHeight; scaleW <= scaleH) {
+        scaledW = target;
+        scaledH = static_cast<int>(contentHeight * scaleW);
+    } else {
+        scaledH = target - padding;
+        scaledW = static_cast<int>(contentWidth * scaleH);
+    }
+    if (scaledW <= 0 || scaledH <= 0) {
+        return {};
+    }
+
+    const auto scaleX = static_cast<double>(scaledW) / contentWidth;
+    const auto scaleY = static_cast<double>(scaledH) / contentHeight;
+
+    RenderTrace::note("canvasWidth", scaledW);
+    RenderTrace::note("canvasHeight", scaledH + padding);
+
+    // avatars are pictures, so they're made at the size they end up and drawn 1:1. Fetched before we start painting,
+    // so their time is their own. One per run of messages from the same sender
+    QVector<QImage> avatars(bubbles.size());
+    if (const auto avatarSize = qRound(50 * scale * scaleX); avatarSize > 0) {
+        RenderTrace::Stage avatarStage("avatar");
+        for (auto i = 0; i < bubbles.size(); ++i) {
+            if (bubbles[i].showAvatar && !bubbles[i].isNull()) {
+                avatars[i] = drawAvatar(bubbles[i].user, avatarSize, quality.avatar);
+            }
+        }
+    }
+
+    RenderTrace::Stage paintStage("paint");
+
+    // the one and only full size picture. The painter does the shrinking, so we draw each pixel once.
+    // Its buffer goes back to the pool once the encoder's done with it
+    auto canvas = ImagePool::take(QSize(scaledW, scaledH + padding));
     canvas.fill(Qt::transparent);
     QPainter painter(&canvas);
+    painter.setRenderHints(QPainter::Antialiasing | QPainter::TextAntialiasing | QPainter::SmoothPixmapTransform);
     painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+    painter.scale(scaleX, scaleY);
+    // the padding stays clear, like it did when the content was its own picture
+    painter.setClipRect(QRectF(0, 0, contentWidth, contentHeight));
+
+    for (auto i = 0; i < bubbles.size(); ++i) {
+        if (bubbles[i].isNull()) {
+            continue;
+        }
 
-    const auto rectWidth = width - blockPosX;
-    const auto rectHeight = height;
+        // avatar at top, just left of text box
+        if (!avatars[i].isNull()) {
+            constexpr auto avatarPosY = 15;
+            constexpr auto avatarPosX = 0;
+            painter.save();
+            painter.resetTransform();
+            painter.drawImage(QPoint(qRound(avatarPosX * scaleX), qRound((tops[i] + avatarPosY) * scaleY)), avatars[i]);
+            painter.restore();
+        }
+
+        painter.save();
+        painter.translate(0, tops[i]);
+        paintBubble(&painter, bubbles[i], backgroundColour, scale, quality);
+        painter.restore();
+    }
+
+    // we just return the QImage to the calling function. They can decide what to do with it.
+    return canvas;
+}
+
+void StickerGenerator::paintBubble(QPainter *painter,
+                                   const Bubble &bubble,
+                                   const QRgb backgroundColour,
+                                   const int scale,
+                                   const RenderQuality &quality)
+{
+    const auto &replyName = bubble.replyName;
+    const auto &replyText = bubble.replyText;
+    const auto &name = bubble.name;
+    const auto &text = bubble.text;
+
+    const auto blockPosX = 55 * scale;
+    constexpr auto blockPosY = 0;
+    const auto rectWidth = bubble.width - blockPosX;
+    const auto rectHeight = static_cast<int>(bubble.height);
     const auto rectPosX = blockPosX;
     constexpr auto rectPosY = blockPosY;
     const auto rectRoundRadius = 25 * scale;
 
-//    finally we draw the box/rectabngle/bubble behind the name and the message text
-    QPixmap rect;
-    if (!name.isNull() || !replyName.isNull()) {
-        rect = drawRoundRect(backgroundColour,
-                             rectWidth,
-                             static_cast<int>(rectHeight),
-                             rectRoundRadius);
+    // finally we draw the box/rectabngle/bubble behind the name and the message text, big enough to hold them both
+    if (bubble.filled) {
+        const QRectF rect(rectPosX, rectPosY, rectWidth, rectHeight);
+        paintSupersampled(painter, rect, quality.bubble, [&](QPainter *p) {
+            paintRoundRect(p, backgroundColour, rect, rectRoundRadius);
+        });
     }
-
-    // avatar at top, just left of text box
-    if (!avatar.isNull()) {
-        constexpr auto avatarPosY = 15;
-        constexpr auto avatarPosX = 0;
-        painter.drawPixmap(avatarPosX, avatarPosY,
-                           avatar.scaled(avatarSize, avatarSize, Qt::KeepAspectRatio, Qt::SmoothTransformation));
-    }
-    // text box big enough to hold name and text
-    if (!rect.isNull()) { painter.drawPixmap(rectPosX, rectPosY, rect); }
     // name is at top of text box
-    if (!name.isNull()) { painter.drawPixmap(namePosX, namePosY - scale, name); }
+    if (!name.isNull()) {
+        const QPointF namePos(bubble.namePosX, bubble.namePosY - scale);
+        paintSupersampled(painter, QRectF(namePos, QSizeF(name.width, name.height)), quality.names, [&](QPainter *p) {
+            name.block.draw(p, namePos + name.offset, name.width);
+        });
+    }
     // text is in text box under name
-    if (!text.isNull()) { painter.drawPixmap(textPosX, static_cast<int>(textPosY), text); }
+    if (!text.isNull()) {
+        const QPointF textPos(bubble.textPosX, static_cast<int>(bubble.textPosY));
+        paintSupersampled(painter, QRectF(textPos, QSizeF(text.width, text.height)), quality.text, [&](QPainter *p) {
+            text.block.draw(p, textPos + text.offset, text.width);
+        });
+    }
 
     // if we have a reply (please no), we can adjust things a bit. Not tested.
     if (!replyName.isNull()) {
         const auto lineColor = isLight(backgroundColour) ? QColor(0, 0, 0) : QColor(0xff, 0xff, 0xff);
-        painter.drawPixmap(textPosX,
-                           static_cast<int>(replyNamePosY),
-                           drawReplyLine(3 * scale, static_cast<int>(replyName.height() + replyText.height() * 0.4), lineColor));
+        paintReplyLine(painter,
+                       QPointF(bubble.textPosX, static_cast<int>(bubble.replyNamePosY)),
+                       3 * scale,
+                       static_cast<int>(replyName.height + replyText.height * 0.4),
+                       lineColor);
+
+        const QPointF replyNamePos(bubble.replyPosX, static_cast<int>(bubble.replyNamePosY));
+        const QPointF replyTextPos(bubble.replyPosX, static_cast<int>(bubble.replyTextPosY));
+        replyName.block.draw(painter, replyNamePos + replyName.offset, replyName.width);
+        replyText.block.draw(painter, replyTextPos + replyText.offset, replyText.width);
+    }
+}
 
-        painter.drawPixmap(replyPosX, static_cast<int>(replyNamePosY), replyName);
-        painter.drawPixmap(replyPosX, static_cast<int>(replyTextPosY), replyText);
+void StickerGenerator::paintSupersampled(QPainter *painter,
+                                         const QRectF &rect,
+                                         const int supersample,
+                                         const std::function<void(QPainter *)> &paint)
+{
+    if (supersample <= 1) {
+        paint(painter);
+        return;
     }
 
-    // we just return the QPixmap to the calling function. They can decide what to do with it.
-    return canvas;
+    // a little layer that's `supersample` times the size of where it's going, painted with the same transform plus
+    // the extra scale, then shrunk smoothly into place
+    const auto target = painter->transform().mapRect(rect).toAlignedRect();
+    if (target.isEmpty()) {
+        return;
+    }
+    auto layer = ImagePool::take(target.size() * supersample);
+    layer.fill(Qt::transparent);
+    QPainter layerPainter(&layer);
+    layerPainter.setRenderHints(painter->renderHints());
+    layerPainter.setTransform(painter->transform()
+                                  * QTransform::fromTranslate(-target.x(), -target.y())
+                                  * QTransform::fromScale(supersample, supersample));
+    paint(&layerPainter);
+    layerPainter.end();
+
+    painter->save();
+    painter->resetTransform();
+    painter->drawImage(target.topLeft(), Downscale::area(layer, target.size()));
+    painter->restore();
 }
 
-QPixmap StickerGenerator::drawText(QString &text,
-                                   const QList<Entity> &entities,
-                                   const int fontSize,
-                                   const QColor *fontColour,
-                                   const int textX,
-                                   const int textY,
-                                   int maxWidth,
-                                   const bool isName)
+StickerGenerator::TextBox StickerGenerator::layoutText(const QString &input,
+                                                      const QList<Entity> &entities,
+                                                      const int fontSize,
+                                                      const QColor *fontColour,
+                                                      const int textX,
+                                                      const int textY,
+                                                      int maxWidth,
+                                                      const bool isName,
+                                                      const qreal fitHeight,
+                                                      const int minFontSize)
 {
     if (maxWidth > 10000) { maxWidth = 10000; }
 //    if (maxHeight > 10000) maxHeight = 10000;
 //    auto lineHeight = 4 * (fontSize * 0.3);
 
-    constexpr auto lineHeight = 90;
+    constexpr auto lineHeight = 0.9;
     // future: support more fonts (specified in input json?) and other emoji typefaces
     /*
      * Desktop TG actually uses OpenSans. Quote-API project uses NotoSans (and San Francisco Mono).
      * Android and IOS both probably use default platform font set by user.
      * OpenSans as installed on my system doesn't do half the things I'd like
      * (or support all the characters I encounter), so the Noto family is a GREAT choice.
-     * Monospace font is set by inline styles in the rich text, and is Noto Serif Mono I think.
+     * Monospace font is set by the character formats in entityFormat, and is Noto Serif Mono I think.
      * So, there's a little bit of freedom to choose with font faces.
      *
      * In the future I'd like to support some styling (ESPECIALLY font faces) in the configuration/input.
@@ -332,7 +566,8 @@ QPixmap StickerGenerator::drawText(QString &text,
 //    QString emojiFontName = QFD::applicationFontFamilies(QFD::addApplicationFont("/tmp/AppleColorEmoji.ttf"))[0];
 
 // telegram convention, really. Could it be configurable? Because for a wee graphic, this might be HUUUUGE
-    text.truncate(4096);
+    // (a copy: the caller's string can be someone's name, which another thread may be comparing right now)
+    const auto text = input.left(4096);
 
 // We copy the input text from the original so that I can still use the original for measurements and estimations
     QString str(text);
@@ -344,263 +579,368 @@ QPixmap StickerGenerator::drawText(QString &text,
 //        str.replace(pos++, 6, QChar(rx.cap(1).right(4).toUShort(nullptr, 16)));
 //    }
 
-    // making these literal lets us do things like process it as ONE character (see below for-loop)
+    // making these literal lets us do things like process it as ONE character (TextBlock breaks the line there)
     str.replace(R"(\n)", "\n");
 
-    struct EntitySpan {
-        Styles type;
-        int start;
-        int end;
-    };
-
-    QVector<EntitySpan> spans;
-    spans.reserve(entities.size());
-    const auto textLen = str.length();
-    for (const auto &[type, offset, length] : entities) {
-        if (length <= 0) {
-            continue;
+    // entities can come in any order and overlap any way they like, so they're flattened into runs first, and each
+    // run gets one format with all of its styles merged into it (in Styles order, should two disagree)
+    const auto runs = normaliseEntities(entities, str.length());
+    QVector<QTextLayout::FormatRange> formats;
+    formats.reserve(runs.size());
+    std::map<quint32, QTextCharFormat> merged;
+    for (const auto &run : runs) {
+        auto found = merged.find(run.styles);
+        if (found == merged.end()) {
+            QTextCharFormat format;
+            for (auto style = 0; style < 32; ++style) {
+                if (run.styles & (1u << style)) {
+                    format.merge(entityFormat(static_cast<Styles>(style)));
+                }
+            }
+            found = merged.emplace(run.styles, format).first;
         }
-        auto start = offset;
-        auto end = start + static_cast<int>(length);
-        if (end <= 0 || start >= textLen) {
+        if (found->second.isEmpty()) {
             continue;
         }
-        if (start < 0) {
-            start = 0;
-        }
-        if (end > textLen) {
-            end = textLen;
-        }
-        spans.push_back({type, start, end});
-    }
-
-    auto spanIndex = 0;
-    QVector<EntitySpan> stack;
-    stack.reserve(spans.size());
-
-    // This little HTML preamble means we don't need to use textlayout class, and everything is automatic
-    QString processed("<div style='line-height: %1%;'>");
-    processed = processed.arg(lineHeight);
-
-    // we iterate over our entities and use them to start and end HTML tags for rich text formatting.
-    // this is only intended for use where entities can nest (<b><i></i></b>) but NOT otherwise overlap.
-    // if your entities overlap (like <b><i></b></i>) it may or may not still work as intended
-    for (auto i = 0; i < str.length(); ++i) {
-        // this seems like it'd be spectacularly inefficient. I hope qt's doing some magic underneath
-        while (spanIndex < spans.size() && spans[spanIndex].start == i) {
-            processed.append(startEntity(spans[spanIndex].type));
-            stack.push_back(spans[spanIndex]);
-            ++spanIndex;
-        }
-
-        // now escape the character itself as HTML (because we are going to need the actual html)
-        processed.append(QString(str[i]).toHtmlEscaped());
-
-        while (!stack.isEmpty() && stack.last().end == i + 1) {
-            processed.append(endEntity(stack.last().type));
-            stack.removeLast();
-        }
-
-        /*
-         * and if the character was a newline, insert it (after opening and closing entities, because inline elements)
-         * as a HTML4ish line break element
-         */
-        if (str[i] == '\n') {
-            processed.append("<br>");
-        }
-
-    }
-
-    while (!stack.isEmpty()) {
-        processed.append(endEntity(stack.last().type));
-        stack.removeLast();
+        QTextLayout::FormatRange range;
+        range.start = run.start;
+        range.length = run.length;
+        range.format = found->second;
+        formats.push_back(range);
     }
 
-    // unescaping something. needed in a future implementation, but not this one right now
-//    processed = processed.replace(R"(\/)", "/");
-//    processed = processed.replace(R"(\\)", "\\") + "</div>";
-
-// close what we opened in the "preamble"
-    processed += "</div>";
-
-    /*
-     * On ANDROID, telegram is allowed to use system fonts, and so it can represent all kinds of weird scripts
-     * with characters wayyyyy off the BMP. I talk to a guy whose name is written in Old Turkic.
-     * Android tg can draw it. Desktop tg on my system cannot.
-     * Loading all these fallback fonts allows us to do the cool thing that the Android version does.
-     * We need to include the emoji font, because (duh) otherwise we don't get many emoji (the combined ones!).
-     * If you want to switch out the emoji font, you MIGHT need to load it as the main font and then use the main font
-     * as a fallback font. Unconfirmed.
-     * android, ios and desktop all use apple emoji, usually, so using Noto is a visible deviation!
-     * The others are all consistent!
-     * However, for MOST of the VERY FUNDAMENTAL emoji, the similarity is usually high enough for it to be OK.
-     * And sometimes packagers change the fonts, lol, so I THINK the debian version uses noto emoji anyway.
-     */
-    const auto fonts = QString(
-        "NotoColorEmoji "
-        "NotoSansAdlam NotoSansAdlamUnjoined NotoSansAnatolianHieroglyphs NotoSansArabic "
-        "NotoSansArmenian NotoSansAvestan NotoSansBalinese NotoSansBamum NotoSansBassaVah "
-        "NotoSansBatak NotoSansBengali NotoSansBhaiksuki NotoSansBrahmi NotoSansBuginese "
-        "NotoSansBuhid NotoSansCanadianAboriginal NotoSansCarian NotoSansCaucasianAlbanian "
-        "NotoSansChakma NotoSansCham NotoSansCherokee NotoSansCoptic NotoSansCuneiform "
-        "NotoSansCypriot NotoSansDeseret NotoSansDevanagari NotoSansDisplay NotoSansDuployan "
-        "NotoSansEgyptianHieroglyphs NotoSansElbasan NotoSansElymaic NotoSansEthiopic "
-        "NotoSansGeorgian NotoSansGlagolitic NotoSansGothic NotoSansGrantha NotoSansGujarati "
-        "NotoSansGunjalaGondi NotoSansGurmukhi NotoSansHanifiRohingya NotoSansHanunoo "
-        "NotoSansHatran NotoSansHebrew NotoSansImperialAramaic NotoSansIndicSiyaqNumbers "
-        "NotoSansInscriptionalPahlavi NotoSansInscriptionalParthian NotoSansJavanese "
-        "NotoSansKaithi NotoSansKannada NotoSansKayahLi NotoSansKharoshthi NotoSansKhmer "
-        "NotoSansKhojki NotoSansKhudawadi NotoSansLao NotoSansLepcha NotoSansLimbu "
-        "NotoSansLinearA NotoSansLinearB NotoSansLisu NotoSansLycian NotoSansLydian "
-        "NotoSansMahajani NotoSansMalayalam NotoSansMandaic NotoSansManichaean NotoSansMarchen "
-        "NotoSansMasaramGondi NotoSansMath NotoSansMayanNumerals NotoSansMedefaidrin "
-        "NotoSansMeeteiMayek NotoSansMendeKikakui NotoSansMeroitic NotoSansMiao NotoSansModi "
-        "NotoSansMongolian NotoSansMro NotoSansMultani NotoSansMyanmar NotoSansNKo "
-        "NotoSansNabataean NotoSansNewTaiLue NotoSansNewa NotoSansNushu NotoSansOgham "
-        "NotoSansOlChiki NotoSansOldHungarian NotoSansOldItalic NotoSansOldNorthArabian "
-        "NotoSansOldPermic NotoSansOldPersian NotoSansOldSogdian NotoSansOldSouthArabian "
-        "NotoSansOldTurkic NotoSansOriya NotoSansOsage NotoSansOsmanya NotoSansPahawhHmong "
-        "NotoSansPalmyrene NotoSansPauCinHau NotoSansPhagsPa NotoSansPhoenician "
-        "NotoSansPsalterPahlavi NotoSansRejang NotoSansRunic NotoSansSamaritan NotoSansSaurashtra "
-        "NotoSansSharada NotoSansShavian NotoSansSiddham NotoSansSignWriting NotoSansSinhala "
-        "NotoSansSogdian NotoSansSoraSompeng NotoSansSoyombo NotoSansSundanese "
-        "NotoSansSylotiNagri NotoSansSymbols NotoSansSymbols2 NotoSansSyriac NotoSansTagalog "
-        "NotoSansTagbanwa NotoSansTaiLe NotoSansTaiTham NotoSansTaiViet NotoSansTakri "
-        "NotoSansTamil NotoSansTamilSupplement NotoSansTelugu NotoSansThaana NotoSansThai "
-        "NotoSansTifinagh NotoSansTifinaghAPT NotoSansTifinaghAdrar "
-        "NotoSansTifinaghAgrawImazighen NotoSansTifinaghAhaggar NotoSansTifinaghAir "
-        "NotoSansTifinaghAzawagh NotoSansTifinaghGhat NotoSansTifinaghHawad "
-        "NotoSansTifinaghRhissaIxa NotoSansTifinaghSIL NotoSansTifinaghTawellemmet "
-        "NotoSansTirhuta NotoSansUgaritic NotoSansVai NotoSansWancho NotoSansWarangCiti "
-        "NotoSansYi NotoSansZanabazarSquare").split(" ");
-
-    static bool substitutionsReady = false;
-    if (!substitutionsReady) {
-        QFont::insertSubstitutions(fontName, fonts);
-        substitutionsReady = true;
+    RenderTrace::count("layoutCalls");
+    RenderTrace::count("textLength", str.length());
+    RenderTrace::count("entities", entities.size());
+    RenderTrace::count("formatRuns", formats.size());
+    RenderTrace::Stage fontStage("fonts");
+
+    // only the fallback fonts this text needs, so plain old English doesn't go looking through a hundred of them
+    const auto fallbacks = FontCoverage::fallbacksFor(str);
+    if (!fallbacks.isEmpty()) {
+        for (auto &range : formats) {
+            // formats that swap the font out (code) need the fallbacks on the end of their list too
+            if (range.format.hasProperty(QTextFormat::FontFamilies)) {
+                range.format.setFontFamilies(range.format.fontFamilies().toStringList() + fallbacks);
+            }
+        }
     }
 
     QFont font(fontName);
 //    QFont font = QFont("ChocoCooky");
-    font.setPixelSize(fontSize);
+    if (!fallbacks.isEmpty()) {
+        font.setFamilies(QStringList(fontName) + fallbacks);
+    }
     font.setHintingPreference(QFont::PreferNoHinting);
     font.setStyleStrategy(QFont::PreferOutline);
     font.setStyleHint(QFont::SansSerif);
 
+    // auto-fitting picks the size (and wraps); otherwise it's the one we were given
+    const auto fitting = fitHeight > 0 && !isName;
+    const auto size = fitting
+        ? fitFontSize(str, formats, font, qMin(minFontSize, fontSize), fontSize, maxWidth, fitHeight, lineHeight)
+        : fontSize;
+    font.setPixelSize(size);
+
     // for measuring text's needed width/height space using the original input
     const QFontMetrics fm(font);
+    fontStage.finish();
 
-    // If you haven't seen this, it's a pre-rendered QString and it accepts rich-text (which in Qt is basically HTML)
-    // QStaticText can do word wrapping and stuff automatically.
-    QStaticText staticText(processed);
-    staticText.setTextFormat(Qt::RichText);
-    staticText.prepare(QTransform(), font);
+    // shaped once, and only wrapped where it's allowed to be: names at the edge of the box, everything else at '\n'
+    const auto block = TextBlock::layout(str, formats, font, *fontColour, lineHeight,
+                                         isName || fitting ? maxWidth : -1, isName);
+    auto width = block.naturalSize().width();
+    const auto height = block.naturalSize().height();
+    // more lines than there are newlines means the name didn't fit in maxWidth
+    const auto wrapped = block.lineCount() > str.count(QLatin1Char('\n')) + 1;
 
-    if (isName && staticText.size().width() > maxWidth) {
+    if (isName && wrapped) {
         // can't draw text past the edge of the box. This is not great protection. rare case, too
-        staticText.setTextWidth(maxWidth);
+        width = maxWidth;
     } else if (!isName) {
         // If it's not the name, then it's message text or avatar text (for now).
         // Desktop seems to trim to 45 or 50 characters roughly of OpenSans, so I emulate that.
         // if the text height is more than 1 (and a half) lines of how tall the font is, give it more horizontal space.
-        if (const auto max_text_width = fm.horizontalAdvance(text.left(45)); staticText.size().width() < max_text_width && staticText.size().height() > fm.height() * 1.5) {
-            staticText.setTextWidth(max_text_width + 1);
+        if (const auto max_text_width = fm.horizontalAdvance(text.left(45)); width < max_text_width && height > fm.height() * 1.5) {
+            width = max_text_width + 1;
         }
     } else {
         // if it's a name and it isn't longer than the max width...
-        QTextOption alignment;
-        // FORCE it to the left of the space, like in android and desktop, even if it's RTL
-        alignment.setAlignment(Qt::AlignLeft | Qt::AlignAbsolute);
-        staticText.setTextOption(alignment);
         // Allow it a little extra horizontal space to prevent accidental wrapping
-        staticText.setTextWidth(fm.size(Qt::TextSingleLine, text).width() * 1.5);
+        width = fm.size(Qt::TextSingleLine, text).width() * 1.5;
     }
 
-    // Now we are gonna adjust our paint area to fit our text, and then we're gonna actually draw the text
-    const auto sz = staticText.size();
-    QPixmap canvas(static_cast<int>(sz.width()), static_cast<int>(sz.height()) + fontSize);
-    canvas.fill(Qt::transparent);
-    QPainter painter(&canvas);
-    painter.setFont(font);
-    painter.setPen(*fontColour);
+    // Now we are gonna size our box to fit our text. It gets drawn later, straight onto the sticker
+    TextBox box;
+    box.block = block;
+    box.offset = QPointF(textX, textY);
+    box.width = static_cast<int>(width);
+    box.height = static_cast<int>(height) + size;
 
-    painter.drawStaticText(textX, textY, staticText);
+    // so there you go, some text that knows where it's going
+    return box;
+}
 
-    // so there you go, a picture of text
-    return canvas;
+int StickerGenerator::fitFontSize(const QString &text,
+                                  const QVector<QTextLayout::FormatRange> &formats,
+                                  QFont font,
+                                  const int minSize,
+                                  const int maxSize,
+                                  const qreal wrapWidth,
+                                  const qreal maxHeight,
+                                  const qreal lineHeight)
+{
+    if (wrapWidth <= 0 || minSize >= maxSize) {
+        return minSize;
+    }
+    RenderTrace::Stage stage("fit");
+
+    // shaped once, at the biggest size, one line per paragraph, the way TextBlock would if it weren't wrapping
+    auto shaped = text;
+    shaped.replace(QLatin1Char('\n'), QChar::LineSeparator);
+    font.setPixelSize(maxSize);
+    QTextLayout layout(shaped, font);
+    QTextOption option;
+    option.setWrapMode(QTextOption::NoWrap);
+    layout.setTextOption(option);
+    layout.setFormats(formats);
+    layout.beginLayout();
+    for (auto line = layout.createLine(); line.isValid(); line = layout.createLine()) {
+        line.setLineWidth(4.0e6);
+    }
+    layout.endLayout();
+
+    // each paragraph's line height, and the widths of the pieces between the places it may wrap
+    struct Paragraph
+    {
+        qreal height;
+        std::vector<qreal> pieces;
+    };
+    std::vector<Paragraph> paragraphs;
+    QTextBoundaryFinder breaks(QTextBoundaryFinder::Line, shaped);
+    for (auto l = 0; l < layout.lineCount(); ++l) {
+        const auto line = layout.lineAt(l);
+        Paragraph paragraph{line.height(), {}};
+        const auto end = line.textStart() + line.textLength();
+        auto from = line.textStart();
+        breaks.setPosition(from);
+        while (from < end) {
+            const auto next = breaks.toNextBoundary();
+            const auto to = next < 0 || next > end ? end : next;
+            paragraph.pieces.push_back(qAbs(line.cursorToX(to) - line.cursorToX(from)));
+            from = to;
+        }
+        paragraphs.push_back(std::move(paragraph));
+    }
+
+    // how tall the text's box would be at a size, wrapped greedily like QTextLayout does
+    const auto heightAt = [&](const int size) {
+        RenderTrace::count("fitTries");
+        const auto ratio = static_cast<qreal>(size) / maxSize;
+        qreal height = size;
+        for (const auto &paragraph : paragraphs) {
+            auto lines = 1;
+            qreal x = 0;
+            for (const auto piece : paragraph.pieces) {
+                const auto width = piece * ratio;
+                if (x > 0 && x + width > wrapWidth) {
+                    ++lines;
+                    x = 0;
+                }
+                if (width > wrapWidth) {
+                    // wider than a whole line, so it's broken anywhere, and the last of it carries on
+                    const auto more = static_cast<int>(std::ceil(width / wrapWidth)) - 1;
+                    lines += more;
+                    x = width - more * wrapWidth;
+                } else {
+                    x += width;
+                }
+            }
+            height += lines * paragraph.height * ratio * lineHeight;
+        }
+        return height;
+    };
+
+    if (heightAt(maxSize) <= maxHeight) {
+        return maxSize;
+    }
+    auto low = minSize;
+    auto high = maxSize - 1;
+    while (low < high) {
+        const auto middle = (low + high + 1) / 2;
+        if (heightAt(middle) <= maxHeight) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+void StickerGenerator::prepareFonts()
+{
+    // layoutText works out the fallback fonts for each bit of text itself now, it just needs the table built
+    RenderTrace::Stage stage("fonts");
+    FontCoverage::prepare();
+}
+
+StickerGenerator::TextBox StickerGenerator::layoutName(const QString &name,
+                                                      const int fontSize,
+                                                      const QColor &fontColour,
+                                                      const int textY,
+                                                      const int maxWidth)
+{
+    // names repeat far more often than message bodies do, so keep them around, shaped and measured
+    const auto cacheKey = QStringLiteral("%1|%2|%3|%4|%5").arg(name,
+                                                               QString::number(fontSize),
+                                                               QString::number(fontColour.rgba()),
+                                                               QString::number(textY),
+                                                               QString::number(maxWidth));
+    if (TextBox cached; nameCache().find(cacheKey, cached)) {
+        RenderTrace::count("nameCacheHits");
+        return cached;
+    }
+    RenderTrace::count("nameCacheMisses");
+
+    // we automatically have a bold entity wrapping the username
+    QList<Entity> boldEntities;
+    boldEntities.append(Entity{bold, 0, name.length()});
+
+    auto box = layoutText(name, boldEntities, fontSize, &fontColour, 0, textY, maxWidth, true);
+    // a glyph is an index and a position, plus a bit for the bookkeeping around it
+    nameCache().insert(cacheKey, box, box.block.glyphCount() * 32 / 1024);
+    return box;
+}
+
+LruCache<StickerGenerator::TextBox> &StickerGenerator::nameCache()
+{
+    // a laid out name's glyph runs hold on to fonts (and font engines) that belong to the thread that shaped them, so
+    // every thread keeps its own. Layouts are small, so even a share this size holds far more names than it did
+    // pictures of them
+    thread_local PerThreadCache<TextBox> cache(1024);
+    return cache.cache;
 }
 
-QPixmap StickerGenerator::drawRoundRect(const QRgb &colour, const int w, const int h, int r)
+CacheStats StickerGenerator::nameCacheStats()
+{
+    return PerThreadCache<TextBox>::total();
+}
+
+void StickerGenerator::paintRoundRect(QPainter *painter, const QRgb &colour, const QRectF &rect, qreal r)
 {
     // The painter doesn't have a roundrect method, but the path tool does. So let's get set up....
 
+    const auto w = rect.width();
+    const auto h = rect.height();
     if (w < 2 * r) { r = w / 2; }
     if (h < 2 * r) { r = h / 2; }
 
-    auto im = QPixmap(w, h);
-    im.fill(Qt::transparent);
-    QPainter painter(&im);
-    painter.setRenderHint(QPainter::Antialiasing);
-    painter.setPen(colour);
-
-    // now we create our rounded rect as a PATH
-    QPainterPath path;
-    path.addRoundedRect(0, 0, w, h, r, r);
-
-    // and boingo, draw the path, job done
-    const QColor base(colour);
-    const QColor light = base.lighter(150);
-    const QColor dark = base.darker(0);
-    QLinearGradient grad(0, h, w, 0);
-    grad.setColorAt(0.0, light);
-    grad.setColorAt(1.0, dark);
-    painter.fillPath(path, grad);
-    painter.drawPath(path);
-
-    return im;
+    // the same bubble, put together from cached corners rather than rasterising the path. Painters it can't handle
+    // (anything rotated, say) get the path
+    if (!BubbleSprites::paint(painter, colour, rect, r)) {
+        BubbleSprites::paintPath(painter, colour, rect, r);
+    }
 }
 
-QPixmap StickerGenerator::drawReplyLine(const int lineWidth, const int height, const QColor &colour)
+void StickerGenerator::paintReplyLine(QPainter *painter,
+                                      const QPointF &position,
+                                      const int lineWidth,
+                                      const int height,
+                                      const QColor &colour)
 {
     // not tested. here be dragons.
-    QPixmap canvas(20, height);
-    QPainter painter(&canvas);
-    auto pen = painter.pen();
-    pen.setColor(colour);
-    pen.setWidth(lineWidth);
-    painter.drawLine(QPointF(10, 0), QPointF(10, height));
-    return canvas;
+    painter->save();
+    // it used to have a 20 pixel wide picture to itself
+    painter->setClipRect(QRectF(position, QSizeF(20, height)), Qt::IntersectClip);
+    // this used to set up a pen with `colour` and `lineWidth`, but never hand it to the painter, so it has always come
+    // out as the default thin black line. Keeping it that way until someone can actually look at a reply.
+    Q_UNUSED(lineWidth)
+    Q_UNUSED(colour)
+    painter->setPen(QPen());
+    painter->drawLine(position + QPointF(10, 0), position + QPointF(10, height));
+    painter->restore();
 }
 
-QPixmap StickerGenerator::drawAvatar(const ChatUser &user)
+QImage StickerGenerator::drawAvatar(const ChatUser &user, const int size, const int supersample)
 {
-    QPixmap avatarImage;
+    // In group chats the same few people get quoted over and over, so remember what their avatars ended up as.
+    // The file's modification time and size are in the key, so a changed picture is a new entry rather than a stale one.
+    QString cacheKey;
+    RemoteAvatar remote;
+    if (AvatarFetcher::isUrl(user.avatar)) {
+        // by what's actually there, since the same URL can have a new picture behind it
+        RenderTrace::Stage fetchStage("avatarFetch");
+        remote = AvatarFetcher::get(user.avatar);
+        fetchStage.finish();
+        if (remote.bytes.isEmpty()) {
+            return avatarImageLetters(user, size, supersample);
+        }
+        cacheKey = QStringLiteral("%1|%2|%3").arg(user.avatar,
+                                                 QString::fromLatin1(remote.version),
+                                                 QString::number(size));
+        if (QImage cached; avatarCache().find(cacheKey, cached)) {
+            RenderTrace::count("avatarCacheHits");
+            return cached;
+        }
+        RenderTrace::count("avatarCacheMisses");
+    } else if (!user.avatar.isEmpty()) {
+        const QFileInfo file(user.avatar);
+        if (file.exists()) {
+            cacheKey = QStringLiteral("%1|%2|%3|%4").arg(user.avatar,
+                                                         QString::number(file.lastModified().toMSecsSinceEpoch()),
+                                                         QString::number(file.size()),
+                                                         QString::number(size));
+            if (QImage cached; avatarCache().find(cacheKey, cached)) {
+                RenderTrace::count("avatarCacheHits");
+                return cached;
+            }
+            RenderTrace::count("avatarCacheMisses");
+        }
+    }
 
-    // This will load from local file paths (or Qt resources) only.
-    // Caching is not really my job. Use a local picture or set up a QNetworkManager.
-    avatarImage.load(user.avatar);
+    QImage avatarImage;
+
+    // a local file (or a Qt resource), or the picture AvatarFetcher got us
+    RenderTrace::Stage loadStage("avatarLoad");
+    if (remote.bytes.isEmpty()) {
+        avatarImage.load(user.avatar);
+    } else {
+        avatarImage.loadFromData(remote.bytes);
+    }
+    loadStage.finish();
 
-    // generate a picture using user's initials, if we failed to load one from input
+    // generate a picture using user's initials, if we failed to load one from input. It comes back finished.
     if (avatarImage.isNull()) {
-        avatarImage = avatarImageLetters(user);
+        return avatarImageLetters(user, size, supersample);
     }
 
-    // just get the image dimensions and draw a rounded rect mask over it with such big corners that it becomes a circle
-    const auto w = avatarImage.width();
-    const auto h = avatarImage.height();
-    auto mask = QBitmap(w, h);
-    mask.fill(Qt::color0);
-    QPainter painter2(&mask);
-    painter2.setBrush(Qt::color1);
-    // yeah, right
-    const auto r = w < h ? w / 2 : h / 2;
-    painter2.drawRoundedRect(0, 0, w, h, r, r);
-    avatarImage.setMask(mask);
+    RenderTrace::Stage maskStage("avatarMask");
+
+    // shrink it to the size it'll be shown at first, then cut it down to a circle there, where there are a lot fewer
+    // pixels to do it to and the edge comes out antialiased to exactly one of them
+    avatarImage = Downscale::area(avatarImage, avatarImage.size().scaled(size, size, Qt::KeepAspectRatio));
+    CircleClip::apply(avatarImage);
+
+    if (!cacheKey.isEmpty()) {
+        avatarCache().insert(cacheKey, avatarImage, static_cast<int>(avatarImage.sizeInBytes() / 1024));
+    }
 
     return avatarImage;
 }
 
-QPixmap StickerGenerator::avatarImageLetters(const ChatUser &user)
+LruCache<QImage> &StickerGenerator::avatarCache()
+{
+    // 16MiB is a few hundred avatars at the default scale
+    static LruCache<QImage> cache(16 * 1024);
+    return cache;
+}
+
+CacheStats StickerGenerator::avatarCacheStats()
+{
+    return avatarCache().stats();
+}
+
+QImage StickerGenerator::avatarImageLetters(const ChatUser &user, const int size, int supersample)
 {
     // this is harder than it looks because of WIDE characters like emoji
 
@@ -645,10 +985,27 @@ QPixmap StickerGenerator::avatarImageLetters(const ChatUser &user)
     auto colorMapId = QList{0, 7, 4, 1, 6, 3, 5};
     auto nameIndex = static_cast<int>(std::fmod(qAbs(user.id), 7));
 
-    auto color = avatarColorArray[colorMapId[nameIndex]];
+    auto colorIndex = colorMapId[nameIndex];
+    auto color = avatarColorArray[colorIndex];
+
+    // most people don't have an avatar file, so this is the usual case. Everything that changes the picture is in
+    // the key, so each distinct user gets drawn once and then it's a lookup.
+    supersample = qMax(supersample, 1);
+    const auto cacheKey = QStringLiteral("%1|%2|%3|%4").arg(letters,
+                                                            QString::number(colorIndex),
+                                                            QString::number(size),
+                                                            QString::number(supersample));
+    if (QImage cached; initialsCache().find(cacheKey, cached)) {
+        RenderTrace::count("initialsCacheHits");
+        return cached;
+    }
+    RenderTrace::count("initialsCacheMisses");
+    RenderTrace::Stage stage("initials");
 
-    auto size = 500;
-    auto canvas = QPixmap(size, size);
+    // drawn at the size it'll be used at, unless we were asked to supersample.
+    // Everything below is proportional to `drawSize`, so it looks like it always did.
+    const auto drawSize = size * supersample;
+    auto canvas = ImagePool::take(QSize(drawSize, drawSize));
     QPainter painter(&canvas);
 
     auto white = QColor(0xffffff << 0);
@@ -656,20 +1013,40 @@ QPixmap StickerGenerator::avatarImageLetters(const ChatUser &user)
     // just draw a big square over the whole thing, to fill it
     painter.fillRect(0, 0, canvas.width(), canvas.height(), color);
 
-    // ask for our text (1 or 2 letters chosen above) to be drawn on a wee picture
-    auto drawLetters = drawText(letters, QList<Entity>(), static_cast<int>(size / 2.5),
-                                &white, 0, 0, static_cast<int>(size / 1.1), false);
+    // lay out our text (1 or 2 letters chosen above)
+    const auto lettersBox = layoutText(letters, QList<Entity>(), static_cast<int>(drawSize / 2.5),
+                                       &white, 0, 0, static_cast<int>(drawSize / 1.1), false);
 
-    // fit the picture onto the background thing.
+    // fit the letters onto the background thing.
     // I could use the gravity/centre thing if this isn't sufficiently accurate.
-    painter.drawPixmap((canvas.width() - drawLetters.width()) / 2,
-                       (canvas.height() - drawLetters.height()) * 2,
-                       drawLetters);
+    const QPointF lettersPos((canvas.width() - lettersBox.width) / 2, (canvas.height() - lettersBox.height) * 2);
+    lettersBox.block.draw(&painter, lettersPos + lettersBox.offset, lettersBox.width);
+
+    painter.end();
+
+    // and cut it down to a circle, at the size it'll be shown at, like the ones from files
+    if (drawSize != size) {
+        canvas = Downscale::area(canvas, QSize(size, size));
+    }
+    CircleClip::apply(canvas);
+
+    initialsCache().insert(cacheKey, canvas, static_cast<int>(canvas.sizeInBytes() / 1024));
 
     return canvas;
 }
 
-QString StickerGenerator::startEntity(const Styles type)
+LruCache<QImage> &StickerGenerator::initialsCache()
+{
+    static LruCache<QImage> cache(8 * 1024);
+    return cache;
+}
+
+CacheStats StickerGenerator::initialsCacheStats()
+{
+    return initialsCache().stats();
+}
+
+QTextCharFormat StickerGenerator::entityFormat(const Styles type)
 {
     // inconsistency: font styles (esp families) and colours
      /*
@@ -683,9 +1060,11 @@ QString StickerGenerator::startEntity(const Styles type)
       * I do let the monospace text be a different colour in clients I use, but I think it looks better in these
       * pictures to NOT do that.
       */
+    QTextCharFormat format;
     switch (type) {
         case bold:
-            return "<b>";
+            format.setFontWeight(QFont::Bold);
+            break;
         case bot_command:
         case cashtag:
         case email:
@@ -693,54 +1072,33 @@ QString StickerGenerator::startEntity(const Styles type)
         case mention:
         case text_link:
         case url:
-            // we do not care where the URL goes
-            return "<a href='about:blank' style='color: #6ab7ec;'>";
-        case
-            code:
-                // do i need to include a longer list of font families here, or can we treat Noto Mono as a hard req?
-                // I guess if it's missing they'll still get the weight difference at least.
-            return "<code style='font-weight: 100; font-family: \"Noto Mono\", Courier, monospace, ui-monospace; /*color: #5887a7;*/'>";
+            // we do not care where the URL goes. Underlined, like Qt does to rich text links
+            format.setForeground(QColor(0x6a, 0xb7, 0xec));
+            format.setFontUnderline(true);
+            break;
+        case code:
         case pre:
-            return "<pre style='font-weight: 100; font-family: \"Noto Mono\", Courier, monospace, ui-monospace; /*color: #5887a7;*/'>";
+            // do i need to include a longer list of font families here, or can we treat Noto Mono as a hard req?
+            // I guess if it's missing they'll still get the weight difference at least.
+            // pre is drawn inline, like code. It used to get an HTML block of its own, margins and all.
+            format.setFontWeight(QFont::Thin);
+            format.setFontFamilies({"Noto Mono", "Courier", "monospace", "ui-monospace"});
+            format.setFontFixedPitch(true);
+            // format.setForeground(QColor(0x58, 0x87, 0xa7));
+            break;
         case italic:
-            return "<i>";
+            format.setFontItalic(true);
+            break;
         case strikethrough:
-            return "<s>";
+            format.setFontStrikeOut(true);
+            break;
         case underline:
-            return "<u>";
+            format.setFontUnderline(true);
+            break;
         case phonenumber:
             // phone number entities show up at wrong times, and i don't see them on desktop, so i decided to ignore.
         default:
-            return "";
-    }
-}
-
-QString StickerGenerator::endEntity(const Styles type)
-{
-    switch (type) {
-        case bold:
-            return "</b>";
-        case bot_command:
-        case cashtag:
-        case email:
-        case hashtag:
-        case mention:
-        case text_link:
-        case url:
-            return "</a>";
-        case
-            code:
-            return "</code>";
-        case pre:
-            return "</pre>";
-        case italic:
-            return "</i>";
-        case strikethrough:
-            return "</s>";
-        case underline:
-            return "</u>";
-        case phonenumber:
-        default:
-            return "";
+            break;
     }
+    return format;
 }
@@ -4,11 +4,35 @@
 #define STICKERGENERATOR_H
 
 class QColor;
-class QPixmap;
+class QImage;
+class QPainter;
+class QRectF;
+class QTextCharFormat;
 typedef unsigned int QRgb;
 
+#include <QFont>
+#include <QPointF>
+#include <QVector>
+#include <functional>
 #include "ChatMessage.h"
 #include "Entities.h"
+#include "LruCache.h"
+#include "TextBlock.h"
+
+/*
+ * How hard to try with each part of a sticker.
+ * Everything is painted straight onto the finished picture at its final size, which does text and shapes justice.
+ * Above 1, that part is painted at that many times the size on a layer of its own, then shrunk into place.
+ * It costs that number, squared, in pixels.
+ */
+struct RenderQuality
+{
+    // initials avatars only. Avatar pictures are always shrunk straight from the size they were loaded at
+    int avatar = 1;
+    int bubble = 1;
+    int names = 1;
+    int text = 1;
+};
 
 /*
  * Generates "stickers", which are pictures of basic, single, un-timestamped chat messages and associated user Avatars.
@@ -53,42 +77,167 @@ public:
      * Generates a sticker.
      *
      * @param backgroundColour - it's a numeric value like 0xffffff. Might support transparency ¯\_(ツ)_/¯
-     * @param message - Contains information about the message we're drawing, including info about the sender
-     * @param width - it's more of a guide, really. It may influence things like your text layout and maximum sizes
+     * @param messages - the messages we're drawing, top to bottom, including info about their senders. A run of
+     *                  messages from the same sender gets one avatar and one name, like it does in a chat.
+     * @param width - it's more of a guide, really. It may influence things like your text layout and maximum sizes.
+     *                  The finished sticker fits in `width` along its longest edge.
      *
      * @param scale - should adjust the relative size of some of the sticker's content, like text
+     * @param bottomPadding - transparent space to leave under the content, in pixels, inside `width`
+     * @param quality - which parts to supersample, if any
+     * @param autoFit - zero draws message text at one size and only breaks it at newlines, like it always has. More
+     *                  wraps it at `width` and picks its size (quote-api's 18 to 28, times `scale`) so the sticker
+     *                  is no taller than this many times its width, if it can be. 1 is square.
+     *
+     * Everything is laid out first, then painted once, straight onto the finished picture. Nothing is drawn at
+     * `scale` times the size and shrunk afterwards. It all happens on the calling thread, which has to be the one
+     * that paints what it laid out.
+     *
+     * Everything in here draws on QImages rather than QPixmaps, so it's fine to call from several threads at once
+     * (as long as the platform can render fonts off the GUI thread - see RenderPool).
+     */
+    static QImage
+    generate(const QRgb &backgroundColour,
+             QList<ChatMessage> &messages,
+             int width = 512,
+             int scale = 2,
+             int bottomPadding = 0,
+             const RenderQuality &quality = RenderQuality(),
+             double autoFit = 0);
+
+    /*
+     * Builds the table of which fallback font covers what (see FontCoverage). Only does the work once per process,
+     * so a long-running process can call it up front and never pay for it during a sticker.
+     */
+    static void prepareFonts();
+
+    /*
+     * @return how the avatar cache (see `drawAvatar`) has been doing
+     */
+    static CacheStats avatarCacheStats();
+
+    /*
+     * @return how the initials avatar cache (see `avatarImageLetters`) has been doing
+     */
+    static CacheStats initialsCacheStats();
+
+    /*
+     * @return how the name cache (see `layoutName`) has been doing
      */
-    static QPixmap
-    generate(const QRgb &backgroundColour, ChatMessage &message, int width = 512, int scale = 2);
+    static CacheStats nameCacheStats();
 
 private:
 
     /*
-     * Opens an HTML element in the rich text we generate for rendering
+     * Some text, laid out, and the box it was measured into. Sizes are in layout pixels (`scale` times the size).
+     */
+    struct TextBox
+    {
+        TextBlock block;
+        // where the text sits inside its box
+        QPointF offset;
+        int width = 0;
+        int height = 0;
+
+        // there's nothing to draw if the box has no area (a picture of it would have been null)
+        bool isNull() const { return width <= 0 || height <= 0; }
+    };
+
+    /*
+     * One message, laid out and measured, ready for drawQuote to stack up with the rest. Layout pixels throughout,
+     * relative to the top of the message.
+     */
+    struct Bubble
+    {
+        // whose avatar goes next to it, if any. Only the first of a run of messages from one sender gets an avatar
+        // (and a name)
+        ChatUser user;
+        bool showAvatar = true;
+
+        TextBox replyName;
+        TextBox replyText;
+        TextBox name;
+        TextBox text;
+
+        // whether there's a bubble behind the text. A lone message from someone with no name has never had one
+        bool filled = false;
+
+        // the whole message, the avatar's column included
+        int width = 0;
+        double height = 0;
+
+        // where everything goes
+        int namePosX = 0;
+        int namePosY = 0;
+        int textPosX = 0;
+        double textPosY = 0;
+        int replyPosX = 0;
+        double replyNamePosY = 0;
+        double replyTextPosY = 0;
+
+        // nothing to draw, like a message with no text from someone with no name
+        bool isNull() const { return width <= 0 || height <= 0; }
+    };
+
+    /*
+     * Lays out one message's name, text and reply, and measures them up (see `measureBubble`)
      *
-     * @param type - see `Entities::styles` enum
+     * @param backgroundColour - the bubble's colour, which decides whether the text is dark or light
+     * @param message - the message
+     * @param continued - whether it's from the same sender as the message above it, which has the name and avatar
+     * @param width - the widest the text may go, in layout pixels
+     * @param scale - see `generate`
+     * @param fitHeight - auto-fitting (see `generate`): how tall the message may be, in layout pixels. 0 for no fitting
      *
-     * @return opening html tag
+     * @return the message, ready to stack
+     */
+    static Bubble layoutMessage(QRgb backgroundColour,
+                                ChatMessage &message,
+                                bool continued,
+                                int width,
+                                int scale,
+                                qreal fitHeight = 0);
+
+    /*
+     * Works out how big a message's bubble is and where everything in it goes, from its laid out text
+     */
+    static void measureBubble(Bubble &bubble, int scale);
+
+    /*
+     * Paints one message's bubble, name, text and reply (not its avatar) in layout pixels. The painter does the
+     * positioning and shrinking.
      */
-    static QString startEntity(Styles type);
+    static void paintBubble(QPainter *painter,
+                            const Bubble &bubble,
+                            QRgb backgroundColour,
+                            int scale,
+                            const RenderQuality &quality);
 
     /*
-     * Closes an HTML element in the rich text we generate for rendering. Surprised?
+     * Describes how an entity looks, as a character format for the text layout
      *
      * @param type - see `Entities::styles` enum
      *
-     * @return closing html tag
+     * @return the format. Empty for entities we don't draw any differently.
      */
-    static QString endEntity(Styles type);
+    static QTextCharFormat entityFormat(Styles type);
 
     /*
-     * Draws a substitute avatar using the user's initials
+     * Draws a substitute avatar using the user's initials, on a circle, at the size it'll be drawn at.
+     * Kept in `initialsCache`, because it's what most people get.
      *
      * @param user - The user
+     * @param size - width and height of the avatar, in pixels
+     * @param supersample - draw it this many times bigger and shrink it down. 1 draws it at `size`
      *
      * @return picture of user's initials
      */
-    static QPixmap avatarImageLetters(const ChatUser &user);
+    static QImage avatarImageLetters(const ChatUser &user, int size, int supersample);
+
+    /*
+     * Finished initials avatars, keyed by the letters, their palette index, the pixel size and the supersampling.
+     */
+    static LruCache<QImage> &initialsCache();
 
     /*
      * Uses SuperHardPoo algorithm to tell you whether your input colour is light or dark
@@ -100,7 +249,8 @@ private:
     static bool isLight(const QRgb &colour);
 
     /*
-     * Given input text and some metadata, returns a drawing of the text (with formatting)
+     * Given input text and some metadata, lays the text out (with formatting) and measures the box it needs.
+     * Nothing is drawn until drawQuote knows how big the sticker ends up.
      *
      * @param text - the text to draw
      * @param entities - formatting entities (boldness, etc) to apply to the text
@@ -110,75 +260,147 @@ private:
      * @param textY - rendered text's offset from top margin, in pixels
      * @param maxWidth - maximum width of rendered text, in pixels
      * @param isName - whether the text is to be drawn as a name. names require a little special treatment
+     * @param fitHeight - if more than 0, the text is wrapped at `maxWidth` and shrunk (from `fontSize` down to
+     *                    `minFontSize` at the most) until its box is no taller than this. See `fitFontSize`.
+     * @param minFontSize - see `fitHeight`
      *
-     * @return a picture of some text, formatted
+     * @return some text, formatted and ready to draw
      */
-    static QPixmap drawText(QString &text,
-                            const QList<Entity> &entities,
-                            int fontSize,
-                            const QColor *fontColour,
-                            int textX,
-                            int textY,
-                            int maxWidth,
-                            bool isName);
+    static TextBox layoutText(const QString &text,
+                              const QList<Entity> &entities,
+                              int fontSize,
+                              const QColor *fontColour,
+                              int textX,
+                              int textY,
+                              int maxWidth,
+                              bool isName,
+                              qreal fitHeight = 0,
+                              int minFontSize = 0);
 
     /*
-     * Draws a rounded rectangle
-     * This implementation is a very simple wrapper around a method which, mercifully, is in the underlying library.
+     * Auto-fitting: the biggest font size between two that some text, wrapped at `wrapWidth`, is no taller than
+     * `maxHeight` at (counting the font size of padding layoutText adds under it).
+     * The text is shaped once, at `maxSize`, with no wrapping, and measured between the places it's allowed to wrap.
+     * Glyphs aren't hinted, so at any other size every one of those widths is just scaled, and so is the line height.
+     * Trying a size is then only wrapping a list of numbers, so the sizes are binary searched that way, and the text
+     * is only laid out for real once, at the size that wins.
      *
-     * @param colour - fill colour for rectangle
-     * @param w - width of rectangle, in pixels
-     * @param h - height of rectangle, in pixels
-     * @param r - radius of corners, in pixes
+     * @return the size, or `minSize` if even that's too tall
+     */
+    static int fitFontSize(const QString &text,
+                           const QVector<QTextLayout::FormatRange> &formats,
+                           QFont font,
+                           int minSize,
+                           int maxSize,
+                           qreal wrapWidth,
+                           qreal maxHeight,
+                           qreal lineHeight);
+
+    /*
+     * Lays out someone's name: `layoutText`, in bold, with the special name treatment.
+     * Laid out names are kept in `nameCache`, so a regular's name is only shaped once.
      *
-     * @return a drawing of a rounded rectangle
+     * @param name - their name
+     * @param fontSize - font size given in pixels
+     * @param fontColour - colour for the name
+     * @param textY - rendered name's offset from top margin, in pixels
+     * @param maxWidth - maximum width of the rendered name, in pixels
+     *
+     * @return their name, laid out
+     */
+    static TextBox layoutName(const QString &name, int fontSize, const QColor &fontColour, int textY, int maxWidth);
+
+    /*
+     * Laid out names, keyed by everything `layoutName` takes. Shared by senders and the people they're replying to.
+     * They hold glyphs rather than pixels, so the same name is fine at whatever size the sticker ends up. It's this
+     * thread's: glyphs can only be drawn on the thread that shaped them.
      */
-    static QPixmap drawRoundRect(const QRgb &colour, int w, int h, int r);
+    static LruCache<TextBox> &nameCache();
 
     /*
-     * Draws a vertical line next to the "replying-to section" at the top of the message.
+     * Paints a rounded rectangle
+     * Usually that's BubbleSprites' job. Otherwise it's a very simple wrapper around a method which, mercifully, is in
+     * the underlying library.
+     *
+     * @param painter - what to paint with, transform and all
+     * @param colour - fill colour for rectangle
+     * @param rect - where the rectangle goes, in the painter's coordinates
+     * @param r - radius of corners, in the painter's coordinates
+     */
+    static void paintRoundRect(QPainter *painter, const QRgb &colour, const QRectF &rect, qreal r);
+
+    /*
+     * Paints a vertical line next to the "replying-to section" at the top of the message.
 
      * Direct, untested port from Javascript/canvas code.
      *
+     * @param painter - what to paint with
+     * @param position - top left of the 20 pixel wide strip the line goes in
      * @param lineWidth - width of line, in pixels
      * @param height - height, of line, in pixels
      * @param colour - colour of line
+     */
+    static void paintReplyLine(QPainter *painter,
+                               const QPointF &position,
+                               int lineWidth,
+                               int height,
+                               const QColor &colour);
+
+    /*
+     * Paints one part of the sticker, optionally supersampled (see RenderQuality)
      *
-     * @return picture of line
+     * @param painter - the sticker's painter
+     * @param rect - roughly where the part goes, in the painter's coordinates. Only used when supersampling.
+     * @param supersample - 1 paints straight through `painter`. More paints a layer that many times the size first.
+     * @param paint - does the painting, with whichever painter it's given
      */
-    static QPixmap drawReplyLine(int lineWidth, int height, const QColor &colour);
+    static void paintSupersampled(QPainter *painter,
+                                  const QRectF &rect,
+                                  int supersample,
+                                  const std::function<void(QPainter *)> &paint);
 
     /*
-     * Draws the user's avatar as a little circle. Will be generated from their name, if it doesn't load.
+     * Draws the user's avatar as a little circle. Will be generated from their name, if it doesn't load (or, for a URL,
+     * doesn't turn up in time: see AvatarFetcher).
+     * Avatars loaded from files or URLs are kept in `avatarCache`, finished, so a repeat quote doesn't decode, mask or
+     * scale.
+     * Initials avatars have their own cache; see `avatarImageLetters`.
      *
      * @param user - The user who probably has an interesting name and/or avatar
+     * @param size - how big the avatar should end up, in pixels
+     * @param supersample - passed on to `avatarImageLetters`
      *
      * @returns a picture of the avatar
      */
-    static QPixmap drawAvatar(const ChatUser &user);
+    static QImage drawAvatar(const ChatUser &user, int size, int supersample = 1);
+
+    /*
+     * Finished avatars, keyed by file path, modification time, file size and pixel size (or by URL, which picture is
+     * behind it, and pixel size).
+     */
+    static LruCache<QImage> &avatarCache();
 
     /*
-     * Positions all our little pictures (including the rectangle - soon) on one big picture and returns it
+     * Stacks the laid out messages, one under the other, and paints them (and their avatars) onto the finished sticker
      *
-     * Functionality of replyName and replyText isn't yet confirmed.
+     * Positions are all worked out in layout pixels, like they always were. Then the painter is scaled so the lot fits
+     * in `target`, and everything is painted through it once. Avatars are fetched at the size they end up.
      *
-     * @param backgroundColour - the colour which the rounded-rectangle behind the text will be filled with
-     * @param avatar - a picture of a user's avatar, either organic (from URI) or artificial (from initials)
-     * @param replyName - a picture of text of an original message author's name to which this message is a reply.
-     * @param replyText - a picture of text of an original message to which this message is a reply. Untested.
-     * @param name - a picture of the message's author's name
-     * @param text - a picture of the (formatted) text of the original message
+     * @param backgroundColour - the colour which the rounded-rectangles behind the text will be filled with
+     * @param bubbles - the messages, top to bottom, from `layoutMessage`
      * @param scale - scale control for spacing and sizing of elements
+     * @param target - how wide the finished sticker is allowed to be, and how tall (padding included)
+     * @param bottomPadding - transparent space under the content, in finished pixels
+     * @param quality - which parts to supersample
      *
-     * return a picture of the message, with all the details we wanted now included
+     * return a picture of the messages, with all the details we wanted now included
      */
-    static QPixmap drawQuote(QRgb backgroundColour,
-                             const QPixmap &avatar,
-                             const QPixmap &replyName,
-                             const QPixmap &replyText,
-                             const QPixmap &name,
-                             const QPixmap &text,
-                             int scale = 1);
+    static QImage drawQuote(QRgb backgroundColour,
+                            const QVector<Bubble> &bubbles,
+                            int scale,
+                            int target,
+                            int bottomPadding,
+                            const RenderQuality &quality);
 
 };
 
@@ -0,0 +1,15 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "StickerRequest.h"
+#include "StickerGenerator.h"
+
+QImage StickerRequest::render()
+{
+    // tg says somewhere in docs that sticker input MUST be 512px along its longest edge, so the content is fitted into
+    // `width`, with a fixed transparent bottom padding. The generator paints it at that size to begin with.
+    constexpr int bottomPadding = 70;
+
+    // we pass in the ChatMessages constructed from input json, and they include Entities and ChatUsers from the same
+    return StickerGenerator::generate(backgroundColour, messages, width, scale, bottomPadding, quality, autoFit);
+}
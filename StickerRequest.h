@@ -0,0 +1,59 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef STICKERREQUEST_H
+#define STICKERREQUEST_H
+
+#include <QImage>
+#include <QJsonValue>
+#include <QRgb>
+#include <QString>
+#include "ChatMessage.h"
+#include "Encoder.h"
+#include "StickerGenerator.h"
+
+/*
+ * One sticker's worth of input: the JSON payload from the README, unmarshalled (by PayloadParser).
+ * main.cpp used to do all this inline, but the daemon needs to do it many times per process, so it lives here now.
+ */
+struct StickerRequest
+{
+    // colour of the bubble behind the text
+    QRgb backgroundColour = 0;
+
+    // width guide for the layout, and also the length of the sticker's longest edge
+    int width = 0;
+
+    // see StickerGenerator::generate
+    int scale = 0;
+
+    // which parts of the sticker to supersample. Nothing, unless the payload asks
+    RenderQuality quality;
+
+    // see StickerGenerator::generate. 0 (the default) is off; "autoFit":true in the payload is 1, for square
+    double autoFit = 0;
+
+    // the messages we're drawing, top to bottom, and who sent them. Usually just the one
+    QList<ChatMessage> messages;
+
+    // where to put the finished picture. Optional in daemon mode, where the picture can come back in the response.
+    QString output;
+
+    // how to encode the finished picture: the command line's defaults, then the payload's "format" and "encoder"
+    EncoderSettings encoder;
+
+    // whatever the caller wants echoed back to them in daemon mode, so they can match responses to requests
+    QJsonValue id;
+
+    // daemon only: not a sticker at all, just someone asking how the caches are doing
+    bool stats = false;
+
+    /*
+     * Draws the sticker, scaled to fit `width` along its longest edge, with the transparent padding telegram likes.
+     *
+     * @return the finished picture
+     */
+    QImage render();
+};
+
+
+#endif //STICKERREQUEST_H
@@ -0,0 +1,345 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "StickerServer.h"
+#include <QFont>
+#include <QFontMetrics>
+#include <QImage>
+#include <QImageWriter>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "AvatarFetcher.h"
+#include "BubbleSprites.h"
+#include "Encoder.h"
+#include "ImagePool.h"
+#include "PayloadParser.h"
+#include "PreforkServer.h"
+#include "RenderCache.h"
+#include "RenderPool.h"
+#include "RenderTrace.h"
+#include "StickerGenerator.h"
+#include "StickerRequest.h"
+
+namespace
+{
+// far more than any sticker's payload, but not so much that a client that never sends a newline can run us out
+constexpr qsizetype maxLineBytes = 4 * 1024 * 1024;
+}
+
+void StickerServer::warmUp()
+{
+    // substitutions, then make Qt actually resolve the font so fontconfig does its big scan now rather than later
+    // (with a FontSnapshot, a small one)
+    StickerGenerator::prepareFonts();
+    QFont font("NotoSans");
+    font.setPixelSize(48);
+    QFontMetrics(font).horizontalAdvance(QStringLiteral("warm up 🙂"));
+
+    // the image format plugins are loaded lazily, so make sure the encoder we'll use by default is in memory too
+    QImageWriter::supportedImageFormats();
+    QImage pixel(1, 1, QImage::Format_ARGB32_Premultiplied);
+    pixel.fill(Qt::transparent);
+    Encoder::encode(pixel, Encoder::defaults());
+}
+
+int StickerServer::serveStream(const int inFd, const int outFd, RenderPool &pool)
+{
+    // a dead client shouldn't take the whole server down with it
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // the workers can finish in any order, so a writer thread waits on each response in turn to keep them in order.
+    // Only a few per worker are let in at once, so a client that sends faster than we draw (or reads slower) has to
+    // wait, rather than us queueing up everything it sends
+    const auto maxInFlight = static_cast<size_t>(pool.size()) * 4;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::future<QByteArray>> inFlight;
+    auto inputEnded = false;
+    auto outputBroken = false;
+
+    std::thread writer([&] {
+        for (;;) {
+            std::future<QByteArray> next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return inputEnded || !inFlight.empty(); });
+                if (inFlight.empty()) {
+                    return;
+                }
+                next = std::move(inFlight.front());
+                inFlight.pop_front();
+            }
+            changed.notify_all();
+            if (!writeAll(outFd, next.get() + '\n')) {
+                std::lock_guard<std::mutex> lock(mutex);
+                outputBroken = true;
+            }
+        }
+    });
+
+    const auto queue = [&](std::future<QByteArray> response) {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return inFlight.size() < maxInFlight; });
+        inFlight.push_back(std::move(response));
+        const auto keepGoing = !outputBroken;
+        lock.unlock();
+        changed.notify_all();
+        return keepGoing;
+    };
+    const auto queueLine = [&](const QByteArray &line) {
+        return queue(pool.submit([line] { return handle(line); }));
+    };
+    const auto queueTooLong = [&] {
+        QJsonObject response;
+        response["ok"] = false;
+        response["error"] = QStringLiteral("request is longer than %1 MiB").arg(maxLineBytes / 1024 / 1024);
+        response["errorCode"] = QStringLiteral("tooLong");
+        std::promise<QByteArray> ready;
+        ready.set_value(QJsonDocument(response).toJson(QJsonDocument::Compact));
+        return queue(ready.get_future());
+    };
+
+    QByteArray pending;
+    // after a line that was too long, until its newline turns up
+    auto skipping = false;
+    char chunk[65536];
+    auto result = 0;
+    for (;;) {
+        const auto got = read(inFd, chunk, sizeof chunk);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            // a request without its trailing newline still counts, if the input ends right after it
+            if (!skipping && !pending.trimmed().isEmpty()) {
+                queueLine(pending);
+            }
+            result = got < 0 ? 1 : 0;
+            break;
+        }
+        pending.append(chunk, static_cast<int>(got));
+
+        qsizetype newline;
+        auto keepGoing = true;
+        while (keepGoing && (newline = pending.indexOf('\n')) >= 0) {
+            const auto line = pending.left(newline);
+            pending.remove(0, newline + 1);
+            if (skipping) {
+                // the end of one we've already answered
+                skipping = false;
+            } else if (line.size() > maxLineBytes) {
+                keepGoing = queueTooLong();
+            } else if (!line.trimmed().isEmpty()) {
+                keepGoing = queueLine(line);
+            }
+        }
+        // no newline in sight: answer it now, and throw the rest away as it comes rather than keeping it all
+        if (keepGoing && pending.size() > maxLineBytes) {
+            if (!skipping) {
+                keepGoing = queueTooLong();
+                skipping = true;
+            }
+            pending.clear();
+        }
+        if (!keepGoing) {
+            result = 1;
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        inputEnded = true;
+    }
+    changed.notify_all();
+    writer.join();
+    return result;
+}
+
+int StickerServer::serveSocket(const QString &path, RenderPool &pool)
+{
+    const auto listener = listenOn(path);
+    if (listener < 0) {
+        return 1;
+    }
+    return serveListener(listener, pool);
+}
+
+int StickerServer::listenOn(const QString &path)
+{
+    const auto encodedPath = path.toLocal8Bit();
+    sockaddr_un address{};
+    if (encodedPath.size() >= static_cast<qsizetype>(sizeof address.sun_path)) {
+        std::fprintf(stderr, "Socket path is too long: %s\n", encodedPath.constData());
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, encodedPath.constData(), encodedPath.size());
+
+    const auto listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::perror("socket");
+        return -1;
+    }
+    unlink(encodedPath.constData());
+    if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof address) < 0 || listen(listener, 16) < 0) {
+        std::perror("bind/listen");
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+int StickerServer::serveListener(const int listener, RenderPool &pool)
+{
+    // a thread per connection, just to read and write. Each connection can send as many requests as it likes.
+    std::signal(SIGPIPE, SIG_IGN);
+    for (;;) {
+        const auto connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno != EINTR) {
+                std::perror("accept");
+            }
+            continue;
+        }
+        std::thread([connection, &pool] {
+            serveStream(connection, connection, pool);
+            close(connection);
+        }).detach();
+    }
+}
+
+QByteArray StickerServer::handle(const QByteArray &line)
+{
+    if (!RenderTrace::enabled()) {
+        const auto response = respond(line);
+        PreforkServer::served(response["ok"].toBool());
+        return QJsonDocument(response).toJson(QJsonDocument::Compact);
+    }
+
+    RenderTrace::begin();
+    const auto response = respond(line);
+    const auto trace = RenderTrace::end();
+    PreforkServer::served(response["ok"].toBool());
+    QJsonObject record;
+    record["mode"] = QStringLiteral("daemon");
+    record["id"] = response["id"];
+    record["ok"] = response["ok"];
+    RenderTrace::write(record, trace);
+    return QJsonDocument(response).toJson(QJsonDocument::Compact);
+}
+
+QJsonObject StickerServer::respond(const QByteArray &line)
+{
+    QJsonObject response;
+    RenderTrace::Stage parseStage("parse");
+    StickerRequest request;
+    const auto error = PayloadParser::parse(line, request);
+    response["id"] = request.id;
+
+    // not a sticker, just someone asking how the caches are doing
+    if (request.stats && (!error || error.code == PayloadError::NoMessage)) {
+        response["ok"] = true;
+        response["avatarCache"] = statsJson(StickerGenerator::avatarCacheStats());
+        response["initialsCache"] = statsJson(StickerGenerator::initialsCacheStats());
+        response["nameCache"] = statsJson(StickerGenerator::nameCacheStats());
+        response["renderCache"] = statsJson(RenderCache::memoryStats());
+        response["bubbleCache"] = statsJson(BubbleSprites::cornerStats());
+        response["imagePool"] = statsJson(ImagePool::stats());
+        response["avatarFetch"] = statsJson(AvatarFetcher::stats());
+        return response;
+    }
+
+    if (error) {
+        response["ok"] = false;
+        response["error"] = error.message();
+        response["errorCode"] = QLatin1String(error.name());
+        return response;
+    }
+    parseStage.finish();
+
+    // a sticker too big to draw (bad_alloc, say) is this request's problem, not every other client's
+    EncodedSticker sticker;
+    try {
+        sticker = RenderCache::draw(request, request.output);
+    } catch (const std::exception &e) {
+        response["ok"] = false;
+        response["error"] = QStringLiteral("could not draw the sticker: ") + QString::fromLocal8Bit(e.what());
+        response["errorCode"] = QStringLiteral("renderFailed");
+        return response;
+    } catch (...) {
+        response["ok"] = false;
+        response["error"] = QStringLiteral("could not draw the sticker");
+        response["errorCode"] = QStringLiteral("renderFailed");
+        return response;
+    }
+    const auto &encoded = sticker.bytes;
+    const auto format = QString::fromLatin1(sticker.encoding.format);
+    if (encoded.isEmpty()) {
+        response["ok"] = false;
+        response["error"] = QStringLiteral("could not encode as ") + format;
+        return response;
+    }
+    // so whoever's tuning the encoder can see what they're trading
+    response["format"] = format;
+    response["bytes"] = sticker.encoding.bytes;
+    response["encodeUs"] = sticker.encoding.encodeUs;
+    response["cached"] = sticker.cached;
+
+    if (!request.output.isEmpty()) {
+        const auto saved = Encoder::writeFile(request.output, encoded);
+        response["ok"] = saved;
+        if (saved) {
+            response["output"] = request.output;
+        } else {
+            response["error"] = QStringLiteral("could not write ") + request.output;
+        }
+        return response;
+    }
+
+    response["ok"] = true;
+    response["width"] = sticker.width;
+    response["height"] = sticker.height;
+    response["image"] = QString::fromLatin1(encoded.toBase64());
+    return response;
+}
+
+QJsonObject StickerServer::statsJson(const CacheStats &stats)
+{
+    QJsonObject json;
+    json["hits"] = static_cast<qint64>(stats.hits);
+    json["misses"] = static_cast<qint64>(stats.misses);
+    json["entries"] = stats.entries;
+    json["usedKiB"] = stats.usedKiB;
+    json["maxKiB"] = stats.maxKiB;
+    return json;
+}
+
+bool StickerServer::writeAll(const int fd, const QByteArray &bytes)
+{
+    qsizetype done = 0;
+    while (done < bytes.size()) {
+        const auto wrote = write(fd, bytes.constData() + done, static_cast<size_t>(bytes.size() - done));
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote <= 0) {
+            return false;
+        }
+        done += wrote;
+    }
+    return true;
+}
@@ -0,0 +1,108 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef STICKERSERVER_H
+#define STICKERSERVER_H
+
+#include <QByteArray>
+#include <QString>
+
+class QJsonObject;
+class RenderPool;
+struct CacheStats;
+
+/*
+ * Keeps one process (and therefore one QGuiApplication, one font database and one set of loaded Qt plugins) alive
+ * for lots of stickers, instead of paying for all of that on every popen.
+ *
+ * The protocol is newline-delimited JSON, both ways. Each request line is the same payload main.cpp takes on stdin,
+ * optionally with an "id" (echoed back) and an "output" path. Each response line looks like
+ *   {"id":..., "ok":true, "output":"/where/it/went.webp", ...}          when an output path was given, or
+ *   {"id":..., "ok":true, "image":"<base64>", ...}                      when it wasn't, or
+ *   {"id":..., "ok":false, "error":"what went wrong"}
+ * A payload we couldn't read also gets an "errorCode" (see PayloadError::name), like "syntax" or "wrongType", and
+ * a line longer than 4MiB gets "tooLong" (and no "id", since we didn't keep it). A sticker that couldn't be drawn
+ * at all (too big to fit in memory, say) gets "renderFailed".
+ * Encoded stickers also come with "format", "bytes" and "encodeUs" (how long encoding took, in microseconds), and
+ * "cached", which says whether the sticker came out of the RenderCache instead of being drawn.
+ * A request of just {"stats":true} gets the cache hit/miss counters back instead of a sticker.
+ * Responses come back in the same order as the requests, even though the stickers are drawn in parallel on a
+ * RenderPool. Socket connections are served concurrently, and share the one pool. Each connection only has a few
+ * requests per worker on the go at once; past that, we stop reading until the client's caught up on responses.
+ */
+class StickerServer
+{
+public:
+    /*
+     * Does all the slow once-per-process setup (fonts, image plugins) so the first request doesn't pay for it.
+     * Needs a QGuiApplication to exist already.
+     */
+    static void warmUp();
+
+    /*
+     * Serves requests from one file descriptor, writing responses to another, until the input ends
+     *
+     * @param inFd - where requests come from. stdin (0), or a socket
+     * @param outFd - where responses go. stdout (1), or the same socket
+     * @param pool - the workers which do the drawing
+     *
+     * @return 0 when the input ended normally, non-zero if we gave up on it
+     */
+    static int serveStream(int inFd, int outFd, RenderPool &pool);
+
+    /*
+     * Listens on a unix domain socket and serves each connection with `serveStream`, forever
+     *
+     * @param path - filesystem path for the socket. Anything already there is removed first.
+     * @param pool - the workers which do the drawing, for every connection
+     *
+     * @return non-zero if the socket couldn't be set up. Doesn't return otherwise.
+     */
+    static int serveSocket(const QString &path, RenderPool &pool);
+
+    /*
+     * Creates a unix domain socket and starts listening on it
+     *
+     * @param path - filesystem path for the socket. Anything already there is removed first.
+     *
+     * @return the listening socket, or -1 if it couldn't be set up (having said why on stderr)
+     */
+    static int listenOn(const QString &path);
+
+    /*
+     * Accepts connections on a socket that's already listening and serves each with `serveStream`, forever.
+     * Several processes can do this on the same socket at once; each connection goes to one of them.
+     *
+     * @param listener - from `listenOn`
+     * @param pool - the workers which do the drawing, for every connection
+     *
+     * @return doesn't
+     */
+    static int serveListener(int listener, RenderPool &pool);
+
+private:
+    /*
+     * Turns one request line into one response line (without the newline). Runs on the pool's workers.
+     * Traces the request too, if tracing is on (see RenderTrace).
+     */
+    static QByteArray handle(const QByteArray &line);
+
+    /*
+     * Does the work for `handle`
+     *
+     * @return the response
+     */
+    static QJsonObject respond(const QByteArray &line);
+
+    /*
+     * Describes a cache's counters in JSON
+     */
+    static QJsonObject statsJson(const CacheStats &stats);
+
+    /*
+     * write(2), but keeps going until it's all out or the other end goes away
+     */
+    static bool writeAll(int fd, const QByteArray &bytes);
+};
+
+
+#endif //STICKERSERVER_H
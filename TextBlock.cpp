@@ -0,0 +1,105 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "TextBlock.h"
+#include <QFont>
+#include <QPainter>
+#include <QTextOption>
+
+TextBlock TextBlock::layout(QString text,
+                            const QVector<QTextLayout::FormatRange> &formats,
+                            const QFont &font,
+                            const QColor &colour,
+                            const qreal lineHeight,
+                            const qreal wrapWidth,
+                            const bool forceLeft)
+{
+    TextBlock block;
+
+    // QTextLayout only breaks at the unicode line separator. It's one character, same as '\n', so the ranges still fit
+    text.replace(QLatin1Char('\n'), QChar::LineSeparator);
+    block.rightToLeft = !forceLeft && text.isRightToLeft();
+
+    QTextLayout layout(text, font);
+    QTextOption option;
+    // we line right-to-left text up ourselves in draw(). Left to Qt, it would be lined up with the end of an
+    // "unbounded" line, which is a very long way to the right.
+    option.setAlignment(Qt::AlignLeft | Qt::AlignAbsolute);
+    option.setWrapMode(wrapWidth < 0 ? QTextOption::NoWrap : QTextOption::WrapAtWordBoundaryOrAnywhere);
+    layout.setTextOption(option);
+    layout.setFormats(formats);
+
+    // this is where the shaping happens, once
+    constexpr auto unbounded = 4.0e6;
+    qreal y = 0;
+    qreal widest = 0;
+    layout.beginLayout();
+    for (;;) {
+        auto line = layout.createLine();
+        if (!line.isValid()) {
+            break;
+        }
+        line.setLineWidth(wrapWidth < 0 ? unbounded : wrapWidth);
+        line.setPosition(QPointF(0, y));
+        y += line.height() * lineHeight;
+        widest = qMax(widest, line.naturalTextWidth());
+    }
+    layout.endLayout();
+
+    block.size = QSizeF(widest, y);
+    block.lines = layout.lineCount();
+
+    // glyph runs don't know about colours, so work out which characters get which colour, and ask for them separately.
+    // -1 is the default colour, anything else is an index into `palette`. Later formats win, like they do in Qt.
+    QVector<int> colourOf(text.size(), -1);
+    QVector<QColor> palette;
+    for (const auto &range : formats) {
+        if (!range.format.hasProperty(QTextFormat::ForegroundBrush)) {
+            continue;
+        }
+        palette.push_back(range.format.foreground().color());
+        const auto end = qMin(range.start + range.length, static_cast<int>(text.size()));
+        for (auto i = qMax(range.start, 0); i < end; ++i) {
+            colourOf[i] = static_cast<int>(palette.size()) - 1;
+        }
+    }
+
+    for (auto i = 0; i < layout.lineCount(); ++i) {
+        const auto line = layout.lineAt(i);
+        auto from = line.textStart();
+        const auto to = from + line.textLength();
+        while (from < to) {
+            auto segmentEnd = from + 1;
+            while (segmentEnd < to && colourOf[segmentEnd] == colourOf[from]) {
+                ++segmentEnd;
+            }
+            const auto segmentColour = colourOf[from] < 0 ? colour : palette[colourOf[from]];
+            for (const auto &glyphs : line.glyphRuns(from, segmentEnd - from)) {
+                if (!glyphs.glyphIndexes().isEmpty()) {
+                    block.runs.push_back({glyphs, segmentColour, line.naturalTextWidth()});
+                }
+            }
+            from = segmentEnd;
+        }
+    }
+
+    return block;
+}
+
+int TextBlock::glyphCount() const
+{
+    auto count = 0;
+    for (const auto &run : runs) {
+        count += static_cast<int>(run.glyphs.glyphIndexes().size());
+    }
+    return count;
+}
+
+void TextBlock::draw(QPainter *painter, const QPointF &position, const qreal boxWidth) const
+{
+    for (const auto &run : runs) {
+        painter->setPen(run.colour);
+        const auto offset = rightToLeft ? boxWidth - run.lineWidth : 0;
+        painter->drawGlyphRun(position + QPointF(offset, 0), run.glyphs);
+    }
+}
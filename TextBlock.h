@@ -0,0 +1,89 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+#ifndef TEXTBLOCK_H
+#define TEXTBLOCK_H
+
+#include <QColor>
+#include <QGlyphRun>
+#include <QSizeF>
+#include <QTextLayout>
+#include <QVector>
+
+class QFont;
+class QPainter;
+
+/*
+ * A paragraph of formatted text, shaped and broken into lines, ready to draw.
+ *
+ * We used to build HTML out of the text and entities and let QStaticText parse it all back out again. This goes
+ * straight from character format ranges to QTextLayout, shapes once, and keeps the positioned glyphs, so there's
+ * no markup round trip and nothing gets laid out twice.
+ */
+class TextBlock
+{
+public:
+    TextBlock() = default;
+
+    /*
+     * Shapes some text and breaks it into lines
+     *
+     * @param text - the text. '\n' starts a new line.
+     * @param formats - character formats (bold, links, etc) to apply to ranges of the text. Ranges may overlap.
+     * @param font - font for anything the formats don't say otherwise about
+     * @param colour - colour for anything the formats don't give a foreground to
+     * @param lineHeight - distance between lines, as a proportion of the font's, like CSS's line-height: 90%
+     * @param wrapWidth - longest a line may get before it's wrapped, in pixels. Negative means only wrap at '\n'.
+     * @param forceLeft - keep lines at the left even if the text is right-to-left
+     *
+     * @return the laid out text
+     */
+    static TextBlock layout(QString text,
+                            const QVector<QTextLayout::FormatRange> &formats,
+                            const QFont &font,
+                            const QColor &colour,
+                            qreal lineHeight,
+                            qreal wrapWidth,
+                            bool forceLeft);
+
+    /*
+     * @return width of the widest line and the height of all of them, in pixels
+     */
+    QSizeF naturalSize() const { return size; }
+
+    /*
+     * @return how many lines the text was broken into
+     */
+    int lineCount() const { return lines; }
+
+    /*
+     * @return how many glyphs there are to draw, all told. Handy for guessing how much memory a block holds on to.
+     */
+    int glyphCount() const;
+
+    /*
+     * Draws the text
+     *
+     * @param painter - what to draw with. Its pen is changed.
+     * @param position - where the top left of the text goes
+     * @param boxWidth - width of the space the text sits in. Right-to-left text lines up with its right-hand side.
+     */
+    void draw(QPainter *painter, const QPointF &position, qreal boxWidth) const;
+
+private:
+    // some glyphs from one line, all in one colour
+    struct Run
+    {
+        QGlyphRun glyphs;
+        QColor colour;
+        // the natural width of the line the glyphs are on, for lining up right-to-left text
+        qreal lineWidth;
+    };
+
+    QVector<Run> runs;
+    QSizeF size;
+    int lines = 0;
+    bool rightToLeft = false;
+};
+
+
+#endif //TEXTBLOCK_H
@@ -0,0 +1,901 @@
+// SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+// Draws every payload in a corpus (bench/corpus.jsonl by default) over and over, one at a time on one thread, and
+// reports how long each stage took (the same stages --trace reports, see RenderTrace). p50 and p99, per payload and overall,
+// as a table or (with --json) as something you can diff between runs.
+//
+// With --scaler it times Downscale's kernels against Qt's smooth scaler instead, on the sizes stickers get shrunk
+// from and to, and checks their pixels: every kernel has to match the scalar one exactly (exit code 1 if not), and
+// how far they are from Qt's is reported.
+//
+// With --entities it times a message at telegram's 4096 character limit with thousands of entities on it, overlapping
+// and in no order: normalising them, and drawing the whole sticker. The runs are checked against the styles worked
+// out one character at a time (exit code 1 if they differ).
+//
+// With --avatars it fetches avatars from a stand-in HTTP server on localhost: a download, a revalidation the server
+// says hasn't changed, a copy that's still fresh, one that takes too long, and a sticker with a URL avatar. Each is
+// checked (exit code 1 if any is wrong) and timed.
+//
+// With --bubbles it paints bubbles of a few sizes, scales and colours both ways: with BubbleSprites, and by filling
+// and stroking the path it stands in for. The pixels have to match closely (exit code 1 if not), and both are timed.
+//
+// Usage: sticker_bench [--corpus <file.jsonl>] [--iterations <n>] [--warmup <n>] [--json]
+//                      [--scaler | --entities | --avatars | --bubbles]
+
+#include <QBuffer>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGuiApplication>
+#include <QImage>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPainter>
+#include <QRadialGradient>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "AvatarFetcher.h"
+#include "BubbleSprites.h"
+#include "Downscale.h"
+#include "Encoder.h"
+#include "ImagePool.h"
+#include "PayloadParser.h"
+#include "RenderTrace.h"
+#include "StickerGenerator.h"
+#include "StickerRequest.h"
+
+namespace
+{
+// in the order a sticker goes through them. Each one's time leaves out the stages inside it (fonts is part of layout,
+// avatarLoad and avatarMask are part of avatar), so they add up to "total", give or take the glue in between
+const char *const stageNames[] = {"parse", "fonts", "fit", "layout", "avatar", "avatarLoad", "avatarMask",
+                                  "initials", "paint", "encode", "total"};
+
+// every sample of every stage for one payload, in nanoseconds
+struct Samples
+{
+    QString name;
+    std::map<QByteArray, std::vector<qint64>> stages;
+    qint64 bytes = 0;
+};
+
+// nearest rank, so p99 of 20 samples is the slowest one rather than something made up in between
+qint64 percentile(std::vector<qint64> values, const double p)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    const auto rank = static_cast<size_t>(std::ceil(p / 100.0 * static_cast<double>(values.size())));
+    return values[rank ? rank - 1 : 0];
+}
+
+// draws one payload, start to finish, and says where the time went
+bool drawOnce(const QByteArray &line, Samples &samples, const bool record)
+{
+    RenderTrace::begin();
+
+    RenderTrace::Stage parseStage("parse");
+    StickerRequest request;
+    if (PayloadParser::parse(line, request)) {
+        RenderTrace::end();
+        return false;
+    }
+    parseStage.finish();
+
+    // straight through, not via RenderCache, which would make every iteration after the first a lookup
+    const auto image = request.render();
+
+    const auto encoded = Encoder::encode(image, request.encoder);
+
+    const auto trace = RenderTrace::end();
+    if (record) {
+        for (const auto *stage : stageNames) {
+            samples.stages[stage].push_back(std::strcmp(stage, "total") == 0 ? trace.totalNs() : trace.stageNs(stage));
+        }
+        samples.bytes = encoded.size();
+    }
+    return true;
+}
+
+QJsonObject stagesJson(const std::map<QByteArray, std::vector<qint64>> &stages)
+{
+    QJsonObject json;
+    for (const auto *stage : stageNames) {
+        const auto found = stages.find(stage);
+        if (found == stages.end()) {
+            continue;
+        }
+        QJsonObject times;
+        times["p50Us"] = percentile(found->second, 50) / 1000.0;
+        times["p99Us"] = percentile(found->second, 99) / 1000.0;
+        json[stage] = times;
+    }
+    return json;
+}
+
+// something like what gets shrunk: soft gradients, hard antialiased edges and a transparent outside
+QImage scalerPicture(const QSize &size)
+{
+    QImage picture(size, QImage::Format_ARGB32_Premultiplied);
+    picture.fill(Qt::transparent);
+    QPainter painter(&picture);
+    painter.setRenderHint(QPainter::Antialiasing);
+    QRadialGradient gradient(size.width() / 3.0, size.height() / 3.0, size.width());
+    gradient.setColorAt(0, QColor(0x24, 0x34, 0x47));
+    gradient.setColorAt(1, QColor(0xff, 0x88, 0x22, 0x80));
+    painter.setPen(Qt::NoPen);
+    painter.setBrush(gradient);
+    painter.drawRoundedRect(QRectF(QPointF(0, 0), size).adjusted(4, 4, -4, -4), size.height() / 6.0, size.height() / 6.0);
+    painter.setPen(QPen(Qt::white, 3));
+    for (auto x = 0; x < size.width(); x += 17) {
+        painter.drawLine(x, 0, size.width() - x, size.height());
+    }
+    painter.end();
+    return picture;
+}
+
+// the biggest and average difference between two pictures' channels
+std::pair<int, double> pictureDifference(const QImage &a, const QImage &b)
+{
+    auto biggest = 0;
+    qint64 total = 0;
+    qint64 channels = 0;
+    for (auto y = 0; y < a.height(); ++y) {
+        const auto *rowA = a.constScanLine(y);
+        const auto *rowB = b.constScanLine(y);
+        for (auto x = 0; x < a.width() * 4; ++x) {
+            const auto difference = std::abs(rowA[x] - rowB[x]);
+            biggest = qMax(biggest, difference);
+            total += difference;
+            ++channels;
+        }
+    }
+    return {biggest, channels ? static_cast<double>(total) / channels : 0.0};
+}
+
+int benchScaler(const int iterations, const bool json)
+{
+    struct Case
+    {
+        const char *name;
+        QSize from;
+        QSize to;
+    };
+    // supersampled layers (2x and 3x), a photo avatar, supersampled initials
+    const Case cases[] = {{"layer 2x", {1024, 600}, {512, 300}},
+                          {"layer 3x", {1536, 900}, {512, 300}},
+                          {"avatar photo", {640, 640}, {100, 100}},
+                          {"initials 3x", {300, 300}, {100, 100}}};
+    std::vector<Downscale::Kernel> kernels{Downscale::Kernel::Scalar};
+    if (Downscale::best() != Downscale::Kernel::Scalar) {
+        kernels.push_back(Downscale::Kernel::Sse2);
+    }
+    if (Downscale::best() == Downscale::Kernel::Avx2) {
+        kernels.push_back(Downscale::Kernel::Avx2);
+    }
+
+    auto matches = true;
+    QJsonArray caseList;
+    if (!json) {
+        std::printf("Qt %s, %d iterations, microseconds (p50), and each kernel's difference from Qt's pixels\n\n",
+                    qVersion(), iterations);
+        std::printf("%-16s %10s %10s", "", "from", "to");
+        std::printf(" %10s", "qt");
+        for (const auto kernel : kernels) {
+            std::printf(" %10s %8s %8s", Downscale::name(kernel), "maxDiff", "meanDiff");
+        }
+        std::printf("\n");
+    }
+    for (const auto &test : cases) {
+        const auto picture = scalerPicture(test.from);
+        QElapsedTimer timer;
+
+        std::vector<qint64> times;
+        QImage qt;
+        for (auto n = 0; n < iterations; ++n) {
+            timer.start();
+            qt = picture.scaled(test.to, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            times.push_back(timer.nsecsElapsed());
+        }
+        qt = qt.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+        const auto qtUs = percentile(times, 50) / 1000.0;
+
+        QJsonObject entry;
+        entry["name"] = test.name;
+        entry["qtUs"] = qtUs;
+        if (!json) {
+            std::printf("%-16s %4dx%-5d %4dx%-5d %10.1f", test.name, test.from.width(), test.from.height(),
+                        test.to.width(), test.to.height(), qtUs);
+        }
+        QImage scalar;
+        for (const auto kernel : kernels) {
+            times.clear();
+            QImage shrunk;
+            for (auto n = 0; n < iterations; ++n) {
+                timer.start();
+                shrunk = Downscale::area(picture, test.to, kernel);
+                times.push_back(timer.nsecsElapsed());
+            }
+            if (kernel == Downscale::Kernel::Scalar) {
+                scalar = shrunk;
+            } else if (pictureDifference(shrunk, scalar).first != 0) {
+                std::fprintf(stderr, "%s: %s doesn't match scalar\n", test.name, Downscale::name(kernel));
+                matches = false;
+            }
+            const auto [maxDiff, meanDiff] = pictureDifference(shrunk, qt);
+            const auto us = percentile(times, 50) / 1000.0;
+            QJsonObject result;
+            result["us"] = us;
+            result["maxDiffFromQt"] = maxDiff;
+            result["meanDiffFromQt"] = meanDiff;
+            entry[Downscale::name(kernel)] = result;
+            if (!json) {
+                std::printf(" %10.1f %8d %8.3f", us, maxDiff, meanDiff);
+            }
+        }
+        if (!json) {
+            std::printf("\n");
+        }
+        caseList.append(entry);
+    }
+
+    if (json) {
+        QJsonObject report;
+        report["qt"] = QString::fromLatin1(qVersion());
+        report["iterations"] = iterations;
+        report["best"] = Downscale::name(Downscale::best());
+        report["kernelsMatch"] = matches;
+        report["cases"] = caseList;
+        std::printf("%s\n", QJsonDocument(report).toJson(QJsonDocument::Indented).constData());
+    }
+    return matches ? 0 : 1;
+}
+
+// like pictureDifference, but each of `a`'s pixels is compared with the closest of the reference's pixels within one
+// pixel of it (by its biggest channel difference), so edges a fraction of a pixel apart don't count
+std::pair<int, double> nearDifference(const QImage &a, const QImage &reference)
+{
+    auto biggest = 0;
+    qint64 total = 0;
+    qint64 pixels = 0;
+    for (auto y = 0; y < a.height(); ++y) {
+        const auto *row = reinterpret_cast<const QRgb *>(a.constScanLine(y));
+        for (auto x = 0; x < a.width(); ++x) {
+            auto closest = 255;
+            for (auto ny = qMax(y - 1, 0); ny <= qMin(y + 1, reference.height() - 1); ++ny) {
+                const auto *near = reinterpret_cast<const QRgb *>(reference.constScanLine(ny));
+                for (auto nx = qMax(x - 1, 0); nx <= qMin(x + 1, reference.width() - 1); ++nx) {
+                    const auto p = row[x];
+                    const auto q = near[nx];
+                    const auto difference = qMax(qMax(std::abs(qAlpha(p) - qAlpha(q)), std::abs(qRed(p) - qRed(q))),
+                                                 qMax(std::abs(qGreen(p) - qGreen(q)), std::abs(qBlue(p) - qBlue(q))));
+                    closest = qMin(closest, difference);
+                }
+            }
+            biggest = qMax(biggest, closest);
+            total += closest;
+            ++pixels;
+        }
+    }
+    return {biggest, pixels ? static_cast<double>(total) / pixels : 0.0};
+}
+
+int benchBubbles(const int iterations, const bool json)
+{
+    // BubbleSprites has to look like the path it stands in for: a pixel at most out anywhere once a pixel's slack is
+    // allowed for (the rect is snapped to whole pixels), and on average next to nothing, since only the edges differ
+    constexpr auto maxNearDiff = 16;
+    constexpr auto maxMeanDiff = 1.0;
+
+    struct Case
+    {
+        const char *name;
+        QSizeF size;
+        qreal radius;
+    };
+    // in layout pixels, painted at each scale. Off whole pixels on purpose, like StickerGenerator's bubbles often are
+    const Case cases[] = {{"tiny", {40, 28}, 8},
+                          {"short", {220, 80}, 12},
+                          {"wide", {512, 160}, 30},
+                          {"long", {480, 900}, 12}};
+    const int scales[] = {1, 2, 3};
+    // telegram's dark and light bubbles, a bright one, and white (whose lighter end is the same white)
+    const QRgb colours[] = {qRgb(0x2b, 0x52, 0x78), qRgb(0xef, 0xfd, 0xde), qRgb(0xd0, 0x30, 0x60),
+                            qRgb(0xff, 0xff, 0xff)};
+    // stickers are transparent around the bubbles, but a bubble can land on something already painted
+    const QRgb backgrounds[] = {0, qRgb(0x24, 0x34, 0x47)};
+    const QPointF origin(3.3, 5.6);
+
+    const auto canvasFor = [](const QSizeF &size, const int scale, const QRgb background) {
+        QImage canvas(((size + QSizeF(8, 8)) * scale).toSize(), QImage::Format_ARGB32_Premultiplied);
+        canvas.fill(background);
+        return canvas;
+    };
+
+    auto matches = true;
+    QJsonArray caseList;
+    if (!json) {
+        std::printf("Qt %s, %d iterations, microseconds (p50), and the sprites' difference from the path's pixels\n"
+                    "(nearDiff allows a pixel's slack; it has to stay within %d, and meanDiff within %.1f)\n\n",
+                    qVersion(), iterations, maxNearDiff, maxMeanDiff);
+        std::printf("%-8s %5s %10s %10s %10s %10s %8s %8s %8s\n", "", "scale", "perimeter", "area", "path", "sprites",
+                    "maxDiff", "nearDiff", "meanDiff");
+    }
+    for (const auto &test : cases) {
+        for (const auto scale : scales) {
+            const QRectF rect(origin, test.size);
+            auto maxDiff = 0;
+            auto nearDiff = 0;
+            auto meanDiff = 0.0;
+            for (const auto colour : colours) {
+                for (const auto background : backgrounds) {
+                    auto path = canvasFor(test.size, scale, background);
+                    auto sprites = path;
+                    {
+                        QPainter painter(&path);
+                        painter.scale(scale, scale);
+                        BubbleSprites::paintPath(&painter, colour, rect, test.radius);
+                    }
+                    {
+                        QPainter painter(&sprites);
+                        painter.scale(scale, scale);
+                        if (!BubbleSprites::paint(&painter, colour, rect, test.radius)) {
+                            std::fprintf(stderr, "%s: BubbleSprites wouldn't paint it\n", test.name);
+                            matches = false;
+                        }
+                    }
+                    const auto [biggest, mean] = pictureDifference(sprites, path);
+                    maxDiff = qMax(maxDiff, biggest);
+                    meanDiff = qMax(meanDiff, mean);
+                    nearDiff = qMax(nearDiff, nearDifference(sprites, path).first);
+                }
+            }
+            if (nearDiff > maxNearDiff || meanDiff > maxMeanDiff) {
+                std::fprintf(stderr, "%s at %dx: the sprites are too far from the path\n", test.name, scale);
+                matches = false;
+            }
+
+            // only the painting's timed, on one canvas painted over and over: the sprites' caches stay warm, like
+            // they do in a long-running process
+            std::vector<qint64> pathTimes;
+            std::vector<qint64> spriteTimes;
+            auto canvas = canvasFor(test.size, scale, 0);
+            QPainter painter(&canvas);
+            painter.scale(scale, scale);
+            BubbleSprites::paint(&painter, colours[0], rect, test.radius);
+            QElapsedTimer timer;
+            for (auto n = 0; n < iterations; ++n) {
+                timer.start();
+                BubbleSprites::paintPath(&painter, colours[0], rect, test.radius);
+                pathTimes.push_back(timer.nsecsElapsed());
+                timer.start();
+                BubbleSprites::paint(&painter, colours[0], rect, test.radius);
+                spriteTimes.push_back(timer.nsecsElapsed());
+            }
+            painter.end();
+            const auto pathUs = percentile(pathTimes, 50) / 1000.0;
+            const auto spritesUs = percentile(spriteTimes, 50) / 1000.0;
+            // in device pixels: what the sprites' cost should go with, and what the path's does
+            const auto perimeter = static_cast<int>(2 * (test.size.width() + test.size.height()) * scale);
+            const auto area = static_cast<qint64>(test.size.width() * test.size.height() * scale * scale);
+
+            QJsonObject entry;
+            entry["name"] = test.name;
+            entry["scale"] = scale;
+            entry["perimeter"] = perimeter;
+            entry["area"] = area;
+            entry["pathUs"] = pathUs;
+            entry["spritesUs"] = spritesUs;
+            entry["maxDiff"] = maxDiff;
+            entry["nearDiff"] = nearDiff;
+            entry["meanDiff"] = meanDiff;
+            caseList.append(entry);
+            if (!json) {
+                std::printf("%-8s %5d %10d %10lld %10.1f %10.1f %8d %8d %8.3f\n", test.name, scale, perimeter,
+                            static_cast<long long>(area), pathUs, spritesUs, maxDiff, nearDiff, meanDiff);
+            }
+        }
+    }
+
+    if (json) {
+        QJsonObject report;
+        report["qt"] = QString::fromLatin1(qVersion());
+        report["iterations"] = iterations;
+        report["maxNearDiff"] = maxNearDiff;
+        report["maxMeanDiff"] = maxMeanDiff;
+        report["spritesMatch"] = matches;
+        report["cases"] = caseList;
+        std::printf("%s\n", QJsonDocument(report).toJson(QJsonDocument::Indented).constData());
+    }
+    return matches ? 0 : 1;
+}
+
+int benchEntities(const int iterations, const bool json)
+{
+    constexpr auto textLength = 4096;
+    const int entityCounts[] = {100, 1000, 4000};
+    const Styles styles[] = {bold, italic, underline, strikethrough, code, text_link, mention, url, phonenumber};
+
+    // the same every run, so runs can be compared
+    std::mt19937 random(4096);
+    QString text;
+    while (text.length() < textLength) {
+        text += QStringLiteral("entity ");
+        text += QString::number(random() % 100000);
+        text += random() % 8 ? QLatin1Char(' ') : QLatin1Char('\n');
+    }
+    text.truncate(textLength);
+
+    auto correct = true;
+    QJsonArray caseList;
+    if (!json) {
+        std::printf("Qt %s, %d iterations, a %d character message, microseconds (p50)\n\n", qVersion(), iterations,
+                    textLength);
+        std::printf("%10s %10s %12s %12s\n", "entities", "runs", "normalise", "sticker");
+    }
+    for (const auto count : entityCounts) {
+        QList<Entity> entities;
+        for (auto i = 0; i < count; ++i) {
+            // mostly short, some long, a few running off the end
+            const auto length = random() % 10 ? 1 + random() % 40 : 1 + random() % 1000;
+            entities.push_back({styles[random() % std::size(styles)],
+                                static_cast<int>(random() % (textLength + 100)) - 50,
+                                static_cast<qsizetype>(length)});
+        }
+
+        const auto runs = normaliseEntities(entities, textLength);
+        // the slow, obvious way: every character, every entity
+        std::vector<quint32> expected(textLength, 0);
+        for (const auto &entity : entities) {
+            for (auto c = qMax(entity.offset, 0); c < qMin<qint64>(entity.offset + entity.length, textLength); ++c) {
+                expected[c] |= 1u << entity.type;
+            }
+        }
+        std::vector<quint32> got(textLength, 0);
+        auto previousEnd = -1;
+        for (const auto &run : runs) {
+            if (run.start < previousEnd || run.length <= 0 || !run.styles) {
+                correct = false;
+            }
+            previousEnd = run.start + run.length;
+            for (auto c = run.start; c < run.start + run.length && c < textLength; ++c) {
+                got[c] = run.styles;
+            }
+        }
+        if (got != expected) {
+            std::fprintf(stderr, "%d entities: the runs don't match the entities\n", count);
+            correct = false;
+        }
+
+        QElapsedTimer timer;
+        std::vector<qint64> normaliseTimes;
+        std::vector<qint64> stickerTimes;
+        for (auto n = 0; n < iterations; ++n) {
+            timer.start();
+            const auto again = normaliseEntities(entities, textLength);
+            normaliseTimes.push_back(timer.nsecsElapsed());
+
+            StickerRequest request;
+            request.backgroundColour = 0xff243447;
+            request.width = 512;
+            request.scale = 2;
+            ChatUser user;
+            user.id = 1;
+            user.name = QStringLiteral("Entity Stress");
+            request.messages.push_back(ChatMessage(entities, user, text));
+            timer.start();
+            request.render();
+            stickerTimes.push_back(timer.nsecsElapsed());
+        }
+        const auto normaliseUs = percentile(normaliseTimes, 50) / 1000.0;
+        const auto stickerUs = percentile(stickerTimes, 50) / 1000.0;
+
+        QJsonObject entry;
+        entry["entities"] = count;
+        entry["runs"] = static_cast<int>(runs.size());
+        entry["normaliseUs"] = normaliseUs;
+        entry["stickerUs"] = stickerUs;
+        caseList.append(entry);
+        if (!json) {
+            std::printf("%10d %10d %12.1f %12.1f\n", count, static_cast<int>(runs.size()), normaliseUs, stickerUs);
+        }
+    }
+
+    if (json) {
+        QJsonObject report;
+        report["qt"] = QString::fromLatin1(qVersion());
+        report["iterations"] = iterations;
+        report["textLength"] = textLength;
+        report["runsMatch"] = correct;
+        report["cases"] = caseList;
+        std::printf("%s\n", QJsonDocument(report).toJson(QJsonDocument::Indented).constData());
+    }
+    return correct ? 0 : 1;
+}
+
+// a stand-in for wherever avatars are hosted: HTTP on localhost, a thread per connection, one picture.
+// /avatar.png has to be revalidated every time, /fresh.png is good for an hour and /slow.png takes 2 seconds
+class StandInServer
+{
+public:
+    explicit StandInServer(QByteArray picture) : picture(std::move(picture)) {}
+
+    ~StandInServer() { stop(); }
+
+    bool start()
+    {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof address;
+        if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), length) < 0
+            || listen(listener, 16) < 0 || getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length) < 0) {
+            return false;
+        }
+        port = ntohs(address.sin_port);
+        acceptor = std::thread([this] {
+            for (;;) {
+                const auto connection = accept(listener, nullptr, nullptr);
+                if (connection < 0) {
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                connections.emplace_back([this, connection] { serve(connection); });
+            }
+        });
+        return true;
+    }
+
+    void stop()
+    {
+        if (listener < 0) {
+            return;
+        }
+        shutdown(listener, SHUT_RDWR);
+        close(listener);
+        listener = -1;
+        acceptor.join();
+        for (auto &connection : connections) {
+            connection.join();
+        }
+    }
+
+    QString url(const char *path) const
+    {
+        return QStringLiteral("http://127.0.0.1:%1%2").arg(port).arg(QLatin1String(path));
+    }
+
+    // how many times the picture was sent, and how many times we said it hadn't changed
+    std::atomic<int> sent{0};
+    std::atomic<int> notModified{0};
+
+private:
+    void serve(const int connection)
+    {
+        QByteArray request;
+        char chunk[4096];
+        while (!request.contains("\r\n\r\n")) {
+            const auto got = read(connection, chunk, sizeof chunk);
+            if (got <= 0) {
+                break;
+            }
+            request.append(chunk, static_cast<int>(got));
+        }
+        const auto path = request.split(' ').value(1);
+        if (path == "/slow.png") {
+            std::this_thread::sleep_for(std::chrono::seconds(2));
+        }
+        const QByteArray caching = path == "/fresh.png" ? "max-age=3600" : "max-age=0";
+
+        QByteArray response;
+        if (request.contains("If-None-Match: \"v1\"")) {
+            ++notModified;
+            response = "HTTP/1.1 304 Not Modified\r\nETag: \"v1\"\r\nCache-Control: " + caching
+                + "\r\nConnection: close\r\n\r\n";
+        } else {
+            ++sent;
+            response = "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nContent-Length: "
+                + QByteArray::number(picture.size()) + "\r\nETag: \"v1\"\r\nCache-Control: " + caching
+                + "\r\nConnection: close\r\n\r\n" + picture;
+        }
+        for (qsizetype done = 0; done < response.size();) {
+            const auto wrote = write(connection, response.constData() + done,
+                                     static_cast<size_t>(response.size() - done));
+            if (wrote <= 0) {
+                break;
+            }
+            done += wrote;
+        }
+        close(connection);
+    }
+
+    QByteArray picture;
+    int listener = -1;
+    int port = 0;
+    std::thread acceptor;
+    std::mutex mutex;
+    std::vector<std::thread> connections;
+};
+
+int benchAvatars(const bool json)
+{
+    if (!AvatarFetcher::available()) {
+        std::printf("Built without QtNetwork, so there's nothing to fetch avatars with\n");
+        return 0;
+    }
+
+    // something that looks like an avatar, as a PNG like a server would send
+    QImage face(256, 256, QImage::Format_ARGB32_Premultiplied);
+    QPainter painter(&face);
+    QRadialGradient gradient(128, 128, 128);
+    gradient.setColorAt(0, QColor(0xf0, 0xc0, 0x90));
+    gradient.setColorAt(1, QColor(0x30, 0x50, 0x90));
+    painter.fillRect(face.rect(), gradient);
+    painter.end();
+    QByteArray picture;
+    QBuffer buffer(&picture);
+    buffer.open(QIODevice::WriteOnly);
+    face.save(&buffer, "PNG");
+
+    StandInServer server(picture);
+    if (!server.start()) {
+        std::fprintf(stderr, "Couldn't start the stand-in server\n");
+        return 1;
+    }
+    QTemporaryDir cacheDir;
+    AvatarFetcher::setDirectory(cacheDir.path(), 8);
+    AvatarFetcher::setTimeout(300);
+
+    auto correct = true;
+    QJsonArray caseList;
+    if (!json) {
+        std::printf("Qt %s, avatars from %s, microseconds\n\n", qVersion(), server.url("").toLocal8Bit().constData());
+        std::printf("%-12s %10s %6s %6s %4s\n", "", "us", "sent", "304s", "ok");
+    }
+    QElapsedTimer timer;
+    const auto step = [&](const char *name, const std::function<bool()> &run) {
+        timer.start();
+        const auto ok = run();
+        const auto us = timer.nsecsElapsed() / 1000.0;
+        if (!ok) {
+            std::fprintf(stderr, "%s: not what it should be\n", name);
+            correct = false;
+        }
+        QJsonObject entry;
+        entry["name"] = QLatin1String(name);
+        entry["us"] = us;
+        entry["sent"] = server.sent.load();
+        entry["notModified"] = server.notModified.load();
+        entry["ok"] = ok;
+        caseList.append(entry);
+        if (!json) {
+            std::printf("%-12s %10.1f %6d %6d %4s\n", name, us, server.sent.load(), server.notModified.load(),
+                        ok ? "yes" : "NO");
+        }
+    };
+
+    const auto avatar = server.url("/avatar.png");
+    step("download", [&] { return AvatarFetcher::get(avatar).bytes == picture && server.sent == 1; });
+    step("revalidate", [&] {
+        return AvatarFetcher::get(avatar).bytes == picture && server.sent == 1 && server.notModified == 1;
+    });
+    const auto fresh = server.url("/fresh.png");
+    step("fresh", [&] {
+        return AvatarFetcher::get(fresh).bytes == picture && AvatarFetcher::get(fresh).bytes == picture
+            && server.sent == 2;
+    });
+    step("sticker", [&] {
+        StickerRequest request;
+        request.backgroundColour = 0xff243447;
+        request.width = 512;
+        request.scale = 2;
+        ChatUser user;
+        user.id = 1;
+        user.name = QStringLiteral("Avatar Url");
+        user.avatar = fresh;
+        request.messages.push_back(
+            ChatMessage(QList<Entity>(), user, QStringLiteral("drawn with an avatar from a URL")));
+        return !request.render().isNull() && server.sent == 2;
+    });
+    // 300ms to wait, and the server takes 2s, so it's the initials
+    step("timeout", [&] {
+        return AvatarFetcher::get(server.url("/slow.png")).bytes.isEmpty() && timer.elapsed() < 1000;
+    });
+    // the slow one turns up eventually too, but probably not yet
+    step("disk", [&] { return QDir(cacheDir.path()).entryList(QDir::Files).size() >= 2; });
+
+    if (json) {
+        QJsonObject report;
+        report["qt"] = QString::fromLatin1(qVersion());
+        report["allOk"] = correct;
+        report["cases"] = caseList;
+        std::printf("%s\n", QJsonDocument(report).toJson(QJsonDocument::Indented).constData());
+    }
+    return correct ? 0 : 1;
+}
+
+void printRow(const QString &name, const std::map<QByteArray, std::vector<qint64>> &stages, const qint64 bytes)
+{
+    std::printf("%-24s", name.left(24).toLocal8Bit().constData());
+    for (const auto *stage : stageNames) {
+        const auto found = stages.find(stage);
+        const auto &values = found == stages.end() ? std::vector<qint64>() : found->second;
+        std::printf(" %8.2f %8.2f", percentile(values, 50) / 1e6, percentile(values, 99) / 1e6);
+    }
+    std::printf(" %8lld\n", static_cast<long long>(bytes));
+}
+}
+
+int main(int argc, char **argv)
+{
+    auto corpusPath = QString::fromLocal8Bit(STICKER_BENCH_CORPUS);
+    auto iterations = 20;
+    auto warmup = 2;
+    auto json = false;
+    auto scaler = false;
+    auto entities = false;
+    auto avatars = false;
+    auto bubbles = false;
+    for (auto i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) {
+            corpusPath = QString::fromLocal8Bit(argv[++i]);
+        } else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            iterations = qMax(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = qMax(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "--scaler") == 0) {
+            scaler = true;
+        } else if (strcmp(argv[i], "--entities") == 0) {
+            entities = true;
+        } else if (strcmp(argv[i], "--avatars") == 0) {
+            avatars = true;
+        } else if (strcmp(argv[i], "--bubbles") == 0) {
+            bubbles = true;
+        } else {
+            std::fprintf(stderr,
+                         "Usage: %s [--corpus <file.jsonl>] [--iterations <n>] [--warmup <n>] [--json]"
+                         " [--scaler | --entities | --avatars | --bubbles]\n",
+                         argv[0]);
+            return 1;
+        }
+    }
+
+    QGuiApplication app(argc, argv);
+
+    if (scaler) {
+        return benchScaler(iterations, json);
+    }
+    if (bubbles) {
+        return benchBubbles(iterations, json);
+    }
+    if (entities) {
+        StickerGenerator::prepareFonts();
+        return benchEntities(iterations, json);
+    }
+    if (avatars) {
+        StickerGenerator::prepareFonts();
+        return benchAvatars(json);
+    }
+
+    QFile corpus(corpusPath);
+    if (!corpus.open(QIODevice::ReadOnly)) {
+        std::fprintf(stderr, "Couldn't open corpus %s\n", corpusPath.toLocal8Bit().constData());
+        return 1;
+    }
+    std::vector<QByteArray> lines;
+    std::vector<Samples> cases;
+    for (;;) {
+        const auto line = corpus.readLine();
+        if (line.isEmpty()) {
+            break;
+        }
+        if (line.trimmed().isEmpty()) {
+            continue;
+        }
+        Samples samples;
+        samples.name = QJsonDocument::fromJson(line).object()["bench"].toString();
+        if (samples.name.isEmpty()) {
+            samples.name = QStringLiteral("line %1").arg(lines.size() + 1);
+        }
+        lines.push_back(line);
+        cases.push_back(samples);
+    }
+
+    // fonts and plugins load on first use, and that's not what we're here to measure
+    StickerGenerator::prepareFonts();
+
+    QElapsedTimer wall;
+    auto drawn = 0;
+    qint64 measuredNs = 0;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        for (auto w = 0; w < warmup; ++w) {
+            drawOnce(lines[i], cases[i], false);
+        }
+        wall.start();
+        for (auto n = 0; n < iterations; ++n) {
+            if (!drawOnce(lines[i], cases[i], true)) {
+                std::fprintf(stderr, "%s isn't a sticker payload\n", cases[i].name.toLocal8Bit().constData());
+                return 1;
+            }
+            ++drawn;
+        }
+        measuredNs += wall.nsecsElapsed();
+    }
+
+    std::map<QByteArray, std::vector<qint64>> overall;
+    for (const auto &samples : cases) {
+        for (const auto &[stage, values] : samples.stages) {
+            auto &all = overall[stage];
+            all.insert(all.end(), values.begin(), values.end());
+        }
+    }
+    const auto perSecond = measuredNs ? drawn * 1e9 / static_cast<double>(measuredNs) : 0.0;
+    // after the warmup, every picture buffer should be one the pool already had
+    const auto pool = ImagePool::stats();
+
+    if (json) {
+        QJsonArray caseList;
+        for (const auto &samples : cases) {
+            QJsonObject entry;
+            entry["name"] = samples.name;
+            entry["bytes"] = samples.bytes;
+            entry["stages"] = stagesJson(samples.stages);
+            caseList.append(entry);
+        }
+        QJsonObject report;
+        report["qt"] = QString::fromLatin1(qVersion());
+        report["iterations"] = iterations;
+        report["warmup"] = warmup;
+        report["stickersPerSecond"] = perSecond;
+        report["buffersReused"] = static_cast<qint64>(pool.hits);
+        report["buffersAllocated"] = static_cast<qint64>(pool.misses);
+        report["overall"] = stagesJson(overall);
+        report["cases"] = caseList;
+        std::printf("%s\n", QJsonDocument(report).toJson(QJsonDocument::Indented).constData());
+        return 0;
+    }
+
+    std::printf("Qt %s, %d iterations (after %d warmup) of %zu payloads, milliseconds\n\n",
+                qVersion(), iterations, warmup, lines.size());
+    std::printf("%-24s", "");
+    for (const auto *stage : stageNames) {
+        std::printf(" %17s", stage);
+    }
+    std::printf(" %8s\n%-24s", "", "payload");
+    for (size_t i = 0; i < std::size(stageNames); ++i) {
+        std::printf(" %8s %8s", "p50", "p99");
+    }
+    std::printf(" %8s\n", "bytes");
+    for (const auto &samples : cases) {
+        printRow(samples.name, samples.stages, samples.bytes);
+    }
+    printRow(QStringLiteral("overall"), overall, 0);
+    std::printf("\n%.1f stickers/s on one thread\n", perSecond);
+    std::printf("%llu picture buffers reused, %llu allocated\n", static_cast<unsigned long long>(pool.hits),
+                static_cast<unsigned long long>(pool.misses));
+    return 0;
+}
@@ -1,16 +1,28 @@
 // SPDX-FileCopyrightText: © 2021 Chris and Flauntbot Contributors <flauntbot@chris-nz.com>
 // SPDX-License-Identifier: LGPL-2.1-or-later
 #include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
 
-#include <QPixmap>
+#include <QFile>
 #include <QGuiApplication>
 #include <QImage>
-#include <QPainter>
-#include <QWindow>
 #include <QJsonDocument>
 #include <QJsonObject>
-#include <QJsonArray>
-#include "StickerGenerator.h"
+#include "AvatarFetcher.h"
+#include "Encoder.h"
+#include "FontSnapshot.h"
+#include "ImagePool.h"
+#include "PayloadParser.h"
+#include "PreforkServer.h"
+#include "RenderCache.h"
+#include "RenderPool.h"
+#include "RenderTrace.h"
+#include "StickerBatch.h"
+#include "StickerRequest.h"
+#include "StickerServer.h"
 
 // this program is a simple example of generating an image (perhaps a telegram sticker) from some arbitrary JSON.
 // the arbitrary JSON has a striking resemblance to message update json in tg bot api, but
@@ -25,79 +37,195 @@ int main(int argc, char **argv)
 
     // if we have no output file, exit immediately with a message
     if (!argv[1] || strcmp(argv[1],"") == 0) {
-        std::printf("Usage:\n<cat_or_echo_some_json> | %s <output_image_filename>\nExample JSON:\n%s\n", argv[0], defaultVal.toStdString().c_str());
+        std::printf("Usage:\n<cat_or_echo_some_json> | %s <output_image_filename | - | fd:N>\n"
+                    "%s --daemon [--threads <n>]                 (newline-delimited JSON requests on stdin, responses on stdout)\n"
+                    "%s --socket <socket_path> [--threads <n>]   (the same, but over a unix domain socket)\n"
+                    "%s --socket <socket_path> --prefork <n> [--threads <n>] [--worker-max-mb <n>]\n"
+                    "                                            (the same, in n worker processes that get replaced if they crash)\n"
+                    "%s --batch <file.jsonl> [--threads <n>]     (one payload per line, each with an \"output\" path; - for stdin)\n"
+                    "Encoder options, for any of the above (payloads can override them):\n"
+                    "  --format <webp|png|rgba>  --quality <0-100>  --lossless  --method <0-6>  --compression <0-9>\n"
+                    "Render cache (shared between processes), for any of the above:\n"
+                    "  --cache-dir <dir>  --cache-max-mb <n> (default 512)\n"
+                    "Avatar URLs (fetched, and cached on disk if you like), for any of the above:\n"
+                    "  --avatar-cache-dir <dir>  --avatar-cache-max-mb <n> (default 64)\n"
+                    "  --avatar-timeout-ms <n> (default 1500)\n"
+                    "Idle picture buffers kept for reuse, for any of the above:\n"
+                    "  --image-pool-mb <n> (default 64)\n"
+                    "Fonts (see README), for any of the above:\n"
+                    "  --font-snapshot <dir> (or $STICKER_FONT_SNAPSHOT)\n"
+                    "%s --build-font-snapshot <dir> [--strict]   (copy the fonts we use out of the system's, to load quickly)\n"
+                    "Tracing (a JSON line of stage timings and counters per sticker), for any of the above:\n"
+                    "  --trace (to stderr)  --trace-file <path> (appended to)\n"
+                    "Example JSON:\n%s\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], defaultVal.toStdString().c_str());
         return 1;
     }
 
-    // Qt docs say it MUST run, but that just does setup we don't need and starts an event loop we also don't need
-    QGuiApplication app(argc, argv);
+    // the long-running modes take a few options. Anything else is the output file name, like it always was.
+    auto daemon = false;
+    QString socketPath;
+    QString batchPath;
+    auto threads = 0;
+    auto prefork = -1;
+    auto workerMaxMiB = 0;
+    const char *outputFile = nullptr;
+    QString cacheDir;
+    auto cacheMaxMiB = 512;
+    QString avatarCacheDir;
+    auto avatarCacheMaxMiB = 64;
+    auto fontSnapshot = qEnvironmentVariable("STICKER_FONT_SNAPSHOT");
+    QString buildFontSnapshot;
+    auto strictFontSnapshot = false;
+    for (auto i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--daemon") == 0) {
+            daemon = true;
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socketPath = QString::fromLocal8Bit(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchPath = QString::fromLocal8Bit(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--prefork") == 0 && i + 1 < argc) {
+            prefork = qMax(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--worker-max-mb") == 0 && i + 1 < argc) {
+            workerMaxMiB = qMax(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            Encoder::defaults().format = QByteArray(argv[++i]).toLower();
+        } else if (strcmp(argv[i], "--quality") == 0 && i + 1 < argc) {
+            Encoder::defaults().quality = qBound(-1, atoi(argv[++i]), 100);
+        } else if (strcmp(argv[i], "--lossless") == 0) {
+            Encoder::defaults().lossless = true;
+        } else if (strcmp(argv[i], "--method") == 0 && i + 1 < argc) {
+            Encoder::defaults().method = qBound(-1, atoi(argv[++i]), 6);
+        } else if (strcmp(argv[i], "--compression") == 0 && i + 1 < argc) {
+            Encoder::defaults().compression = qBound(-1, atoi(argv[++i]), 9);
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cacheDir = QString::fromLocal8Bit(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-max-mb") == 0 && i + 1 < argc) {
+            cacheMaxMiB = qMax(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--avatar-cache-dir") == 0 && i + 1 < argc) {
+            avatarCacheDir = QString::fromLocal8Bit(argv[++i]);
+        } else if (strcmp(argv[i], "--avatar-cache-max-mb") == 0 && i + 1 < argc) {
+            avatarCacheMaxMiB = qMax(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--avatar-timeout-ms") == 0 && i + 1 < argc) {
+            AvatarFetcher::setTimeout(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--image-pool-mb") == 0 && i + 1 < argc) {
+            ImagePool::setMaxKiB(qMax(0, atoi(argv[++i])) * 1024);
+        } else if (strcmp(argv[i], "--font-snapshot") == 0 && i + 1 < argc) {
+            fontSnapshot = QString::fromLocal8Bit(argv[++i]);
+        } else if (strcmp(argv[i], "--build-font-snapshot") == 0 && i + 1 < argc) {
+            buildFontSnapshot = QString::fromLocal8Bit(argv[++i]);
+        } else if (strcmp(argv[i], "--strict") == 0) {
+            strictFontSnapshot = true;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            RenderTrace::setOutput(stderr);
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            // left open until we exit, which flushes it
+            auto *traceFile = std::fopen(argv[++i], "a");
+            if (!traceFile) {
+                std::printf("Couldn't open %s for tracing\n", argv[i]);
+                return 1;
+            }
+            RenderTrace::setOutput(traceFile);
+        } else {
+            outputFile = argv[i];
+        }
+    }
 
-    // get data from stdin, unmarshall it a bit so we can feed it to the appropriate method
-    QTextStream stream(stdin);
-    const QString val = stream.readAll();
-    if (val.isEmpty()) {
-//        val = defaultVal;
-        std::printf("%s\n%s\n", "You need to pass stdin some json, with structure like this:", defaultVal.toLocal8Bit().data());
+    // the fonts have to be chosen before Qt starts up and goes looking for them
+    if (!fontSnapshot.isEmpty() && buildFontSnapshot.isEmpty() && !FontSnapshot::use(fontSnapshot)) {
+        std::printf("%s isn't a font snapshot. Make one with --build-font-snapshot\n",
+                    fontSnapshot.toLocal8Bit().constData());
         return 1;
     }
-    QJsonObject j = QJsonDocument::fromJson(val.toUtf8()).object();
-    auto m = j["message"].toObject();
-    if (m.isEmpty()) {
-        std::printf("%s\n%s\n", "You need to pass stdin in some json, with structure like this:", defaultVal.toLocal8Bit().data());
+
+    if (prefork >= 0 && socketPath.isEmpty()) {
+        std::printf("--prefork needs a --socket to share between its workers\n");
         return 1;
     }
-
-    // we expect entities that look like telegram bot api's, but we normalize a bit
-    QList<Entity> entities;
-    for (auto en: m["entities"].toArray()) {
-        auto ent = en.toObject();
-        entities
-            .push_back({.type=entityType(ent["type"].toString()), .offset=ent["offset"].toInt(), .length=ent["length"]
-                .toInt()});
+    // workers can't share a connection to a display, and don't need one, so unless we're told otherwise there isn't one
+    if (prefork >= 0 && qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
     }
 
-    auto u = m["from"].toObject();
-
-    ChatMessage
-        m2(entities, {.name=u["name"].toString(), .avatar=u["avatar"].toString(), .first_name=u["first_name"].toString(), .last_name=u["last_name"].toString(), .id=u["id"].toDouble()}, m["text"].toString());
-
-    const auto w = j["width"].toInt();
+    // Qt docs say it MUST run, but that just does setup we don't need and starts an event loop we also don't need
+    QGuiApplication app(argc, argv);
 
-    // we pass in ChatMessage m2 constructed from input json, and it includes Entities and ChatUser from the same
-    auto pic2 = StickerGenerator::generate(QColor(j["backgroundColor"].toString()).rgb(),
-                                           m2,
-                                           w,
-                                           j["scale"].toInt()).toImage();
+    // checked now there's an app, so Qt knows where its plugins are
+    if (const auto &format = Encoder::defaults().format; !format.isEmpty() && !Encoder::supports(format)) {
+        std::fprintf(stderr, "Can't encode to %s\n", format.constData());
+        return 1;
+    }
 
-    // tg says somewhere in docs that sticker input MUST be 512px along its longest edge, so
-    // scale the content and add a fixed transparent bottom padding.
-    const int target = w;
-    constexpr int bottomPadding = 70;
-    int padding = bottomPadding;
-    if (padding >= target) {
-        padding = 0;
+    if (!buildFontSnapshot.isEmpty()) {
+        return FontSnapshot::build(buildFontSnapshot, strictFontSnapshot);
     }
 
-    int scaledW = pic2.width();
-    int scaledH = pic2.height();
-    if (pic2.width() > 0 && pic2.height() > 0) {
-        const int contentMaxHeight = target - padding;
-        const double scaleW = static_cast<double>(target) / pic2.width();
-        if (const double scaleH = static_cast<double>(contentMaxHeight) / pic2.height(); scaleW <= scaleH) {
-            scaledW = target;
-            scaledH = static_cast<int>(pic2.height() * scaleW);
-        } else {
-            scaledH = contentMaxHeight;
-            scaledW = static_cast<int>(pic2.width() * scaleH);
+    // finished stickers can be kept on disk, and shared with every other sticker process pointed at the same place
+    RenderCache::setDirectory(cacheDir, cacheMaxMiB);
+    AvatarFetcher::setDirectory(avatarCacheDir, avatarCacheMaxMiB);
+
+    // long-running modes: do the expensive setup once, then take as many requests as anyone sends us
+    if (daemon || !socketPath.isEmpty()) {
+        StickerServer::warmUp();
+        if (prefork >= 0) {
+            // no threads before this: the workers fork from here, and start their own
+            return PreforkServer::serve(socketPath, prefork, threads, workerMaxMiB);
         }
+        RenderPool pool(threads);
+        return daemon ? StickerServer::serveStream(STDIN_FILENO, STDOUT_FILENO, pool)
+                      : StickerServer::serveSocket(socketPath, pool);
+    }
+    if (!batchPath.isEmpty()) {
+        RenderPool pool(threads);
+        return StickerBatch::run(batchPath, pool);
+    }
+    if (!outputFile) {
+        std::printf("%s needs an output file name\n", argv[0]);
+        return 1;
     }
 
-    const auto scaled = pic2.scaled(scaledW, scaledH, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-    QImage out(scaledW, scaledH + padding, QImage::Format_ARGB32_Premultiplied);
-    out.fill(Qt::transparent);
-    QPainter painter(&out);
-    painter.drawImage(0, 0, scaled);
-    painter.end();
+    // get data from stdin, as bytes: the parser wants UTF-8, which is what it already is
+    QFile input;
+    if (!input.open(stdin, QIODevice::ReadOnly)) {
+        return 1;
+    }
+    const auto val = input.readAll();
+    if (val.trimmed().isEmpty()) {
+        std::printf("%s\n%s\n", "You need to pass stdin some json, with structure like this:", defaultVal.toLocal8Bit().data());
+        return 1;
+    }
 
-    return out.save(argv[1]) ? 0 : 6;
+    // only ever one sticker here, so this thread records it if tracing's on
+    const auto tracing = RenderTrace::enabled();
+    if (tracing) {
+        RenderTrace::begin();
+    }
+    RenderTrace::Stage parseStage("parse");
+    StickerRequest request;
+    if (const auto error = PayloadParser::parse(val, request)) {
+        std::printf("%s\n%s\n%s\n", error.message().toLocal8Bit().data(),
+                    "You need to pass stdin in some json, with structure like this:", defaultVal.toLocal8Bit().data());
+        return 1;
+    }
+    parseStage.finish();
+
+    const auto output = QString::fromLocal8Bit(outputFile);
+    const auto sticker = RenderCache::draw(request, output);
+    const auto &encoded = sticker.bytes;
+    if (tracing) {
+        const auto trace = RenderTrace::end();
+        QJsonObject record;
+        record["mode"] = QStringLiteral("oneshot");
+        record["ok"] = !encoded.isEmpty();
+        RenderTrace::write(record, trace);
+    }
+    if (encoded.isEmpty()) {
+        return 6;
+    }
+    // "-" or "fd:N" hands the bytes straight back to whoever started us, no temporary file needed
+    if (const auto fd = Encoder::streamFor(output); fd >= 0) {
+        return Encoder::writeStream(fd, encoded, sticker.width, sticker.height) ? 0 : 6;
+    }
+    return Encoder::writeFile(output, encoded) ? 0 : 6;
 }